@@ -38,6 +38,7 @@
 #include "hd-activate-views-dialog.h"
 #include "hd-backgrounds.h"
 #include "hd-change-background-dialog.h"
+#include "hd-raw-image.h"
 
 #define HD_GCONF_KEY_ACTIVE_VIEWS "/apps/osso/hildon-desktop/views/active"
 #define HD_DESKTOP_VIEWS_MAX 9
@@ -175,6 +176,29 @@ hd_activate_views_dialog_class_init (HDActivateViewsDialogClass *klass)
   g_type_class_add_private (klass, sizeof (HDActivateViewsDialogPrivate));
 }
 
+/* Loads the raw cached background @basename.raw if there is one, else
+ * @basename.png */
+static GdkPixbuf *
+load_background_thumbnail (const gchar  *basename,
+                           GError      **error)
+{
+  GdkPixbuf *pixbuf;
+  gchar *filename;
+
+  filename = g_strconcat (basename, ".raw", NULL);
+  pixbuf = hd_raw_image_load_thumbnail (filename, 125, 75, NULL);
+  g_free (filename);
+
+  if (pixbuf)
+    return pixbuf;
+
+  filename = g_strconcat (basename, ".png", NULL);
+  pixbuf = gdk_pixbuf_new_from_file_at_scale (filename, 125, 75, TRUE, error);
+  g_free (filename);
+
+  return pixbuf;
+}
+
 static void
 hd_activate_views_dialog_init (HDActivateViewsDialog *dialog)
 {
@@ -266,15 +290,15 @@ hd_activate_views_dialog_init (HDActivateViewsDialog *dialog)
 
       if (hd_change_background_dialog_is_portrait () 
             && hd_backgrounds_is_portrait_wallpaper_enabled (hd_backgrounds_get ()))
-        bg_image = g_strdup_printf ("%s/.backgrounds/background_portrait-%u.png",
+        bg_image = g_strdup_printf ("%s/.backgrounds/background_portrait-%u",
                                     g_get_home_dir (),
                                     i);
       else
-        bg_image = g_strdup_printf ("%s/.backgrounds/background-%u.png",
+        bg_image = g_strdup_printf ("%s/.backgrounds/background-%u",
                                     g_get_home_dir (),
                                     i);        
 
-      pixbuf = gdk_pixbuf_new_from_file_at_scale (bg_image, 125, 75, TRUE, &error);
+      pixbuf = load_background_thumbnail (bg_image, &error);
 
       if (error)
         {
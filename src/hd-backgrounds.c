@@ -38,6 +38,8 @@
 
 #include <libgnomevfs/gnome-vfs.h>
 
+#include <errno.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "hd-background-info.h"
@@ -45,12 +47,21 @@
 #include "hd-desktop.h"
 #include "hd-file-background.h"
 #include "hd-pixbuf-utils.h"
+#include "hd-raw-image.h"
 
 #include "hd-backgrounds.h"
 
 #define CACHED_DIR        ".backgrounds"
 #define BACKGROUND_CACHED_PNG CACHED_DIR "/background-%u.png"
 #define BACKGROUND_CACHED_PNG_PORTRAIT CACHED_DIR "/background_portrait-%u.png"
+#define BACKGROUND_CACHED_RAW CACHED_DIR "/background-%u.raw"
+#define BACKGROUND_CACHED_RAW_PORTRAIT CACHED_DIR "/background_portrait-%u.raw"
+
+/* Cached images are hard links to entries of the store, named after their key */
+#define CACHE_STORE_DIR   CACHED_DIR "/store"
+#define CACHE_STORE_PNG   CACHE_STORE_DIR "/%s.png"
+#define CACHE_STORE_RAW   CACHE_STORE_DIR "/%s.raw"
+#define CACHE_CROP_MODE   "scale-and-crop"
 
 #define GCONF_KEY_PORTRAIT_WALLPAPER "/apps/osso/hildon-desktop/portrait_wallpaper"
 
@@ -68,6 +79,16 @@
 #define BACKGROUNDS_DESKTOP_KEY_FILE "X-File%u"
 #define BACKGROUNDS_DESKTOP_KEY_FILE_PORTRAIT "X-Portrait-File%u"
 
+/* Cached image creation, see home.conf */
+#define HOME_CONF_FILE            HD_DESKTOP_CONFIG_PATH "/home.conf"
+#define BACKGROUNDS_GROUP         "Backgrounds"
+#define BACKGROUNDS_KEY_WORKERS   "workers"
+#define BACKGROUNDS_KEY_RAW_CACHE "raw-cache"
+#define MAX_WORKERS               4
+
+/* Thread pool key of the cached image validation, views use 1..HD_DESKTOP_VIEWS*2 */
+#define VALIDATE_KEY              (HD_DESKTOP_VIEWS * 2 + 1)
+
 #define HD_BACKGROUNDS_GET_PRIVATE(object) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_BACKGROUNDS, HDBackgroundsPrivate))
 
@@ -96,11 +117,20 @@ struct _HDBackgroundsPrivate
   /* Theme change support */
   gchar *current_theme;
   guint set_theme_idle_id;
+  GTimer *theme_timer;
 
   GVolumeMonitor *volume_monitor;
   GnomeVFSVolumeMonitor *volume_monitor2;
 
   gboolean portrait_wallpaper;
+
+  /* Settings from home.conf */
+  guint max_workers;
+  gboolean raw_cache;
+
+  /* Store entries which are being created, protected by store_mutex */
+  GHashTable *store_keys;
+  GCond *store_cond;
 };
 
 static CacheImageRequestData *cache_image_request_data_new (GFile        *file,
@@ -110,73 +140,288 @@ static void cache_image_request_data_free (CacheImageRequestData *data);
 
 static gboolean remove_request (CacheImageRequestData *request);
 
+static GFile *get_background_for_view (HDBackgrounds *backgrounds,
+                                      guint          view);
+
 G_DEFINE_TYPE (HDBackgrounds, hd_backgrounds, G_TYPE_OBJECT);
 
+/* Serializes GConf writes of the worker threads */
+static GStaticMutex gconf_mutex = G_STATIC_MUTEX_INIT;
+static GStaticMutex store_mutex = G_STATIC_MUTEX_INIT;
+
+/* Views of a batch whose cached images are validated together */
+typedef struct
+{
+  guint view;
+  GFile *file;
+
+  /* Background of the view in GConf when the batch was queued, the view
+   * is skipped if the user changed it meanwhile */
+  GFile *configured_file;
+
+  /* Snapshot of the background info, taken in the main thread */
+  GFile *cached_file;
+  char *cached_etag;
+
+  /* Set by the worker thread */
+  char *etag;
+  gboolean outdated;
+} ValidateView;
+
+typedef struct
+{
+  HDBackgrounds *backgrounds;
+  ValidateView *views;
+  guint n_views;
+  gboolean error_dialogs;
+  gboolean update_gconf;
+  GSourceFunc done_callback;
+} ValidateData;
+
 static void
-create_cached_background (HDBackgrounds *backgrounds,
-                          GFile         *image_file,
-                          guint          view,
-                          gboolean       error_dialogs,
-                          gboolean       update_gconf)
+validate_data_free (ValidateData *data)
 {
-  HDBackgroundsPrivate *priv = backgrounds->priv;
-  GFile *current_file;
-  const char *current_etag;
-  gboolean create_cached_background = TRUE;
-
-  current_file = hd_background_info_get_file (priv->info,
-                                              view);
-  current_etag = hd_background_info_get_etag (priv->info,
-                                              view);
-
-  if (current_file &&
-      current_etag &&
-      g_file_equal (current_file,
-                    image_file))
+  guint i;
+
+  for (i = 0; i < data->n_views; i++)
     {
-      GFileInfo *info;
-      const char *etag;
-      GError *error = NULL;
+      ValidateView *v = &data->views[i];
+
+      g_object_unref (v->file);
+      if (v->configured_file)
+        g_object_unref (v->configured_file);
+      if (v->cached_file)
+        g_object_unref (v->cached_file);
+      g_free (v->cached_etag);
+      g_free (v->etag);
+    }
 
-      info = g_file_query_info (image_file,
-                                G_FILE_ATTRIBUTE_ETAG_VALUE,
-                                G_FILE_QUERY_INFO_NONE,
-                                NULL,
-                                &error);
+  g_free (data->views);
+  g_slice_free (ValidateData, data);
+}
 
-      if (error)
+/*
+ * Runs in a worker thread. Marks the views whose cached image is not
+ * made from the current version of their file. Each file of the batch
+ * is only queried once.
+ */
+static void
+validate_command (ValidateData *data)
+{
+  guint i, j, queried = 0;
+
+  for (i = 0; i < data->n_views; i++)
+    {
+      ValidateView *v = &data->views[i];
+      gboolean found = FALSE;
+
+      if (!v->cached_file ||
+          !v->cached_etag ||
+          !g_file_equal (v->cached_file, v->file))
         {
-          g_debug ("%s. Could not get etag value. %s",
-                   __FUNCTION__,
-                   error->message);
-          g_error_free (error);
+          v->outdated = TRUE;
+          continue;
         }
 
-      if (info)
+      for (j = 0; j < i && !found; j++)
         {
-          etag = g_file_info_get_etag (info);
+          ValidateView *other = &data->views[j];
 
-          create_cached_background = g_strcmp0 (current_etag, etag) != 0;
+          if (other->etag && g_file_equal (other->file, v->file))
+            {
+              v->etag = g_strdup (other->etag);
+              found = TRUE;
+            }
+        }
 
-          g_object_unref (info);
+      if (!found)
+        {
+          GFileInfo *info;
+          GError *error = NULL;
+
+          info = g_file_query_info (v->file,
+                                    G_FILE_ATTRIBUTE_ETAG_VALUE,
+                                    G_FILE_QUERY_INFO_NONE,
+                                    NULL,
+                                    &error);
+          queried++;
+
+          if (error)
+            {
+              g_debug ("%s. Could not get etag value. %s",
+                       __FUNCTION__,
+                       error->message);
+              g_error_free (error);
+            }
+
+          if (info)
+            {
+              v->etag = g_strdup (g_file_info_get_etag (info));
+              g_object_unref (info);
+            }
         }
+
+      v->outdated = g_strcmp0 (v->cached_etag, v->etag) != 0;
     }
 
-  if (create_cached_background)
+  g_debug ("%s. Validated %u views with %u queries",
+           __FUNCTION__,
+           data->n_views,
+           queried);
+}
+
+/*
+ * Returns FALSE if the background of the view in GConf changed since the
+ * batch was queued. A cached image made now would supersede or
+ * overwrite the one of the newer background.
+ */
+static gboolean
+background_unchanged (HDBackgrounds *backgrounds,
+                      ValidateView  *v)
+{
+  GFile *current;
+  gboolean unchanged;
+
+  current = get_background_for_view (backgrounds, v->view);
+
+  unchanged = current && v->configured_file &&
+              g_file_equal (current, v->configured_file);
+
+  if (!unchanged)
+    g_debug ("%s. Background of view %u changed while validating, skipped",
+             __FUNCTION__,
+             v->view);
+
+  if (current)
+    g_object_unref (current);
+
+  return unchanged;
+}
+
+/* Runs in the main loop once the batch is validated */
+static gboolean
+validate_done (ValidateData *data)
+{
+  HDBackgroundsPrivate *priv = data->backgrounds->priv;
+  guint i;
+
+  for (i = 0; i < data->n_views; i++)
     {
+      ValidateView *v = &data->views[i];
       HDBackground *background;
-      GCancellable *cancellable = g_cancellable_new ();
+      GCancellable *cancellable;
+
+      if (!v->outdated || !background_unchanged (data->backgrounds, v))
+        continue;
 
-      background = hd_file_background_new (image_file);
+      background = hd_file_background_new (v->file);
+      cancellable = g_cancellable_new ();
 
       hd_file_background_set_for_view_full (HD_FILE_BACKGROUND (background),
-                                            view,
+                                            v->view,
                                             cancellable,
-                                            error_dialogs,
-                                            update_gconf);
+                                            data->error_dialogs,
+                                            data->update_gconf);
 
       g_object_unref (cancellable);
+      g_object_unref (background);
+    }
+
+  if (data->done_callback)
+    hd_command_thread_pool_push_idle (priv->thread_pool,
+                                      G_PRIORITY_HIGH_IDLE,
+                                      data->done_callback,
+                                      NULL,
+                                      NULL);
+
+  return FALSE;
+}
+
+/*
+ * Creates the cached images of @views from @files, in that order, unless
+ * they are made from the current version of the file already. The files
+ * are queried in a worker thread. @done_callback is added as idle once
+ * the cached images are created. Views without file are skipped.
+ */
+static void
+create_cached_backgrounds (HDBackgrounds  *backgrounds,
+                           const guint    *views,
+                           GFile         **files,
+                           guint           n_views,
+                           gboolean        error_dialogs,
+                           gboolean        update_gconf,
+                           GSourceFunc     done_callback)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  ValidateData *data;
+  guint i;
+
+  data = g_slice_new0 (ValidateData);
+  data->backgrounds = backgrounds;
+  data->views = g_new0 (ValidateView, n_views);
+  data->error_dialogs = error_dialogs;
+  data->update_gconf = update_gconf;
+  data->done_callback = done_callback;
+
+  for (i = 0; i < n_views; i++)
+    {
+      ValidateView *v = &data->views[data->n_views];
+      GFile *cached_file;
+
+      if (!files[i])
+        continue;
+
+      v->view = views[i];
+      v->file = g_object_ref (files[i]);
+
+      /* GConf is only updated by the jobs of a theme change */
+      if (update_gconf)
+        v->configured_file = get_background_for_view (backgrounds,
+                                                      views[i]);
+      else
+        v->configured_file = g_object_ref (files[i]);
+
+      cached_file = hd_background_info_get_file (priv->info,
+                                                 views[i]);
+      if (cached_file)
+        v->cached_file = g_object_ref (cached_file);
+      v->cached_etag = g_strdup (hd_background_info_get_etag (priv->info,
+                                                              views[i]));
+
+      data->n_views++;
     }
+
+  hd_command_thread_pool_push_full (priv->thread_pool,
+                                    VALIDATE_KEY,
+                                    G_PRIORITY_HIGH,
+                                    FALSE,
+                                    NULL,
+                                    (HDCommandCallback) validate_command,
+                                    data,
+                                    NULL);
+
+  hd_command_thread_pool_push_idle_for_key (priv->thread_pool,
+                                            VALIDATE_KEY,
+                                            G_PRIORITY_HIGH_IDLE,
+                                            (GSourceFunc) validate_done,
+                                            data,
+                                            (GDestroyNotify) validate_data_free);
+}
+
+static void
+create_cached_background (HDBackgrounds *backgrounds,
+                          GFile         *image_file,
+                          guint          view,
+                          gboolean       error_dialogs,
+                          gboolean       update_gconf)
+{
+  create_cached_backgrounds (backgrounds,
+                             &view,
+                             &image_file,
+                             1,
+                             error_dialogs,
+                             update_gconf,
+                             NULL);
 }
 
 static gboolean
@@ -349,7 +594,9 @@ background_info_loaded (HDBackgroundInfo *info,
 {
   HDBackgroundsPrivate *priv = backgrounds->priv;
   guint current_view, i;
-  GFile *bg_image;
+  GFile *files[HD_DESKTOP_VIEWS * 2];
+  guint views[HD_DESKTOP_VIEWS * 2];
+  guint n_views = 0;
   GError *error = NULL;
 
   hd_background_info_init_finish (info,
@@ -384,43 +631,44 @@ background_info_loaded (HDBackgroundInfo *info,
 
   current_view = CLAMP (current_view, 0, max - 1);
 
-  /* Update cache for current view */
-  bg_image = get_background_for_view (backgrounds,
-                                      current_view);
-  if (bg_image)
-    {
-      create_cached_background (backgrounds,
-                                bg_image,
-                                current_view,
-                                FALSE,
-                                FALSE);
-      g_object_unref (bg_image);
-    }
+  /* Update cache for current view first */
+  views[n_views] = current_view;
+  files[n_views++] = get_background_for_view (backgrounds,
+                                              current_view);
 
-  /* Update cache for other views */
   for (i = 0; i < max; i++)
     {
       if (i != current_view)
         {
-          bg_image = get_background_for_view (backgrounds,
-                                              i);
-          if (bg_image)
-            {
-              create_cached_background (backgrounds,
-                                        bg_image,
-                                        i,
-                                        FALSE,
-                                        FALSE);
-              g_object_unref (bg_image);
-            }
+          views[n_views] = i;
+          files[n_views++] = get_background_for_view (backgrounds,
+                                                      i);
         }
     }
+
+  create_cached_backgrounds (backgrounds,
+                             views,
+                             files,
+                             n_views,
+                             FALSE,
+                             FALSE,
+                             NULL);
+
+  for (i = 0; i < n_views; i++)
+    if (files[i])
+      g_object_unref (files[i]);
 }
 
+/* Called once the cached images of a new theme are created */
 static gboolean
-restart_hildon_home (gpointer data)
+theme_backgrounds_updated (gpointer data)
 {
-  gtk_main_quit ();
+  HDBackgroundsPrivate *priv = hd_backgrounds_get ()->priv;
+
+  g_debug ("%s. Backgrounds of theme %s updated in %.0f ms",
+           __FUNCTION__,
+           priv->current_theme,
+           g_timer_elapsed (priv->theme_timer, NULL) * 1000);
 
   return FALSE;
 }
@@ -459,7 +707,9 @@ update_backgrounds_from_theme (HDBackgrounds *backgrounds,
     max_value += HD_DESKTOP_VIEWS;
 
   GFile *bg_image[max_value];
-
+  GFile *files[max_value];
+  guint views[max_value];
+  guint n_views;
 
   current_theme = get_current_theme ();
   if (g_strcmp0 (priv->current_theme, current_theme) == 0)
@@ -473,6 +723,9 @@ update_backgrounds_from_theme (HDBackgrounds *backgrounds,
       priv->current_theme = current_theme;
     }
 
+  /* The theme is switched in place, only the cached images are updated */
+  g_timer_start (priv->theme_timer);
+
   key_file = g_key_file_new ();
   if (!g_key_file_load_from_file (key_file,
                                   backgrounds_desktop,
@@ -573,36 +826,33 @@ update_backgrounds_from_theme (HDBackgrounds *backgrounds,
   /* Set to 0..HD_DESKTOP_VIEWS */
   current_view--;
 
+  /* Update cache for current view first */
+  n_views = 0;
   if (current_view >= 0 && current_view < max_value)
-    create_cached_background (backgrounds,
-                              bg_image[current_view],
-                              current_view,
-                              FALSE,
-                              TRUE);
-
-
+    {
+      views[n_views] = current_view;
+      files[n_views++] = bg_image[current_view];
+    }
 
-  /* Update cache for other views */
   for (i = 0; i < max_value; i++)
     {
       if (i != current_view)
         {
-          create_cached_background (backgrounds,
-                                    bg_image[i],
-                                    i,
-                                    FALSE,
-                                    TRUE);
+          views[n_views] = i;
+          files[n_views++] = bg_image[i];
         }
     }
 
+  create_cached_backgrounds (backgrounds,
+                             views,
+                             files,
+                             n_views,
+                             FALSE,
+                             TRUE,
+                             theme_backgrounds_updated);
+
   for (i = 0; i < max_value; i++)
     g_object_unref (bg_image[i]);
-
-  hd_command_thread_pool_push_idle (priv->thread_pool,
-                                    G_PRIORITY_HIGH_IDLE,
-                                    restart_hildon_home,
-                                    NULL,
-                                    NULL);
 }
 
 static gboolean
@@ -664,7 +914,7 @@ hd_backgrounds_startup (HDBackgrounds *backgrounds)
                          backgrounds);
 
 
-  cached_dir = g_strdup_printf ("%s/" CACHED_DIR,
+  cached_dir = g_strdup_printf ("%s/" CACHE_STORE_DIR,
                                 g_get_home_dir ());
   if (g_mkdir_with_parents (cached_dir,
                             S_IRUSR | S_IWUSR | S_IXUSR |
@@ -836,6 +1086,48 @@ volume_pre_unmount_cb (GnomeVFSVolumeMonitor *monitor,
     }
 }
 
+/* Loads the [Backgrounds] settings from home.conf */
+static void
+load_settings (HDBackgrounds *backgrounds)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  GKeyFile *key_file;
+  GError *error = NULL;
+  glong online;
+
+  /* Defaults to one worker per CPU */
+  online = sysconf (_SC_NPROCESSORS_ONLN);
+  priv->max_workers = CLAMP (online, 1, MAX_WORKERS);
+  priv->raw_cache = FALSE;
+
+  key_file = g_key_file_new ();
+  if (g_key_file_load_from_file (key_file,
+                                 HOME_CONF_FILE,
+                                 G_KEY_FILE_NONE,
+                                 NULL))
+    {
+      gint value = g_key_file_get_integer (key_file,
+                                           BACKGROUNDS_GROUP,
+                                           BACKGROUNDS_KEY_WORKERS,
+                                           &error);
+      if (error)
+        g_clear_error (&error);
+      else
+        priv->max_workers = CLAMP (value, 1, MAX_WORKERS);
+
+      priv->raw_cache = g_key_file_get_boolean (key_file,
+                                                BACKGROUNDS_GROUP,
+                                                BACKGROUNDS_KEY_RAW_CACHE,
+                                                NULL);
+    }
+  g_key_file_free (key_file);
+
+  g_debug ("%s. Creating cached images in %u threads, raw cache: %d",
+           __FUNCTION__,
+           priv->max_workers,
+           priv->raw_cache);
+}
+
 static void
 hd_backgrounds_init (HDBackgrounds *backgrounds)
 {
@@ -848,7 +1140,17 @@ hd_backgrounds_init (HDBackgrounds *backgrounds)
 
   priv->requests = g_ptr_array_new ();
 
-  priv->thread_pool = hd_command_thread_pool_new ();
+  priv->store_keys = g_hash_table_new_full (g_str_hash,
+                                            g_str_equal,
+                                            g_free,
+                                            NULL);
+  priv->store_cond = g_cond_new ();
+
+  priv->theme_timer = g_timer_new ();
+
+  load_settings (backgrounds);
+
+  priv->thread_pool = hd_command_thread_pool_new_with_workers (priv->max_workers);
 
   priv->volume_monitor = g_volume_monitor_get ();
   g_signal_connect (priv->volume_monitor, "mount-pre-unmount",
@@ -896,6 +1198,9 @@ hd_backgrounds_dipose (GObject *object)
 
   priv->current_theme = (g_free (priv->current_theme), NULL);
 
+  if (priv->theme_timer)
+    priv->theme_timer = (g_timer_destroy (priv->theme_timer), NULL);
+
   G_OBJECT_CLASS (hd_backgrounds_parent_class)->dispose (object);
 }
 
@@ -957,8 +1262,45 @@ hd_backgrounds_get_background (HDBackgrounds *backgrounds,
                                       view);
 }
 
+/* Returns TRUE if @view shows the current desktop, in either orientation */
+static gboolean
+is_current_view (HDBackgrounds *backgrounds,
+                 gint           view)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  gint current_view;
+  GError *error = NULL;
+
+  if (view < 0)
+    return TRUE;
+
+  current_view = gconf_client_get_int (priv->gconf_client,
+                                       GCONF_CURRENT_DESKTOP_KEY,
+                                       &error);
+  if (error)
+    {
+      g_debug ("%s. Could not get current view. %s",
+               __FUNCTION__,
+               error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  return view % HD_DESKTOP_VIEWS == current_view - 1;
+}
+
+/*
+ * Runs @command in a worker thread. Commands for the same @view are run
+ * one after another, a command for all views (@view -1) after all
+ * commands added before it. Commands for the current view are started
+ * before the ones for other views. A command replaces the commands for
+ * its view which did not start yet and cancels @cancellable of the one
+ * which is running, so it should not be shared with other commands, see
+ * hd_backgrounds_job_cancellable_new().
+ */
 void
 hd_backgrounds_add_create_cached_image (HDBackgrounds     *backgrounds,
+                                        gint               view,
                                         GFile             *source_file,
                                         gboolean           error_dialogs,
                                         GCancellable      *cancellable,
@@ -979,16 +1321,86 @@ hd_backgrounds_add_create_cached_image (HDBackgrounds     *backgrounds,
   g_ptr_array_add (priv->requests,
                    request);
 
-  hd_command_thread_pool_push (priv->thread_pool,
-                               command,
-                               data,
-                               destroy_data);
+  /* Keys for views start after HD_COMMAND_THREAD_POOL_NO_KEY */
+  hd_command_thread_pool_push_full (priv->thread_pool,
+                                    view + 1,
+                                    is_current_view (backgrounds, view) ? G_PRIORITY_HIGH : G_PRIORITY_DEFAULT,
+                                    TRUE,
+                                    cancellable,
+                                    command,
+                                    data,
+                                    destroy_data);
 
-  hd_command_thread_pool_push_idle (priv->thread_pool,
-                                    G_PRIORITY_HIGH_IDLE,
-                                    (GSourceFunc) remove_request,
-                                    request,
-                                    (GDestroyNotify) cache_image_request_data_free);
+  hd_command_thread_pool_push_idle_for_key (priv->thread_pool,
+                                            view + 1,
+                                            G_PRIORITY_HIGH_IDLE,
+                                            (GSourceFunc) remove_request,
+                                            request,
+                                            (GDestroyNotify) cache_image_request_data_free);
+}
+
+/*
+ * Returns a new cancellable for one command of
+ * hd_backgrounds_add_create_cached_image() which is cancelled together
+ * with @cancellable. Superseding the command then does not cancel the
+ * other commands sharing @cancellable.
+ */
+GCancellable *
+hd_backgrounds_job_cancellable_new (GCancellable *cancellable)
+{
+  GCancellable *job_cancellable = g_cancellable_new ();
+
+  if (cancellable)
+    {
+      g_signal_connect_object (cancellable, "cancelled",
+                               G_CALLBACK (g_cancellable_cancel),
+                               job_cancellable,
+                               G_CONNECT_SWAPPED);
+
+      if (g_cancellable_is_cancelled (cancellable))
+        g_cancellable_cancel (job_cancellable);
+    }
+
+  return job_cancellable;
+}
+
+/* Removes the store entries no cached image links to anymore */
+static void
+prune_cache_store (void)
+{
+  gchar *store_dir;
+  GDir *dir;
+  const gchar *name;
+  GError *error = NULL;
+
+  store_dir = g_strdup_printf ("%s/" CACHE_STORE_DIR,
+                               g_get_home_dir ());
+
+  dir = g_dir_open (store_dir, 0, &error);
+  if (!dir)
+    {
+      g_debug ("%s. Could not open %s. %s",
+               __FUNCTION__,
+               store_dir,
+               error->message);
+      g_error_free (error);
+      g_free (store_dir);
+      return;
+    }
+
+  while ((name = g_dir_read_name (dir)))
+    {
+      gchar *filename;
+      struct stat buf;
+
+      filename = g_build_filename (store_dir, name, NULL);
+      if (!g_stat (filename, &buf) && buf.st_nlink < 2)
+        g_unlink (filename);
+      g_free (filename);
+    }
+
+  g_dir_close (dir);
+  g_free (store_dir);
 }
 
 static gboolean
@@ -1000,6 +1412,33 @@ remove_request (CacheImageRequestData *request)
   g_ptr_array_remove_fast (priv->requests,
                            request);
 
+  if (!priv->requests->len)
+    {
+      guint finished, dropped;
+      gint64 wait_avg, wait_max, duration_avg, duration_max;
+
+      hd_command_thread_pool_get_stats (priv->thread_pool,
+                                        &finished,
+                                        &dropped,
+                                        &wait_avg,
+                                        &wait_max,
+                                        &duration_avg,
+                                        &duration_max);
+
+      g_debug ("%s. Cached images created: %u, superseded: %u, "
+               "wait avg/max: %" G_GINT64_FORMAT "/%" G_GINT64_FORMAT " ms, "
+               "duration avg/max: %" G_GINT64_FORMAT "/%" G_GINT64_FORMAT " ms",
+               __FUNCTION__,
+               finished,
+               dropped,
+               wait_avg / 1000,
+               wait_max / 1000,
+               duration_avg / 1000,
+               duration_max / 1000);
+
+      prune_cache_store ();
+    }
+
   return FALSE;
 }
 
@@ -1049,39 +1488,353 @@ update_cache_info_file (HDBackgrounds *backgrounds,
                              NULL);
 }
 
-gboolean
-hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
-                                  GdkPixbuf      *pixbuf,
-                                  guint           view,
-                                  GFile          *source_file,
-                                  const char     *source_etag,
-                                  gboolean        error_dialogs,
-                                  gboolean        update_gconf,
-                                  GCancellable   *cancellable,
-                                  GError        **error)
+/* Returns the path of the cached PNG or raw image of @view */
+static char *
+get_cached_filename (guint    view,
+                     gboolean raw)
+{
+  if (view >= HD_DESKTOP_VIEWS)
+    return g_strdup_printf (raw ?
+                            "%s/" BACKGROUND_CACHED_RAW_PORTRAIT :
+                            "%s/" BACKGROUND_CACHED_PNG_PORTRAIT,
+                            g_get_home_dir (),
+                            (view - HD_DESKTOP_VIEWS) + 1);
+  else
+    return g_strdup_printf (raw ?
+                            "%s/" BACKGROUND_CACHED_RAW :
+                            "%s/" BACKGROUND_CACHED_PNG,
+                            g_get_home_dir (),
+                            view + 1);
+}
+
+static char *
+get_store_filename (const char *key,
+                    gboolean    raw)
+{
+  return g_strdup_printf (raw ?
+                          "%s/" CACHE_STORE_RAW :
+                          "%s/" CACHE_STORE_PNG,
+                          g_get_home_dir (),
+                          key);
+}
+
+/* Key of the store entry for version @etag of @file scaled and cropped to @size */
+static char *
+get_source_key (GFile       *file,
+                const char  *etag,
+                HDImageSize *size)
+{
+  GChecksum *checksum;
+  char *uri, *geometry, *key;
+
+  uri = g_file_get_uri (file);
+  geometry = g_strdup_printf ("%dx%d " CACHE_CROP_MODE,
+                              size->width,
+                              size->height);
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA1);
+  g_checksum_update (checksum, (const guchar *) uri, strlen (uri) + 1);
+  g_checksum_update (checksum, (const guchar *) etag, strlen (etag) + 1);
+  g_checksum_update (checksum, (const guchar *) geometry, -1);
+  key = g_strdup (g_checksum_get_string (checksum));
+
+  g_checksum_free (checksum);
+  g_free (geometry);
+  g_free (uri);
+
+  return key;
+}
+
+/* Key of the store entry for the pixels of @pixbuf */
+static char *
+get_pixbuf_key (GdkPixbuf *pixbuf)
+{
+  GChecksum *checksum;
+  const guchar *pixels;
+  gint width, height, n_channels, rowstride, y;
+  char *geometry, *key;
+
+  width = gdk_pixbuf_get_width (pixbuf);
+  height = gdk_pixbuf_get_height (pixbuf);
+  n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+
+  geometry = g_strdup_printf ("%dx%dx%d", width, height, n_channels);
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA1);
+  g_checksum_update (checksum, (const guchar *) geometry, strlen (geometry) + 1);
+
+  /* Sub pixbufs share the rowstride of their parent */
+  for (y = 0; y < height; y++)
+    g_checksum_update (checksum,
+                       pixels + y * rowstride,
+                       width * n_channels);
+
+  key = g_strdup (g_checksum_get_string (checksum));
+
+  g_checksum_free (checksum);
+  g_free (geometry);
+
+  return key;
+}
+
+/* Waits until no other thread creates the store entry @key */
+static void
+lock_store_key (HDBackgrounds *backgrounds,
+                const char    *key)
 {
   HDBackgroundsPrivate *priv = backgrounds->priv;
-  char *dest_filename;
-  GFile *dest_file;
-  GError *local_error = NULL;
+  GMutex *mutex = g_static_mutex_get_mutex (&store_mutex);
+
+  g_mutex_lock (mutex);
+  while (g_hash_table_lookup (priv->store_keys, key))
+    g_cond_wait (priv->store_cond, mutex);
+  g_hash_table_insert (priv->store_keys,
+                       g_strdup (key),
+                       GINT_TO_POINTER (TRUE));
+  g_mutex_unlock (mutex);
+}
+
+static void
+unlock_store_key (HDBackgrounds *backgrounds,
+                  const char    *key)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  GMutex *mutex = g_static_mutex_get_mutex (&store_mutex);
+
+  g_mutex_lock (mutex);
+  g_hash_table_remove (priv->store_keys, key);
+  g_cond_broadcast (priv->store_cond);
+  g_mutex_unlock (mutex);
+}
+
+/*
+ * Replaces @dest_filename by a hard link to @store_filename, or by a copy
+ * if the file system does not support links.
+ */
+static gboolean
+link_cached_file (const char  *store_filename,
+                  const char  *dest_filename,
+                  GError     **error)
+{
+  char *tmp_filename;
+  gboolean result = TRUE;
+
+  tmp_filename = g_strconcat (dest_filename, ".new", NULL);
+  g_unlink (tmp_filename);
+
+  if (link (store_filename, tmp_filename))
+    {
+      GFile *store_file, *tmp_file;
+
+      store_file = g_file_new_for_path (store_filename);
+      tmp_file = g_file_new_for_path (tmp_filename);
+
+      result = g_file_copy (store_file,
+                            tmp_file,
+                            G_FILE_COPY_OVERWRITE,
+                            NULL,
+                            NULL,
+                            NULL,
+                            error);
+
+      g_object_unref (store_file);
+      g_object_unref (tmp_file);
+    }
+
+  if (result && g_rename (tmp_filename, dest_filename))
+    {
+      int saved_errno = errno;
+
+      g_set_error (error,
+                   G_IO_ERROR,
+                   g_io_error_from_errno (saved_errno),
+                   "Could not rename %s: %s",
+                   tmp_filename,
+                   g_strerror (saved_errno));
+      result = FALSE;
+    }
+
+  /* rename () keeps both names if they are links to the same file */
+  g_unlink (tmp_filename);
+  g_free (tmp_filename);
+
+  return result;
+}
+
+/* Writes the store entry @key for @pixbuf unless it exists already */
+static gboolean
+store_cached_image (HDBackgrounds  *backgrounds,
+                    GdkPixbuf      *pixbuf,
+                    const char     *key,
+                    const char     *source_etag,
+                    GCancellable   *cancellable,
+                    GError        **error)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  char *filename;
+  GFile *file;
+  gboolean result = TRUE;
+
+  filename = get_store_filename (key, FALSE);
+  if (!g_file_test (filename, G_FILE_TEST_EXISTS))
+    {
+      file = g_file_new_for_path (filename);
+      result = hd_pixbuf_utils_save (file,
+                                     pixbuf,
+                                     "png",
+                                     cancellable,
+                                     error);
+      g_object_unref (file);
+    }
+  g_free (filename);
+
+  if (!result || !priv->raw_cache)
+    return result;
+
+  /* The raw image is optional */
+  filename = get_store_filename (key, TRUE);
+  if (!g_file_test (filename, G_FILE_TEST_EXISTS))
+    {
+      GError *local_error = NULL;
+
+      file = g_file_new_for_path (filename);
+      if (!hd_raw_image_save (file,
+                              pixbuf,
+                              source_etag,
+                              cancellable,
+                              &local_error))
+        {
+          g_debug ("%s. Could not save raw cached image. %s",
+                   __FUNCTION__,
+                   local_error->message);
+          g_error_free (local_error);
+          g_unlink (filename);
+        }
+      g_object_unref (file);
+    }
+  g_free (filename);
+
+  return TRUE;
+}
+
+/* Makes the cached images of @view refer to the store entry @key */
+static gboolean
+link_cached_image (HDBackgrounds  *backgrounds,
+                   const char     *key,
+                   guint           view,
+                   GError        **error)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  char *store_filename, *dest_filename;
+  gboolean result;
+
+  store_filename = get_store_filename (key, FALSE);
+  dest_filename = get_cached_filename (view, FALSE);
+  result = link_cached_file (store_filename, dest_filename, error);
+  g_free (store_filename);
+  g_free (dest_filename);
+
+  if (!result)
+    return FALSE;
+
+  /* A stale raw image must not stay around */
+  store_filename = get_store_filename (key, TRUE);
+  dest_filename = get_cached_filename (view, TRUE);
+
+  if (priv->raw_cache &&
+      g_file_test (store_filename, G_FILE_TEST_EXISTS))
+    {
+      GError *local_error = NULL;
 
-  /* Create the file objects for the cached background image */
-  if(view >= HD_DESKTOP_VIEWS)
-    dest_filename = g_strdup_printf ("%s/" BACKGROUND_CACHED_PNG_PORTRAIT,
-                                     g_get_home_dir (),
-                                     (view - HD_DESKTOP_VIEWS) + 1);
+      if (!link_cached_file (store_filename, dest_filename, &local_error))
+        {
+          g_debug ("%s. Could not link raw cached image. %s",
+                   __FUNCTION__,
+                   local_error->message);
+          g_error_free (local_error);
+          g_unlink (dest_filename);
+        }
+    }
   else
-    dest_filename = g_strdup_printf ("%s/" BACKGROUND_CACHED_PNG,
-                                     g_get_home_dir (),
-                                     view + 1);
-  dest_file = g_file_new_for_path (dest_filename);
-
-  /* Create the cached background image */
-  if (!hd_pixbuf_utils_save (dest_file,
-                             pixbuf,
-                             "png",
-                             cancellable,
-                             &local_error))
+    g_unlink (dest_filename);
+
+  g_free (store_filename);
+  g_free (dest_filename);
+
+  return TRUE;
+}
+
+/* Records @source_file as background of @view in the cache info and GConf */
+static void
+cached_image_updated (HDBackgrounds *backgrounds,
+                      guint          view,
+                      GFile         *source_file,
+                      const char    *source_etag,
+                      gboolean       update_gconf)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  gchar *gconf_key, *path;
+  GError *error = NULL;
+
+  update_cache_info_file (backgrounds,
+                          view,
+                          source_file,
+                          source_etag);
+
+  if (!update_gconf)
+    return;
+
+  path = g_file_get_path (source_file);
+
+  /* Store background to GConf */
+  gconf_key = g_strdup_printf (GCONF_BACKGROUND_KEY, view + 1);
+  g_static_mutex_lock (&gconf_mutex);
+  gconf_client_set_string (priv->gconf_client,
+                           gconf_key,
+                           path,
+                           &error);
+  g_static_mutex_unlock (&gconf_mutex);
+
+  if (error)
+    {
+      g_debug ("%s. Could not set background in GConf for view %u. %s",
+               __FUNCTION__,
+               view,
+               error->message);
+      g_error_free (error);
+    }
+
+  g_free (gconf_key);
+  g_free (path);
+}
+
+/* Saves @pixbuf as store entry @key and links the cached images of @view to it */
+static gboolean
+save_cached_image (HDBackgrounds  *backgrounds,
+                   GdkPixbuf      *pixbuf,
+                   const char     *key,
+                   guint           view,
+                   GFile          *source_file,
+                   const char     *source_etag,
+                   gboolean        error_dialogs,
+                   gboolean        update_gconf,
+                   GCancellable   *cancellable,
+                   GError        **error)
+{
+  GError *local_error = NULL;
+
+  if (!store_cached_image (backgrounds,
+                           pixbuf,
+                           key,
+                           source_etag,
+                           cancellable,
+                           &local_error) ||
+      !link_cached_image (backgrounds,
+                          key,
+                          view,
+                          &local_error))
     {
       /* Display not enough space notification banner */
       if (error_dialogs &&
@@ -1091,9 +1844,11 @@ hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
                                  "sfil_ni_not_enough_memory"));
         }
 
-      g_warning ("%s. Could not save cached image. %s",
-                 __FUNCTION__,
-                 local_error->message);
+      /* A superseded command is cancelled */
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_warning ("%s. Could not save cached image. %s",
+                   __FUNCTION__,
+                   local_error->message);
 
       g_propagate_error (error,
                          local_error);
@@ -1101,42 +1856,193 @@ hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
       return FALSE;
     }
 
-  g_free (dest_filename);
-  g_object_unref (dest_file);
+  cached_image_updated (backgrounds,
+                        view,
+                        source_file,
+                        source_etag,
+                        update_gconf);
 
-  update_cache_info_file (backgrounds,
-                          view,
-                          source_file,
-                          source_etag);
+  return TRUE;
+}
+
+/*
+ * Saves @pixbuf as cached image of @view. Views with identical pixels
+ * share one store entry.
+ */
+gboolean
+hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
+                                  GdkPixbuf      *pixbuf,
+                                  guint           view,
+                                  GFile          *source_file,
+                                  const char     *source_etag,
+                                  gboolean        error_dialogs,
+                                  gboolean        update_gconf,
+                                  GCancellable   *cancellable,
+                                  GError        **error)
+{
+  char *key;
+  gboolean result;
+
+  key = get_pixbuf_key (pixbuf);
+
+  lock_store_key (backgrounds, key);
+  result = save_cached_image (backgrounds,
+                              pixbuf,
+                              key,
+                              view,
+                              source_file,
+                              source_etag,
+                              error_dialogs,
+                              update_gconf,
+                              cancellable,
+                              error);
+  unlock_store_key (backgrounds, key);
+
+  g_free (key);
+
+  return result;
+}
 
-  /* Update GConf if requested */
-  if (update_gconf)
+/*
+ * Creates the cached image of @view from @source_file scaled and cropped
+ * to @size. Views showing the same version of a file at the same size
+ * share one store entry, the file is decoded only for the first of them.
+ */
+gboolean
+hd_backgrounds_create_cached_image (HDBackgrounds  *backgrounds,
+                                    guint           view,
+                                    GFile          *source_file,
+                                    HDImageSize    *size,
+                                    gboolean        error_dialogs,
+                                    gboolean        update_gconf,
+                                    GCancellable   *cancellable,
+                                    GError        **error)
+{
+  GFileInfo *info;
+  char *etag = NULL, *loaded_etag = NULL, *key = NULL;
+  GdkPixbuf *pixbuf = NULL;
+  gboolean result = FALSE;
+  GError *local_error = NULL;
+
+  info = g_file_query_info (source_file,
+                            G_FILE_ATTRIBUTE_ETAG_VALUE,
+                            G_FILE_QUERY_INFO_NONE,
+                            cancellable,
+                            NULL);
+  if (info)
     {
-      gchar *gconf_key, *path;
+      etag = g_strdup (g_file_info_get_etag (info));
+      g_object_unref (info);
+    }
 
-      path = g_file_get_path (source_file);
+  if (etag)
+    {
+      char *store_filename;
 
-      /* Store background to GConf */
-      gconf_key = g_strdup_printf (GCONF_BACKGROUND_KEY, view + 1);
-      gconf_client_set_string (priv->gconf_client,
-                               gconf_key,
-                               path,
-                               &local_error);
+      key = get_source_key (source_file, etag, size);
+      lock_store_key (backgrounds, key);
 
-      if (local_error)
+      store_filename = get_store_filename (key, FALSE);
+      if (g_file_test (store_filename, G_FILE_TEST_EXISTS))
         {
-          g_debug ("%s. Could not set background in GConf for view %u. %s",
-                   __FUNCTION__,
-                   view,
-                   local_error->message);
-          g_clear_error (&local_error);
+          if (link_cached_image (backgrounds,
+                                 key,
+                                 view,
+                                 &local_error))
+            {
+              g_debug ("%s. Reused cached image %s for view %u",
+                       __FUNCTION__,
+                       key,
+                       view);
+
+              cached_image_updated (backgrounds,
+                                    view,
+                                    source_file,
+                                    etag,
+                                    update_gconf);
+              result = TRUE;
+            }
+          else
+            {
+              g_debug ("%s. Could not reuse cached image %s. %s",
+                       __FUNCTION__,
+                       key,
+                       local_error->message);
+              g_clear_error (&local_error);
+            }
         }
+      g_free (store_filename);
 
-      g_free (gconf_key);
-      g_free (path);
+      if (result)
+        goto cleanup;
     }
 
-  return TRUE;
+  pixbuf = hd_pixbuf_utils_load_scaled_and_cropped (source_file,
+                                                    size,
+                                                    &loaded_etag,
+                                                    cancellable,
+                                                    &local_error);
+  if (local_error)
+    {
+      char *uri;
+
+      if (error_dialogs)
+        hd_backgrounds_report_corrupt_image (local_error);
+
+      uri = g_file_get_uri (source_file);
+      g_warning ("%s. Could not load pixbuf from file %s. %s",
+                 __FUNCTION__,
+                 uri,
+                 local_error->message);
+      g_free (uri);
+      g_propagate_error (error, local_error);
+      goto cleanup;
+    }
+
+  if (!pixbuf || g_cancellable_is_cancelled (cancellable))
+    goto cleanup;
+
+  /* The file changed after the key was computed */
+  if (key && g_strcmp0 (etag, loaded_etag))
+    {
+      unlock_store_key (backgrounds, key);
+      key = (g_free (key), NULL);
+    }
+
+  if (key)
+    result = save_cached_image (backgrounds,
+                                pixbuf,
+                                key,
+                                view,
+                                source_file,
+                                loaded_etag,
+                                error_dialogs,
+                                update_gconf,
+                                cancellable,
+                                error);
+  else
+    result = hd_backgrounds_save_cached_image (backgrounds,
+                                               pixbuf,
+                                               view,
+                                               source_file,
+                                               loaded_etag,
+                                               error_dialogs,
+                                               update_gconf,
+                                               cancellable,
+                                               error);
+
+cleanup:
+  if (key)
+    {
+      unlock_store_key (backgrounds, key);
+      g_free (key);
+    }
+  if (pixbuf)
+    g_object_unref (pixbuf);
+  g_free (etag);
+  g_free (loaded_etag);
+
+  return result;
 }
 
 void
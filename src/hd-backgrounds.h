@@ -26,6 +26,7 @@
 #include <gio/gio.h>
 
 #include "hd-command-thread-pool.h"
+#include "hd-pixbuf-utils.h"
 
 G_BEGIN_DECLS
 
@@ -64,12 +65,14 @@ void           hd_backgrounds_add_done_cb     (HDBackgrounds  *backgrounds,
                                                GDestroyNotify  destroy_data);
 
 void           hd_backgrounds_add_create_cached_image (HDBackgrounds      *backgrounds,
+                                                       gint                view,
                                                        GFile              *source_file,
                                                        gboolean            error_dialogs,
                                                        GCancellable       *cancellable,
                                                        HDCommandCallback   command,
                                                        gpointer            data,
                                                        GDestroyNotify      destroy_data);
+GCancellable  *hd_backgrounds_job_cancellable_new     (GCancellable       *cancellable);
 
 void           hd_backgrounds_add_update_current_files (HDBackgrounds  *backgrounds,
                                                         GFile         **files,
@@ -90,6 +93,14 @@ gboolean       hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
                                                  gboolean        update_gconf,
                                                  GCancellable   *cancellable,
                                                  GError        **error);
+gboolean       hd_backgrounds_create_cached_image (HDBackgrounds  *backgrounds,
+                                                   guint           view,
+                                                   GFile          *source_file,
+                                                   HDImageSize    *size,
+                                                   gboolean        error_dialogs,
+                                                   gboolean        update_gconf,
+                                                   GCancellable   *cancellable,
+                                                   GError        **error);
 void hd_backgrounds_report_corrupt_image        (const GError   *error);
 
 gboolean hd_backgrounds_is_portrait_wallpaper_enabled (HDBackgrounds *backgrounds);
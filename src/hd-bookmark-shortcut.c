@@ -515,6 +515,27 @@ hd_bookmark_shortcut_expose_event (GtkWidget *widget,
                                                                              event);
 }
 
+/* Takes the theme images from the surface cache */
+static void
+load_theme_images (HDBookmarkShortcut *applet)
+{
+  HDBookmarkShortcutPrivate *priv = applet->priv;
+
+  if (priv->bg_image)
+    cairo_surface_destroy (priv->bg_image);
+  if (priv->bg_active)
+    cairo_surface_destroy (priv->bg_active);
+  if (priv->thumb_mask)
+    cairo_surface_destroy (priv->thumb_mask);
+
+  priv->bg_image = hd_cairo_surface_cache_get_surface (hd_cairo_surface_cache_get (),
+                                                       BACKGROUND_IMAGE_FILE);
+  priv->bg_active = hd_cairo_surface_cache_get_surface (hd_cairo_surface_cache_get (),
+                                                        BACKGROUND_ACTIVE_IMAGE_FILE);
+  priv->thumb_mask = hd_cairo_surface_cache_get_surface (hd_cairo_surface_cache_get (),
+                                                         THUMBNAIL_MASK_FILE);
+}
+
 static void
 hd_bookmark_shortcut_style_set (GtkWidget *widget,
                                 GtkStyle  *previous_style)
@@ -524,6 +545,13 @@ hd_bookmark_shortcut_style_set (GtkWidget *widget,
   if (priv->default_thumbnail_icon)
     priv->default_thumbnail_icon = (cairo_surface_destroy (priv->default_thumbnail_icon), NULL);
 
+  /* The theme changed */
+  if (previous_style)
+    {
+      load_theme_images (HD_BOOKMARK_SHORTCUT (widget));
+      gtk_widget_queue_draw (widget);
+    }
+
   if (GTK_WIDGET_CLASS (hd_bookmark_shortcut_parent_class)->style_set)
     GTK_WIDGET_CLASS (hd_bookmark_shortcut_parent_class)->style_set (widget,
                                                                      previous_style);
@@ -658,12 +686,7 @@ hd_bookmark_shortcut_init (HDBookmarkShortcut *applet)
   g_signal_connect (applet, "delete-event",
                     G_CALLBACK (delete_event_cb), applet);
 
-  priv->bg_image = hd_cairo_surface_cache_get_surface (hd_cairo_surface_cache_get (),
-                                                       BACKGROUND_IMAGE_FILE);
-  priv->bg_active = hd_cairo_surface_cache_get_surface (hd_cairo_surface_cache_get (),
-                                                        BACKGROUND_ACTIVE_IMAGE_FILE);
-  priv->thumb_mask = hd_cairo_surface_cache_get_surface (hd_cairo_surface_cache_get (),
-                                                         THUMBNAIL_MASK_FILE);
+  load_theme_images (applet);
 
   priv->gconf_client = gconf_client_get_default ();
 }
@@ -197,6 +197,17 @@ hd_bookmark_widgets_bookmark_files_changed (GnomeVFSMonitorHandle *handle,
                                                 user_data);
 }
 
+static void
+hd_bookmark_widgets_icon_theme_changed (HDBookmarkWidgets *widgets)
+{
+  HDBookmarkWidgetsPrivate *priv = widgets->priv;
+
+  /* The default bookmark icons are from the icon theme */
+  if (!priv->parse_idle_id)
+    priv->parse_idle_id = gdk_threads_add_idle ((GSourceFunc) hd_bookmark_widgets_parse_bookmark_files,
+                                                widgets);
+}
+
 static void
 hd_bookmark_widgets_constructed (GObject *object)
 {
@@ -226,6 +237,9 @@ hd_bookmark_widgets_constructed (GObject *object)
   priv->parse_idle_id = gdk_threads_add_idle ((GSourceFunc) hd_bookmark_widgets_parse_bookmark_files,
                                               object);
 
+  g_signal_connect_swapped (gtk_icon_theme_get_default (), "changed",
+                            G_CALLBACK (hd_bookmark_widgets_icon_theme_changed), object);
+
   g_free (user_bookmarks);
   g_free (user_bookmarks_uri);
 }
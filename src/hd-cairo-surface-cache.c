@@ -121,3 +121,12 @@ hd_cairo_surface_cache_get_surface (HDCairoSurfaceCache *cache,
 
   return cairo_surface_reference (surface);
 }
+
+/* Drops all surfaces, references returned before stay valid */
+void
+hd_cairo_surface_cache_clear (HDCairoSurfaceCache *cache)
+{
+  HDCairoSurfaceCachePrivate *priv = cache->priv;
+
+  g_hash_table_remove_all (priv->table);
+}
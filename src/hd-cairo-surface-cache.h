@@ -60,6 +60,7 @@ GType                hd_cairo_surface_cache_get_type    (void);
 HDCairoSurfaceCache *hd_cairo_surface_cache_get         (void);
 cairo_surface_t *    hd_cairo_surface_cache_get_surface (HDCairoSurfaceCache *cache,
                                                          const gchar         *filename);
+void                 hd_cairo_surface_cache_clear       (HDCairoSurfaceCache *cache);
 
 G_END_DECLS
 
@@ -19,6 +19,26 @@
  *
  */
 
+
+/*
+ * Runs commands in worker threads.
+ *
+ * Each command has a key. Commands with the same key are run in the
+ * order they were pushed, one after another, commands with different
+ * keys may run at the same time. Commands with HD_COMMAND_THREAD_POOL_NO_KEY
+ * are run after all commands pushed before them finished and before
+ * any command pushed after them is started.
+ *
+ * Idle commands (hd_command_thread_pool_push_idle) do not need a worker,
+ * they just add an idle to the main loop once they may run.
+ *
+ * Of the commands which may run, the ones with the lowest priority
+ * value are started first. A command can supersede the commands with
+ * its key which did not start yet, these are dropped. A superseded
+ * command which is already running is cancelled through its
+ * GCancellable, if it has one.
+ */
+
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
@@ -35,10 +55,19 @@ typedef struct
   HDCommandCallback command;
   gpointer data;
   GDestroyNotify destroy_data;
+  GCancellable *cancellable;
+
+  guint key;
+  gint priority;
+  guint seq;
+  gboolean idle : 1;
+  gboolean running : 1;
+
+  gint64 push_time;
 } ThreadCommand;
 
-static void           thread_command_execute (ThreadCommand *thread_command,
-                                              gpointer       data);
+static void           thread_command_execute (ThreadCommand       *thread_command,
+                                              HDCommandThreadPool *pool);
 static ThreadCommand *thread_command_new     (HDCommandCallback command,
                                               gpointer          data,
                                               GDestroyNotify    destroy_data);
@@ -62,6 +91,21 @@ static void             idle_command_data_free (IdleCommandData *command_data);
 struct _HDCommandThreadPoolPrivate
 {
   GThreadPool *thread_pool;
+
+  /* Protects everything below */
+  GMutex *mutex;
+  /* Commands not finished yet in the order they were pushed */
+  GQueue *commands;
+  guint next_seq;
+  gboolean disposed;
+
+  /* Statistics in us */
+  guint finished;
+  guint dropped;
+  gint64 wait_total;
+  gint64 wait_max;
+  gint64 duration_total;
+  gint64 duration_max;
 };
 
 G_DEFINE_TYPE (HDCommandThreadPool, hd_command_thread_pool, G_TYPE_OBJECT);
@@ -73,25 +117,68 @@ hd_command_thread_pool_dipose (GObject *object)
 
   if (priv->thread_pool)
     {
+      g_mutex_lock (priv->mutex);
+      priv->disposed = TRUE;
+      g_mutex_unlock (priv->mutex);
+
       g_thread_pool_free (priv->thread_pool,
                           FALSE,
                           TRUE);
       priv->thread_pool = NULL;
+
+      /* Drop commands which were not started */
+      g_queue_foreach (priv->commands, (GFunc) thread_command_free, NULL);
+      g_queue_clear (priv->commands);
     }
 
   G_OBJECT_CLASS (hd_command_thread_pool_parent_class)->dispose (object);
 }
 
+static void
+hd_command_thread_pool_finalize (GObject *object)
+{
+  HDCommandThreadPoolPrivate *priv = HD_COMMAND_THREAD_POOL (object)->priv;
+
+  g_queue_free (priv->commands);
+  g_mutex_free (priv->mutex);
+
+  G_OBJECT_CLASS (hd_command_thread_pool_parent_class)->finalize (object);
+}
+
 static void
 hd_command_thread_pool_class_init (HDCommandThreadPoolClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
   object_class->dispose = hd_command_thread_pool_dipose;
+  object_class->finalize = hd_command_thread_pool_finalize;
 
   g_type_class_add_private (klass, sizeof (HDCommandThreadPoolPrivate));
 }
 
+/* Returns the current time in microseconds */
+static gint64
+get_time_us (void)
+{
+  GTimeVal tv;
+
+  g_get_current_time (&tv);
+
+  return (gint64) tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+}
+
+/* Orders the commands waiting for a worker */
+static gint
+thread_command_compare (ThreadCommand *a,
+                        ThreadCommand *b,
+                        gpointer       data)
+{
+  if (a->priority != b->priority)
+    return a->priority < b->priority ? -1 : 1;
+
+  return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
 static void
 hd_command_thread_pool_init (HDCommandThreadPool *command_thread_pool)
 {
@@ -100,18 +187,107 @@ hd_command_thread_pool_init (HDCommandThreadPool *command_thread_pool)
   priv = HD_COMMAND_THREAD_POOL_GET_PRIVATE (command_thread_pool);
   command_thread_pool->priv = priv;
 
-  priv->thread_pool = g_thread_pool_new ((GFunc) thread_command_execute,
-                                         NULL,
-                                         1,
-                                         FALSE,
-                                         NULL);
+  priv->mutex = g_mutex_new ();
+  priv->commands = g_queue_new ();
 }
 
+/* Starts all commands which may run now, called with the mutex locked */
 static void
-thread_command_execute (ThreadCommand *thread_command,
-                        gpointer       data)
+schedule_commands (HDCommandThreadPool *pool)
 {
+  HDCommandThreadPoolPrivate *priv = pool->priv;
+  GArray *busy_keys;
+  GList *l;
+
+  if (priv->disposed)
+    return;
+
+  busy_keys = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  l = priv->commands->head;
+  while (l)
+    {
+      ThreadCommand *thread_command = l->data;
+      GList *next = l->next;
+      gboolean blocked = FALSE;
+      guint i;
+
+      /* Everything after an unfinished command without key waits */
+      if (busy_keys->len &&
+          g_array_index (busy_keys, guint, busy_keys->len - 1) == HD_COMMAND_THREAD_POOL_NO_KEY)
+        break;
+
+      if (thread_command->key == HD_COMMAND_THREAD_POOL_NO_KEY)
+        blocked = busy_keys->len > 0;
+      else
+        for (i = 0; i < busy_keys->len && !blocked; i++)
+          blocked = g_array_index (busy_keys, guint, i) == thread_command->key;
+
+      if (!blocked && !thread_command->running && thread_command->idle)
+        {
+          /* Idle commands finish immediately */
+          g_queue_delete_link (priv->commands, l);
+          thread_command->command (thread_command->data);
+          thread_command_free (thread_command);
+        }
+      else
+        {
+          if (!blocked && !thread_command->running)
+            {
+              GError *error = NULL;
+
+              thread_command->running = TRUE;
+              g_thread_pool_push (priv->thread_pool,
+                                  thread_command,
+                                  &error);
+
+              if (error)
+                {
+                  g_debug ("%s. Error: %s", __FUNCTION__, error->message);
+                  g_error_free (error);
+                }
+            }
+
+          g_array_append_val (busy_keys, thread_command->key);
+        }
+
+      l = next;
+    }
+
+  g_array_free (busy_keys, TRUE);
+}
+
+static void
+thread_command_execute (ThreadCommand       *thread_command,
+                        HDCommandThreadPool *pool)
+{
+  HDCommandThreadPoolPrivate *priv = pool->priv;
+  gint64 start, wait, duration;
+
+  start = get_time_us ();
+
   thread_command->command (thread_command->data);
+
+  duration = get_time_us () - start;
+  wait = start - thread_command->push_time;
+
+  g_mutex_lock (priv->mutex);
+  g_queue_remove (priv->commands, thread_command);
+
+  priv->finished++;
+  priv->wait_total += wait;
+  priv->wait_max = MAX (priv->wait_max, wait);
+  priv->duration_total += duration;
+  priv->duration_max = MAX (priv->duration_max, duration);
+
+  schedule_commands (pool);
+  g_mutex_unlock (priv->mutex);
+
+  g_debug ("%s. Command waited %" G_GINT64_FORMAT " us, ran %" G_GINT64_FORMAT " us",
+           __FUNCTION__,
+           wait,
+           duration);
+
   thread_command_free (thread_command);
 }
 
@@ -120,7 +296,7 @@ thread_command_new (HDCommandCallback command,
                     gpointer          data,
                     GDestroyNotify    destroy_data)
 {
-  ThreadCommand *thread_command = g_slice_new (ThreadCommand);
+  ThreadCommand *thread_command = g_slice_new0 (ThreadCommand);
 
   thread_command->command = command;
   thread_command->data = data;
@@ -138,13 +314,119 @@ thread_command_free (ThreadCommand *thread_command)
   if (thread_command->destroy_data)
     thread_command->destroy_data (thread_command->data);
 
+  if (thread_command->cancellable)
+    g_object_unref (thread_command->cancellable);
+
   g_slice_free (ThreadCommand, thread_command);
 }
 
+static void
+push_command (HDCommandThreadPool *pool,
+              ThreadCommand       *thread_command,
+              gboolean             supersede)
+{
+  HDCommandThreadPoolPrivate *priv = pool->priv;
+  GSList *dropped = NULL, *cancelled = NULL;
+
+  thread_command->push_time = get_time_us ();
+
+  g_mutex_lock (priv->mutex);
+
+  /* Drop the commands with the same key which did not start yet and
+   * cancel the running one */
+  if (supersede)
+    {
+      GList *l = priv->commands->head;
+
+      while (l)
+        {
+          ThreadCommand *old = l->data;
+          GList *next = l->next;
+
+          if (old->key == thread_command->key &&
+              !old->idle)
+            {
+              if (!old->running)
+                {
+                  g_queue_delete_link (priv->commands, l);
+                  dropped = g_slist_prepend (dropped, old);
+                  priv->dropped++;
+                }
+              else if (old->cancellable)
+                cancelled = g_slist_prepend (cancelled,
+                                             g_object_ref (old->cancellable));
+            }
+
+          l = next;
+        }
+    }
+
+  thread_command->seq = priv->next_seq++;
+  g_queue_push_tail (priv->commands, thread_command);
+  schedule_commands (pool);
+
+  g_mutex_unlock (priv->mutex);
+
+  if (dropped)
+    {
+      g_debug ("%s. Dropped %u superseded commands",
+               __FUNCTION__,
+               g_slist_length (dropped));
+
+      g_slist_foreach (dropped, (GFunc) thread_command_free, NULL);
+      g_slist_free (dropped);
+    }
+
+  /* Outside of the lock, the handlers may push commands */
+  if (cancelled)
+    {
+      g_debug ("%s. Cancelled superseded running command", __FUNCTION__);
+
+      g_slist_foreach (cancelled, (GFunc) g_cancellable_cancel, NULL);
+      g_slist_foreach (cancelled, (GFunc) g_object_unref, NULL);
+      g_slist_free (cancelled);
+    }
+}
+
+/**
+ * hd_command_thread_pool_new:
+ *
+ * Creates a thread pool which runs one command at a time.
+ *
+ * Returns: a new #HDCommandThreadPool
+ */
 HDCommandThreadPool *
 hd_command_thread_pool_new (void)
 {
-  return g_object_new (HD_TYPE_COMMAND_THREAD_POOL, NULL);
+  return hd_command_thread_pool_new_with_workers (1);
+}
+
+/**
+ * hd_command_thread_pool_new_with_workers:
+ * @max_workers: the maximal number of commands run at the same time
+ *
+ * Creates a thread pool which runs commands with different keys in up
+ * to @max_workers threads.
+ *
+ * Returns: a new #HDCommandThreadPool
+ */
+HDCommandThreadPool *
+hd_command_thread_pool_new_with_workers (guint max_workers)
+{
+  HDCommandThreadPool *pool;
+
+  pool = g_object_new (HD_TYPE_COMMAND_THREAD_POOL, NULL);
+
+  pool->priv->thread_pool = g_thread_pool_new ((GFunc) thread_command_execute,
+                                               pool,
+                                               MAX (max_workers, 1),
+                                               FALSE,
+                                               NULL);
+  g_thread_pool_set_sort_function (pool->priv->thread_pool,
+                                   (GCompareDataFunc) thread_command_compare,
+                                   NULL);
+
+  return pool;
 }
 
 void
@@ -153,25 +435,81 @@ hd_command_thread_pool_push (HDCommandThreadPool *pool,
                              gpointer             data,
                              GDestroyNotify       destroy_data)
 {
-  HDCommandThreadPoolPrivate *priv;
-  GError *error = NULL;
+  hd_command_thread_pool_push_for_key (pool,
+                                       HD_COMMAND_THREAD_POOL_NO_KEY,
+                                       command,
+                                       data,
+                                       destroy_data);
+}
 
-  g_return_if_fail (HD_IS_COMMAND_THREAD_POOL (pool));
+/**
+ * hd_command_thread_pool_push_for_key:
+ * @pool: a #HDCommandThreadPool
+ * @key: commands with the same key are run in order
+ * @command: the function run in a worker thread
+ * @data: data passed to @command
+ * @destroy_data: called with @data after @command was run or dropped
+ *
+ * Runs @command in a worker thread after all commands with the same @key
+ * or without key which were pushed before.
+ */
+void
+hd_command_thread_pool_push_for_key (HDCommandThreadPool *pool,
+                                     guint                key,
+                                     HDCommandCallback    command,
+                                     gpointer             data,
+                                     GDestroyNotify       destroy_data)
+{
+  hd_command_thread_pool_push_full (pool,
+                                    key,
+                                    G_PRIORITY_DEFAULT,
+                                    FALSE,
+                                    NULL,
+                                    command,
+                                    data,
+                                    destroy_data);
+}
 
-  priv = pool->priv;
+/**
+ * hd_command_thread_pool_push_full:
+ * @pool: a #HDCommandThreadPool
+ * @key: commands with the same key are run in order
+ * @priority: commands with a lower value are started first
+ * @supersede: whether to drop the commands with @key which did not start yet
+ * @cancellable: cancelled when a superseding command is pushed while
+ * @command runs, or %NULL
+ * @command: the function run in a worker thread
+ * @data: data passed to @command
+ * @destroy_data: called with @data after @command was run or dropped
+ *
+ * Like hd_command_thread_pool_push_for_key(), but with a priority. If
+ * @supersede is set @command replaces older commands with the same @key,
+ * idle commands are kept. A replaced command which is running already
+ * is cancelled through its @cancellable.
+ */
+void
+hd_command_thread_pool_push_full (HDCommandThreadPool *pool,
+                                  guint                key,
+                                  gint                 priority,
+                                  gboolean             supersede,
+                                  GCancellable        *cancellable,
+                                  HDCommandCallback    command,
+                                  gpointer             data,
+                                  GDestroyNotify       destroy_data)
+{
+  ThreadCommand *thread_command;
 
-  ThreadCommand *thread_command = thread_command_new (command,
-                                                      data,
-                                                      destroy_data);
-  g_thread_pool_push (priv->thread_pool,
-                      thread_command,
-                      &error);
+  g_return_if_fail (HD_IS_COMMAND_THREAD_POOL (pool));
 
-  if (error)
-    {
-      g_debug ("%s. Error: %s", __FUNCTION__, error->message);
-      g_error_free (error);
-    }
+  thread_command = thread_command_new (command,
+                                       data,
+                                       destroy_data);
+  thread_command->key = key;
+  thread_command->priority = priority;
+  if (cancellable)
+    thread_command->cancellable = g_object_ref (cancellable);
+
+  push_command (pool, thread_command, supersede);
 }
 
 void
@@ -180,8 +518,38 @@ hd_command_thread_pool_push_idle (HDCommandThreadPool *pool,
                                   GSourceFunc          function,
                                   gpointer             data,
                                   GDestroyNotify       destroy_data)
+{
+  hd_command_thread_pool_push_idle_for_key (pool,
+                                            HD_COMMAND_THREAD_POOL_NO_KEY,
+                                            priority,
+                                            function,
+                                            data,
+                                            destroy_data);
+}
+
+/**
+ * hd_command_thread_pool_push_idle_for_key:
+ * @pool: a #HDCommandThreadPool
+ * @key: the key of the commands @function depends on
+ * @priority: the priority of the idle source
+ * @function: the function called in the main loop
+ * @data: data passed to @function
+ * @destroy_data: called with @data when the idle source is removed
+ *
+ * Adds @function as idle to the main loop once the commands with the
+ * same @key, or all commands if @key is %HD_COMMAND_THREAD_POOL_NO_KEY,
+ * which were pushed before are finished.
+ */
+void
+hd_command_thread_pool_push_idle_for_key (HDCommandThreadPool *pool,
+                                          guint                key,
+                                          gint                 priority,
+                                          GSourceFunc          function,
+                                          gpointer             data,
+                                          GDestroyNotify       destroy_data)
 {
   IdleCommandData *command_data;
+  ThreadCommand *thread_command;
 
   g_return_if_fail (HD_IS_COMMAND_THREAD_POOL (pool));
 
@@ -190,10 +558,58 @@ hd_command_thread_pool_push_idle (HDCommandThreadPool *pool,
                                         data,
                                         destroy_data);
 
-  hd_command_thread_pool_push (pool,
-                               (HDCommandCallback) idle_command_execute,
-                               command_data,
-                               (GDestroyNotify) idle_command_data_free);
+  thread_command = thread_command_new ((HDCommandCallback) idle_command_execute,
+                                       command_data,
+                                       (GDestroyNotify) idle_command_data_free);
+  thread_command->key = key;
+  thread_command->idle = TRUE;
+
+  push_command (pool, thread_command, FALSE);
+}
+
+/**
+ * hd_command_thread_pool_get_stats:
+ * @pool: a #HDCommandThreadPool
+ * @finished: return location for the number of commands run, or %NULL
+ * @dropped: return location for the number of superseded commands, or %NULL
+ * @wait_avg: return location for the average time in us a command waited, or %NULL
+ * @wait_max: return location for the longest time in us a command waited, or %NULL
+ * @duration_avg: return location for the average run time in us, or %NULL
+ * @duration_max: return location for the longest run time in us, or %NULL
+ *
+ * Returns statistics about the commands run in worker threads.
+ */
+void
+hd_command_thread_pool_get_stats (HDCommandThreadPool *pool,
+                                  guint               *finished,
+                                  guint               *dropped,
+                                  gint64              *wait_avg,
+                                  gint64              *wait_max,
+                                  gint64              *duration_avg,
+                                  gint64              *duration_max)
+{
+  HDCommandThreadPoolPrivate *priv;
+
+  g_return_if_fail (HD_IS_COMMAND_THREAD_POOL (pool));
+
+  priv = pool->priv;
+
+  g_mutex_lock (priv->mutex);
+
+  if (finished)
+    *finished = priv->finished;
+  if (dropped)
+    *dropped = priv->dropped;
+  if (wait_avg)
+    *wait_avg = priv->finished ? priv->wait_total / priv->finished : 0;
+  if (wait_max)
+    *wait_max = priv->wait_max;
+  if (duration_avg)
+    *duration_avg = priv->finished ? priv->duration_total / priv->finished : 0;
+  if (duration_max)
+    *duration_max = priv->duration_max;
+
+  g_mutex_unlock (priv->mutex);
 }
 
 static IdleCommandData *
@@ -229,4 +645,3 @@ idle_command_data_free (IdleCommandData *command_data)
 
   g_slice_free (IdleCommandData, command_data);
 }
-
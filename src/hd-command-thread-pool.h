@@ -24,6 +24,7 @@
 
 #include <glib.h>
 #include <glib-object.h>
+#include <gio/gio.h>
 
 G_BEGIN_DECLS
 
@@ -52,19 +53,50 @@ struct _HDCommandThreadPoolClass
 
 typedef void (*HDCommandCallback) (gpointer data);
 
-GType                hd_command_thread_pool_get_type  (void);
+/* Commands without key are ordered with respect to all other commands */
+#define HD_COMMAND_THREAD_POOL_NO_KEY 0
 
-HDCommandThreadPool *hd_command_thread_pool_new       (void);
+GType                hd_command_thread_pool_get_type          (void);
 
-void                 hd_command_thread_pool_push      (HDCommandThreadPool *pool,
-                                                       HDCommandCallback    command,
-                                                       gpointer             data,
-                                                       GDestroyNotify       destroy_data);
-void                 hd_command_thread_pool_push_idle (HDCommandThreadPool *pool,
-                                                       gint                 priority,
-                                                       GSourceFunc          function,
-                                                       gpointer             data,
-                                                       GDestroyNotify       destroy_data);
+HDCommandThreadPool *hd_command_thread_pool_new               (void);
+HDCommandThreadPool *hd_command_thread_pool_new_with_workers  (guint                max_workers);
+
+void                 hd_command_thread_pool_push              (HDCommandThreadPool *pool,
+                                                               HDCommandCallback    command,
+                                                               gpointer             data,
+                                                               GDestroyNotify       destroy_data);
+void                 hd_command_thread_pool_push_for_key      (HDCommandThreadPool *pool,
+                                                               guint                key,
+                                                               HDCommandCallback    command,
+                                                               gpointer             data,
+                                                               GDestroyNotify       destroy_data);
+void                 hd_command_thread_pool_push_full         (HDCommandThreadPool *pool,
+                                                               guint                key,
+                                                               gint                 priority,
+                                                               gboolean             supersede,
+                                                               GCancellable        *cancellable,
+                                                               HDCommandCallback    command,
+                                                               gpointer             data,
+                                                               GDestroyNotify       destroy_data);
+void                 hd_command_thread_pool_push_idle         (HDCommandThreadPool *pool,
+                                                               gint                 priority,
+                                                               GSourceFunc          function,
+                                                               gpointer             data,
+                                                               GDestroyNotify       destroy_data);
+void                 hd_command_thread_pool_push_idle_for_key (HDCommandThreadPool *pool,
+                                                               guint                key,
+                                                               gint                 priority,
+                                                               GSourceFunc          function,
+                                                               gpointer             data,
+                                                               GDestroyNotify       destroy_data);
+
+void                 hd_command_thread_pool_get_stats         (HDCommandThreadPool *pool,
+                                                               guint               *finished,
+                                                               guint               *dropped,
+                                                               gint64              *wait_avg,
+                                                               gint64              *wait_max,
+                                                               gint64              *duration_avg,
+                                                               gint64              *duration_max);
 
 G_END_DECLS
 
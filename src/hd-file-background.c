@@ -135,9 +135,10 @@ hd_file_background_set_for_view_full (HDFileBackground *background,
                            update_gconf);
 
   hd_backgrounds_add_create_cached_image (hd_backgrounds_get (),
+                                          current_view,
                                           priv->image_file,
                                           data->error_dialogs,
-                                          cancellable,
+                                          data->cancellable,
                                           (HDCommandCallback) create_cached_image_command,
                                           data,
                                           (GDestroyNotify) command_data_free);
@@ -156,58 +157,18 @@ static void
 create_cached_image_command (CommandData *data)
 {
   HDImageSize screen_size = {HD_SCREEN_WIDTH, HD_SCREEN_HEIGHT};
-  GdkPixbuf *pixbuf = NULL;
-  char *etag = NULL;
-  GError *error = NULL;
 
   if (g_cancellable_is_cancelled (data->cancellable))
-    goto cleanup;
-
-  pixbuf = hd_pixbuf_utils_load_scaled_and_cropped (data->file,
-                                                    &screen_size,
-                                                    &etag,
-                                                    data->cancellable,
-                                                    &error);
-  if (error)
-    {
-      char *uri;
-
-      if (data->error_dialogs)
-        hd_backgrounds_report_corrupt_image (error);
-
-      uri = g_file_get_uri (data->file);
-      g_warning ("%s. Could not load pixbuf from file %s. %s",
-                 __FUNCTION__,
-                 uri,
-                 error->message);
-      g_free (uri);
-      g_error_free (error);
-      goto cleanup;
-    }
-
-  if (!pixbuf)
-    goto cleanup;
+    return;
 
-  if (g_cancellable_is_cancelled (data->cancellable))
-    goto cleanup;
-
-  hd_backgrounds_save_cached_image (hd_backgrounds_get (),
-                                    pixbuf,
-                                    data->view,
-                                    data->file,
-                                    etag,
-                                    data->error_dialogs,
-                                    data->update_gconf,
-                                    data->cancellable,
-                                    &error);
-
-  if (error)
-    g_error_free (error);
-
-cleanup:
-  if (pixbuf)
-    g_object_unref (pixbuf);
-  g_free (etag);
+  hd_backgrounds_create_cached_image (hd_backgrounds_get (),
+                                      data->view,
+                                      data->file,
+                                      &screen_size,
+                                      data->error_dialogs,
+                                      data->update_gconf,
+                                      data->cancellable,
+                                      NULL);
 }
 
 static void
@@ -326,7 +287,7 @@ command_data_new  (GFile        *file,
 
   data->file = g_object_ref (file);
   data->view = view;
-  data->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  data->cancellable = hd_backgrounds_job_cancellable_new (cancellable);
 
   data->error_dialogs = error_dialogs;
   data->update_gconf = update_gconf;
@@ -62,6 +62,16 @@
 /* Timeout in seconds */
 #define INCOMING_EVENT_WINDOW_PREVIEW_TIMEOUT 4
 
+/* Relative time labels which would change within this many seconds of
+ * the next tick are updated early, so they share one wakeup */
+#define TIME_TICKER_SLACK 10
+
+/* Maximal number of hidden windows kept for reuse. Setting the
+ * HD_INCOMING_EVENT_WINDOW_POOL environment variable to "0" disables
+ * the pools, to compare the preview latency with and without them */
+#define PREVIEW_POOL_SIZE 1
+#define SWITCHER_POOL_SIZE 4
+
 #define HD_INCOMING_EVENT_WINDOW_GET_PRIVATE(object) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_INCOMING_EVENT_WINDOW, HDIncomingEventWindowPrivate))
 
@@ -100,13 +110,42 @@ struct _HDIncomingEventWindowPrivate
 
   guint timeout_id;
 
-  guint update_time_source;
+  /* Pending synthetic map of a stubbed window */
+  guint stub_map_id;
+
+  /* Relative time label as set on the X window, owned by the time
+   * difference cache */
+  const gchar *time_text;
+  gboolean time_text_valid;
 
   cairo_surface_t *bg_image;
 };
 
 G_DEFINE_TYPE (HDIncomingEventWindow, hd_incoming_event_window, GTK_TYPE_WINDOW);
 
+/* Hidden, realized windows which can be reused. Preview and switcher
+ * windows are kept apart because the preview property cannot be changed. */
+static GQueue preview_pool = G_QUEUE_INIT;
+static GQueue switcher_pool = G_QUEUE_INIT;
+
+/* Set by hd_incoming_event_window_set_stubbed () */
+static gboolean stubbed = FALSE;
+
+/* Statistics for hd_incoming_event_window_get_stats () */
+static guint windows_created = 0;
+static guint windows_reused = 0;
+static guint property_updates = 0;
+
+/* Mapped switcher windows showing a relative time. They are all updated
+ * from one shared timeout instead of a timeout per window. */
+static GList *time_ticker_windows = NULL;
+static guint time_ticker_source = 0;
+static gboolean time_ticker_connected = FALSE;
+
+static void time_ticker_add_window (HDIncomingEventWindow *window);
+static void time_ticker_remove_window (HDIncomingEventWindow *window);
+static void time_ticker_queue_update (void);
+
 static gboolean
 hd_incoming_event_window_timeout (HDIncomingEventWindow *window)
 {
@@ -130,20 +169,77 @@ hd_incoming_event_window_map_event (GtkWidget   *widget,
   HDIncomingEventWindowPrivate *priv = HD_INCOMING_EVENT_WINDOW (widget)->priv;
   gboolean result = FALSE;
 
-  if (GTK_WIDGET_CLASS (hd_incoming_event_window_parent_class)->map_event)
+  /* A stubbed window has no GdkWindow */
+  if (!stubbed &&
+      GTK_WIDGET_CLASS (hd_incoming_event_window_parent_class)->map_event)
     result = GTK_WIDGET_CLASS (hd_incoming_event_window_parent_class)->map_event (widget,
                                                                                   event);
 
   if (priv->preview)
     {
-      priv->timeout_id = g_timeout_add_seconds (INCOMING_EVENT_WINDOW_PREVIEW_TIMEOUT,
-                                                (GSourceFunc) hd_incoming_event_window_timeout,
-                                                widget);
+      /* Nobody looks at a stubbed preview, so it times out right away */
+      if (stubbed)
+        priv->timeout_id = g_idle_add ((GSourceFunc) hd_incoming_event_window_timeout,
+                                       widget);
+      else
+        priv->timeout_id = g_timeout_add_seconds (INCOMING_EVENT_WINDOW_PREVIEW_TIMEOUT,
+                                                  (GSourceFunc) hd_incoming_event_window_timeout,
+                                                  widget);
     }
+  else if (!stubbed)
+    time_ticker_add_window (HD_INCOMING_EVENT_WINDOW (widget));
 
   return result;
 }
 
+static gboolean
+hd_incoming_event_window_stub_map (GtkWidget *widget)
+{
+  HDIncomingEventWindowPrivate *priv = HD_INCOMING_EVENT_WINDOW (widget)->priv;
+  GdkEvent event = { 0 };
+  gboolean handled;
+
+  priv->stub_map_id = 0;
+
+  if (!GTK_WIDGET_VISIBLE (widget))
+    return FALSE;
+
+  event.any.type = GDK_MAP;
+  event.any.send_event = TRUE;
+
+  g_signal_emit_by_name (widget, "map-event", &event, &handled);
+
+  return FALSE;
+}
+
+static void
+hd_incoming_event_window_show (GtkWidget *widget)
+{
+  HDIncomingEventWindowPrivate *priv = HD_INCOMING_EVENT_WINDOW (widget)->priv;
+
+  if (!stubbed)
+    {
+      GTK_WIDGET_CLASS (hd_incoming_event_window_parent_class)->show (widget);
+      return;
+    }
+
+  /* Neither realized nor mapped, the ::map-event handlers still run
+   * from the main loop like for a real window */
+  GTK_WIDGET_SET_FLAGS (widget, GTK_VISIBLE);
+
+  if (!priv->stub_map_id)
+    priv->stub_map_id = gdk_threads_add_idle ((GSourceFunc) hd_incoming_event_window_stub_map,
+                                              widget);
+}
+
+static void
+hd_incoming_event_window_unmap (GtkWidget *widget)
+{
+  time_ticker_remove_window (HD_INCOMING_EVENT_WINDOW (widget));
+
+  GTK_WIDGET_CLASS (hd_incoming_event_window_parent_class)->unmap (widget);
+}
+
 static gboolean
 hd_incoming_event_window_delete_event (GtkWidget   *widget,
                                        GdkEventAny *event)
@@ -194,6 +290,8 @@ hd_incoming_event_window_set_string_xwindow_property (GtkWidget *widget,
 
   window = widget->window;
 
+  property_updates++;
+
   dpy = gdk_drawable_get_display (window);
   atom = gdk_x11_get_xatom_by_name_for_display (dpy, prop);
 
@@ -213,37 +311,132 @@ hd_incoming_event_window_set_string_xwindow_property (GtkWidget *widget,
 }
 
 /*
- * Update the displayed relative time in the task switcher notification thumbnail window
+ * Update the displayed relative time in the task switcher notification thumbnail window.
+ * Returns the number of seconds until the displayed text has to change.
  */
-static gboolean
-hd_incoming_event_window_update_time (HDIncomingEventWindow *window)
+static time_t
+hd_incoming_event_window_update_time (HDIncomingEventWindow *window,
+                                      time_t                 current_time)
 {
   HDIncomingEventWindowPrivate *priv = window->priv;
-  time_t current_time, difference, timeout;
-  gchar *time_text;
-
-  time (&current_time);
+  time_t difference, timeout;
+  const gchar *time_text;
 
   difference = current_time - priv->time;
 
-  time_text = hd_time_difference_get_text (difference);
   timeout = hd_time_difference_get_timeout (difference);
+  if (timeout <= TIME_TICKER_SLACK)
+    {
+      difference += timeout;
+      timeout += hd_time_difference_get_timeout (difference);
+    }
 
-  hd_incoming_event_window_set_string_xwindow_property (GTK_WIDGET (window),
-                                                        "_HILDON_INCOMING_EVENT_NOTIFICATION_TIME",
-                                                        time_text);
-  if (priv->update_time_source)
-    priv->update_time_source = (g_source_remove (priv->update_time_source), 0);
+  /* Cached texts are shared, so they can be compared by pointer */
+  time_text = hd_time_difference_get_cached_text (difference);
+
+  if (!priv->time_text_valid || time_text != priv->time_text)
+    {
+      hd_incoming_event_window_set_string_xwindow_property (GTK_WIDGET (window),
+                                                            "_HILDON_INCOMING_EVENT_NOTIFICATION_TIME",
+                                                            time_text);
+      priv->time_text = time_text;
+      priv->time_text_valid = GTK_WIDGET_REALIZED (window);
+    }
+
+  return timeout;
+}
 
-  priv->update_time_source = g_timeout_add_seconds (timeout,
-                                                    (GSourceFunc) hd_incoming_event_window_update_time,
-                                                    window);
+static gboolean time_ticker_timeout (gpointer data);
 
-  g_free (time_text);
+static void
+time_ticker_update (void)
+{
+  GList *l;
+  time_t current_time, next_timeout = 0;
+
+  if (time_ticker_source)
+    time_ticker_source = (g_source_remove (time_ticker_source), 0);
+
+  if (!time_ticker_windows || !hd_incoming_events_get_display_on ())
+    return;
+
+  time (&current_time);
+
+  for (l = time_ticker_windows; l; l = l->next)
+    {
+      time_t timeout = hd_incoming_event_window_update_time (l->data,
+                                                             current_time);
+
+      if (!next_timeout || timeout < next_timeout)
+        next_timeout = timeout;
+    }
+
+  time_ticker_source = gdk_threads_add_timeout_seconds (MAX (next_timeout, 1),
+                                                        time_ticker_timeout,
+                                                        NULL);
+}
+
+static gboolean
+time_ticker_timeout (gpointer data)
+{
+  time_ticker_source = 0;
+
+  time_ticker_update ();
 
   return FALSE;
 }
 
+/*
+ * Update all windows in the next main loop iteration, e.g. after several
+ * windows were mapped at once
+ */
+static void
+time_ticker_queue_update (void)
+{
+  if (time_ticker_source)
+    time_ticker_source = (g_source_remove (time_ticker_source), 0);
+
+  time_ticker_source = gdk_threads_add_idle (time_ticker_timeout, NULL);
+}
+
+static void
+time_ticker_display_status_changed (HDIncomingEvents *ie,
+                                    gboolean          display_on,
+                                    gpointer          data)
+{
+  if (display_on)
+    time_ticker_queue_update ();
+  else if (time_ticker_source)
+    time_ticker_source = (g_source_remove (time_ticker_source), 0);
+}
+
+static void
+time_ticker_add_window (HDIncomingEventWindow *window)
+{
+  if (g_list_find (time_ticker_windows, window))
+    return;
+
+  if (!time_ticker_connected)
+    {
+      g_signal_connect (hd_incoming_events_get (), "display-status-changed",
+                        G_CALLBACK (time_ticker_display_status_changed), NULL);
+      time_ticker_connected = TRUE;
+    }
+
+  time_ticker_windows = g_list_prepend (time_ticker_windows, window);
+
+  time_ticker_queue_update ();
+}
+
+static void
+time_ticker_remove_window (HDIncomingEventWindow *window)
+{
+  time_ticker_windows = g_list_remove (time_ticker_windows, window);
+
+  if (!time_ticker_windows && time_ticker_source)
+    time_ticker_source = (g_source_remove (time_ticker_source), 0);
+}
+
 static void
 hd_incoming_event_window_update_title_and_amount (HDIncomingEventWindow *window)
 {
@@ -317,7 +510,8 @@ hd_incoming_event_window_realize (GtkWidget *widget)
 
   /* Update time of nopreview windows */
   if (!priv->preview && hd_incoming_events_get_display_on ())
-    hd_incoming_event_window_update_time (HD_INCOMING_EVENT_WINDOW (widget));
+    hd_incoming_event_window_update_time (HD_INCOMING_EVENT_WINDOW (widget),
+                                          time (NULL));
   hd_incoming_event_window_update_title_and_amount (HD_INCOMING_EVENT_WINDOW (widget));
 
   /* Set background to transparent pixmap */
@@ -370,8 +564,10 @@ hd_incoming_event_window_dispose (GObject *object)
       priv->timeout_id = 0;
     }
 
-  if (priv->update_time_source)
-    priv->update_time_source = (g_source_remove (priv->update_time_source), 0);
+  if (priv->stub_map_id)
+    priv->stub_map_id = (g_source_remove (priv->stub_map_id), 0);
+
+  time_ticker_remove_window (HD_INCOMING_EVENT_WINDOW (object));
 
   if (priv->bg_image)
     priv->bg_image = (cairo_surface_destroy (priv->bg_image), NULL);
@@ -480,8 +676,13 @@ hd_incoming_event_window_set_property (GObject      *object,
 
     case PROP_TIME:
       priv->time = g_value_get_long (value);
+      priv->time_text_valid = FALSE;
       if (!priv->preview && hd_incoming_events_get_display_on ())
-        hd_incoming_event_window_update_time (HD_INCOMING_EVENT_WINDOW (object));
+        hd_incoming_event_window_update_time (HD_INCOMING_EVENT_WINDOW (object),
+                                              time (NULL));
+      /* The next change of the label may be earlier now */
+      if (g_list_find (time_ticker_windows, object))
+        time_ticker_queue_update ();
       break;
 
     case PROP_AMOUNT:
@@ -514,6 +715,39 @@ hd_incoming_event_window_set_property (GObject      *object,
     }
 }
 
+/* Takes the background image from the surface cache, the window has its size */
+static void
+load_theme_images (HDIncomingEventWindow *window)
+{
+  HDIncomingEventWindowPrivate *priv = window->priv;
+
+  if (priv->bg_image)
+    cairo_surface_destroy (priv->bg_image);
+
+  priv->bg_image = hd_cairo_surface_cache_get_surface (hd_cairo_surface_cache_get (),
+                                                       BACKGROUND_IMAGE_FILE);
+
+  gtk_widget_set_size_request (GTK_WIDGET (window),
+                               cairo_image_surface_get_width (priv->bg_image),
+                               cairo_image_surface_get_height (priv->bg_image));
+}
+
+static void
+hd_incoming_event_window_style_set (GtkWidget *widget,
+                                    GtkStyle  *previous_style)
+{
+  /* The theme changed */
+  if (previous_style)
+    {
+      load_theme_images (HD_INCOMING_EVENT_WINDOW (widget));
+      gtk_widget_queue_draw (widget);
+    }
+
+  if (GTK_WIDGET_CLASS (hd_incoming_event_window_parent_class)->style_set)
+    GTK_WIDGET_CLASS (hd_incoming_event_window_parent_class)->style_set (widget,
+                                                                         previous_style);
+}
+
 static void
 hd_incoming_event_window_class_init (HDIncomingEventWindowClass *klass)
 {
@@ -522,9 +756,12 @@ hd_incoming_event_window_class_init (HDIncomingEventWindowClass *klass)
 
   widget_class->button_press_event = hd_incoming_event_window_button_press_event;
   widget_class->delete_event = hd_incoming_event_window_delete_event;
+  widget_class->show = hd_incoming_event_window_show;
   widget_class->map_event = hd_incoming_event_window_map_event;
+  widget_class->unmap = hd_incoming_event_window_unmap;
   widget_class->realize = hd_incoming_event_window_realize;
   widget_class->expose_event = hd_incoming_event_window_expose_event;
+  widget_class->style_set = hd_incoming_event_window_style_set;
 
   object_class->dispose = hd_incoming_event_window_dispose;
   object_class->finalize = hd_incoming_event_window_finalize;
@@ -606,27 +843,6 @@ hd_incoming_event_window_class_init (HDIncomingEventWindowClass *klass)
   g_type_class_add_private (klass, sizeof (HDIncomingEventWindowPrivate));
 }
 
-static void
-display_status_changed (HDIncomingEvents      *ie,
-                        gboolean               display_on,
-                        HDIncomingEventWindow *window)
-{
-  HDIncomingEventWindowPrivate *priv = window->priv;
-
-  if (priv->preview)
-    return;
-
-  if (display_on)
-    {
-      hd_incoming_event_window_update_time (window);
-    }
-  else
-    {
-      if (priv->update_time_source)
-        priv->update_time_source = (g_source_remove (priv->update_time_source), 0);
-    }
-}
-
 static void
 hd_incoming_event_window_init (HDIncomingEventWindow *window)
 {
@@ -635,6 +851,8 @@ hd_incoming_event_window_init (HDIncomingEventWindow *window)
 
   window->priv = priv;
 
+  windows_created++;
+
   main_table = gtk_table_new (2, 2, FALSE);
   gtk_table_set_col_spacings (GTK_TABLE (main_table), ICON_SPACING);
   gtk_container_set_border_width (GTK_CONTAINER (main_table), WINDOW_MARGIN);
@@ -701,15 +919,7 @@ hd_incoming_event_window_init (HDIncomingEventWindow *window)
   gtk_window_set_accept_focus (GTK_WINDOW (window), FALSE);
 
   /* bg image */
-  priv->bg_image = hd_cairo_surface_cache_get_surface (hd_cairo_surface_cache_get (),
-                                                       BACKGROUND_IMAGE_FILE);
-
-  g_signal_connect_object (hd_incoming_events_get (), "display-status-changed",
-                           G_CALLBACK (display_status_changed), window, 0);
-
-  gtk_widget_set_size_request (GTK_WIDGET (window),
-                               cairo_image_surface_get_width (priv->bg_image),
-                               cairo_image_surface_get_height (priv->bg_image));
+  load_theme_images (window);
 }
 
 GtkWidget *
@@ -734,3 +944,176 @@ hd_incoming_event_window_new (gboolean     preview,
   return window;
 }
 
+static GQueue *
+get_pool (gboolean preview)
+{
+  return preview ? &preview_pool : &switcher_pool;
+}
+
+static guint
+get_pool_size (gboolean preview)
+{
+  static gint pooled = -1;
+
+  if (G_UNLIKELY (pooled < 0))
+    pooled = g_strcmp0 (g_getenv ("HD_INCOMING_EVENT_WINDOW_POOL"), "0") != 0;
+
+  if (!pooled)
+    return 0;
+
+  return preview ? PREVIEW_POOL_SIZE : SWITCHER_POOL_SIZE;
+}
+
+/**
+ * hd_incoming_event_window_acquire:
+ *
+ * Like hd_incoming_event_window_new() but reuses a window which was
+ * released with hd_incoming_event_window_release() if available. Reused
+ * windows are already realized, so only the changed X window properties
+ * are updated.
+ *
+ * Returns: a hidden #HDIncomingEventWindow
+ */
+GtkWidget *
+hd_incoming_event_window_acquire (gboolean     preview,
+                                  const gchar *destination,
+                                  const gchar *summary,
+                                  const gchar *body,
+                                  time_t       time,
+                                  const gchar *icon)
+{
+  GtkWidget *window;
+
+  window = g_queue_pop_head (get_pool (preview));
+
+  if (!window)
+    return hd_incoming_event_window_new (preview,
+                                         destination,
+                                         summary,
+                                         body,
+                                         time,
+                                         icon);
+
+  g_object_set (window,
+                "destination", destination,
+                "title", summary,
+                "message", body,
+                "icon", icon,
+                "time", (glong) time,
+                "amount", (gulong) 1,
+                NULL);
+
+  windows_reused++;
+
+  return window;
+}
+
+/**
+ * hd_incoming_event_window_release:
+ * @window: a #HDIncomingEventWindow
+ *
+ * Hides @window and keeps it for reuse by hd_incoming_event_window_acquire()
+ * or destroys it if enough windows are kept already. All ::response
+ * handlers are disconnected. @window should not be used by the caller
+ * afterwards.
+ */
+void
+hd_incoming_event_window_release (GtkWidget *window)
+{
+  HDIncomingEventWindowPrivate *priv;
+  GQueue *pool;
+
+  g_return_if_fail (HD_IS_INCOMING_EVENT_WINDOW (window));
+
+  priv = HD_INCOMING_EVENT_WINDOW (window)->priv;
+  pool = get_pool (priv->preview);
+
+  /* Already released */
+  if (g_queue_find (pool, window))
+    return;
+
+  if (g_queue_get_length (pool) >= get_pool_size (priv->preview))
+    {
+      gtk_widget_destroy (window);
+      return;
+    }
+
+  if (priv->timeout_id)
+    priv->timeout_id = (g_source_remove (priv->timeout_id), 0);
+
+  g_signal_handlers_disconnect_matched (window,
+                                        G_SIGNAL_MATCH_ID,
+                                        signals[RESPONSE],
+                                        0, NULL, NULL, NULL);
+
+  gtk_widget_hide (window);
+
+  g_queue_push_tail (pool, window);
+}
+
+/**
+ * hd_incoming_event_window_preallocate:
+ * @preview: if preview windows should be created
+ * @n: number of windows
+ *
+ * Creates and realizes up to @n windows so the first
+ * hd_incoming_event_window_acquire() calls do not need to.
+ */
+void
+hd_incoming_event_window_preallocate (gboolean preview,
+                                      guint    n)
+{
+  GQueue *pool = get_pool (preview);
+
+  n = MIN (n, get_pool_size (preview));
+
+  while (g_queue_get_length (pool) < n)
+    {
+      GtkWidget *window;
+
+      window = hd_incoming_event_window_new (preview,
+                                             NULL, NULL, NULL,
+                                             -1, NULL);
+      if (!stubbed)
+        gtk_widget_realize (window);
+      g_queue_push_tail (pool, window);
+    }
+}
+
+/**
+ * hd_incoming_event_window_set_stubbed:
+ * @stub: %TRUE to stub the windows
+ *
+ * Stubbed windows are never realized or mapped, so no X windows are
+ * created. Showing one emits a synthetic ::map-event from the main loop
+ * and a stubbed preview window responds with %GTK_RESPONSE_DELETE_EVENT
+ * right after that instead of after the preview timeout. Used to replay
+ * notification traces without a window manager. Call it before any
+ * window is created.
+ */
+void
+hd_incoming_event_window_set_stubbed (gboolean stub)
+{
+  stubbed = stub;
+}
+
+/**
+ * hd_incoming_event_window_get_stats:
+ * @created: return location for the number of created windows, or %NULL
+ * @reused: return location for the number of windows reused from the pool, or %NULL
+ * @updates: return location for the number of X window property changes, or %NULL
+ *
+ * Returns counters over all incoming event windows since startup.
+ */
+void
+hd_incoming_event_window_get_stats (guint *created,
+                                    guint *reused,
+                                    guint *updates)
+{
+  if (created)
+    *created = windows_created;
+  if (reused)
+    *reused = windows_reused;
+  if (updates)
+    *updates = property_updates;
+}
@@ -66,6 +66,22 @@ GtkWidget *hd_incoming_event_window_new      (gboolean     preview,
                                               time_t       time,
                                               const gchar *icon);
 
+GtkWidget *hd_incoming_event_window_acquire  (gboolean     preview,
+                                              const gchar *destination,
+                                              const gchar *summary,
+                                              const gchar *body,
+                                              time_t       time,
+                                              const gchar *icon);
+void       hd_incoming_event_window_release  (GtkWidget   *window);
+void       hd_incoming_event_window_preallocate (gboolean  preview,
+                                                 guint     n);
+
+void       hd_incoming_event_window_set_stubbed (gboolean stub);
+
+void       hd_incoming_event_window_get_stats (guint *created,
+                                               guint *reused,
+                                               guint *updates);
+
 G_END_DECLS
 
 #endif
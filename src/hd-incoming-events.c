@@ -46,6 +46,8 @@
 #include "hd-notification-manager.h"
 #include "hd-led-pattern.h"
 #include "hd-multi-map.h"
+#include "hd-notification-latency.h"
+#include "hd-notification-trace.h"
 
 #include "hd-incoming-events.h"
 
@@ -66,12 +68,51 @@
 #define NOTIFICATION_GROUP_KEY_LED_PATTERN "LED-Pattern"
 #define NOTIFICATION_GROUP_KEY_GROUP "Group"
 #define NOTIFICATION_GROUP_KEY_SPLIT_IN_THREADS "Split-In-Threads"
+#define NOTIFICATION_GROUP_KEY_PRIORITY "Priority"
+
+#define STORM_GROUP "Storm"
+#define STORM_KEY_ENABLED "enabled"
+#define STORM_KEY_BACKLOG "backlog"
+#define STORM_KEY_RATE "rate"
+#define STORM_KEY_INTERVAL "interval"
+
+/* Preview priority is the category priority plus URGENCY_WEIGHT per
+ * urgency level (0 low, 1 normal, 2 critical). Waiting previews gain one
+ * point each PREVIEW_AGING_INTERVAL ms so nothing starves. */
+#define URGENCY_WEIGHT 10
+#define DEFAULT_URGENCY 1
+#define PREVIEW_AGING_INTERVAL 1000
+
+/* Window updates are applied after GTK+ resizing but before redrawing */
+#define WINDOW_UPDATE_PRIORITY (GDK_PRIORITY_REDRAW - 1)
+
+/* Sound/vibra playback of a category is only started once within
+ * this interval in ms */
+#define SV_COALESCE_INTERVAL 1000
+
+/* Replayed notifications are added to the switcher at latest this many
+ * seconds after startup, even if no compositor was detected */
+#define REPLAY_FLUSH_TIMEOUT 30
+
+/* Notification plugins are called from a low priority idle. A plugin
+ * gets PLUGIN_TIME_BUDGET ms per idle run, a plugin which blocks longer
+ * in a single call is disabled. At most PLUGIN_MAX_PENDING notifications
+ * are kept per plugin. */
+#define PLUGIN_TIME_BUDGET 50
+#define PLUGIN_MAX_PENDING 32
 
 #define HD_SV_NOTIFICATION_DAEMON_DBUS_NAME  "com.nokia.HildonSVNotificationDaemon" 
 #define HD_SV_NOTIFICATION_DAEMON_DBUS_PATH  "/com/nokia/HildonSVNotificationDaemon"
 
 typedef struct _Notifications Notifications;
 
+/* A notification plugin and the notifications not yet passed to it */
+typedef struct
+{
+  HDNotificationPlugin *plugin;
+  GQueue               *pending;
+  gboolean              disabled : 1;
+} PluginQueue;
 
 /*
  * A HDNotification contains in a category (hd_notification_get_category)
@@ -105,6 +146,7 @@ typedef struct
   gchar *pattern;
   gchar *group;
   gchar *split_in_threads;
+  gint priority;
   gboolean no_window : 1;
 } CategoryInfo;
 
@@ -125,6 +167,15 @@ struct _Notifications
   gpointer               cb_data;
 
   GtkWidget             *window;
+
+  /* Preview scheduling */
+  gint                   priority;
+  gint64                 queued_time;
+
+  /* If set changes are collected and cb is called once per main loop
+   * iteration (see notifications_queue_update) */
+  gboolean               coalesce_updates : 1;
+  gboolean               update_queued : 1;
 };
 
 struct _HDIncomingEventsPrivate
@@ -137,6 +188,7 @@ struct _HDIncomingEventsPrivate
   GHashTable      *switcher_groups;
 
   GPtrArray       *plugins;
+  guint            plugins_source;
 
   HDPluginManager *plugin_manager;
 
@@ -146,8 +198,48 @@ struct _HDIncomingEventsPrivate
   gboolean         device_locked : 1;
   gboolean         display_on : 1;
   gboolean         task_switcher_shown : 1;
+  gboolean         plugins_loaded : 1;
+
+  /* Last sound/vibra playback and stop requests not sent yet */
+  gchar           *sv_last_category;
+  gint64           sv_last_time;
+  GArray          *sv_stop_ids;
+  guint            sv_stop_source;
+
+  /* Replayed notifications are kept here until the desktop is ready */
+  gboolean         replay_pending : 1;
+  GList           *replayed_list;
+  guint            replay_timeout_source;
 
   HDMultiMap      *unperceived_notifications;
+
+  /* Notifications with a pending window update */
+  GQueue          *queued_updates;
+  guint            queued_updates_source;
+
+  /* Storm mode, see notification.conf */
+  gboolean         storm_enabled;
+  guint            storm_backlog;
+  guint            storm_rate;
+  guint            storm_interval;
+
+  time_t           storm_interval_start;
+  guint            storm_arrivals;
+
+  /* Preview queue statistics */
+  guint            preview_max_depth;
+  guint            preview_shown;
+  gint64           preview_wait_total;
+  gint64           preview_wait_max;
+
+  /* Time from show_preview_window () to the map of the preview
+   * window, the wait in the preview queue is not included */
+  gint64           preview_show_time;
+  guint            preview_mapped;
+  gint64           preview_latency_total;
+  gint64           preview_latency_max;
+  /* Ids of the notifications shown in the preview window being mapped */
+  GArray          *preview_latency_ids;
 };
 
 enum
@@ -158,8 +250,174 @@ enum
 
 static guint incoming_events_signals [LAST_SIGNAL] = { 0 };
 
+/* Set by hd_incoming_events_set_headless () */
+static gboolean headless = FALSE;
+
 G_DEFINE_TYPE (HDIncomingEvents, hd_incoming_events, G_TYPE_OBJECT);
 
+static void preview_window_close (HDIncomingEvents *ie);
+
+/* Returns the current time in milliseconds */
+static gint64
+get_time_ms (void)
+{
+  GTimeVal tv;
+
+  g_get_current_time (&tv);
+
+  return (gint64) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void
+plugin_queue_clear (PluginQueue *pq)
+{
+  HDNotification *notification;
+
+  while ((notification = g_queue_pop_head (pq->pending)))
+    g_object_unref (notification);
+}
+
+static void
+plugin_queue_free (PluginQueue *pq)
+{
+  plugin_queue_clear (pq);
+  g_queue_free (pq->pending);
+
+  g_slice_free (PluginQueue, pq);
+}
+
+static gboolean
+dispatch_to_plugins (HDIncomingEvents *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+  gboolean more = FALSE;
+  guint i;
+
+  for (i = 0; i < priv->plugins->len; i++)
+    {
+      PluginQueue *pq = g_ptr_array_index (priv->plugins, i);
+      gint64 start = get_time_ms ();
+      HDNotification *notification;
+
+      while (!pq->disabled &&
+             (notification = g_queue_pop_head (pq->pending)))
+        {
+          gint64 before = get_time_ms (), elapsed;
+
+          hd_notification_plugin_notify (pq->plugin, notification);
+          g_object_unref (notification);
+
+          elapsed = get_time_ms () - before;
+          if (elapsed > PLUGIN_TIME_BUDGET)
+            {
+              g_warning ("Notification plugin %s blocked for %" G_GINT64_FORMAT " ms, disabled",
+                         G_OBJECT_TYPE_NAME (pq->plugin),
+                         elapsed);
+              pq->disabled = TRUE;
+              plugin_queue_clear (pq);
+            }
+          else if (get_time_ms () - start >= PLUGIN_TIME_BUDGET)
+            {
+              /* Let the other plugins and the main loop run first */
+              more = more || !g_queue_is_empty (pq->pending);
+              break;
+            }
+        }
+    }
+
+  if (!more)
+    priv->plugins_source = 0;
+
+  return more;
+}
+
+static void
+queue_for_plugins (HDIncomingEvents *ie,
+                   HDNotification   *notification)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+  gboolean queued = FALSE;
+  guint i;
+
+  for (i = 0; i < priv->plugins->len; i++)
+    {
+      PluginQueue *pq = g_ptr_array_index (priv->plugins, i);
+
+      if (pq->disabled)
+        continue;
+
+      if (g_queue_get_length (pq->pending) >= PLUGIN_MAX_PENDING)
+        {
+          g_debug ("%s. Plugin %s too slow, notification dropped",
+                   __FUNCTION__,
+                   G_OBJECT_TYPE_NAME (pq->plugin));
+          g_object_unref (g_queue_pop_head (pq->pending));
+        }
+
+      g_queue_push_tail (pq->pending, g_object_ref (notification));
+      queued = TRUE;
+    }
+
+  if (queued && !priv->plugins_source)
+    priv->plugins_source = gdk_threads_add_idle_full (G_PRIORITY_LOW,
+                                                      (GSourceFunc) dispatch_to_plugins,
+                                                      ie,
+                                                      NULL);
+}
+
+static gboolean
+apply_queued_updates (HDIncomingEvents *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+  Notifications *ns;
+
+  priv->queued_updates_source = 0;
+
+  /* A callback can free other queued Notifications, these
+   * remove themselves from the queue (see notifications_free) */
+  while ((ns = g_queue_pop_head (priv->queued_updates)))
+    {
+      ns->update_queued = FALSE;
+
+      if (ns->cb)
+        ns->cb (ns, ns->cb_data);
+    }
+
+  return FALSE;
+}
+
+/*
+ * Calls the update callback of @ns. If @ns coalesces updates the call is
+ * deferred, so multiple changes in one main loop iteration result in
+ * just one window update.
+ */
+static void
+notifications_queue_update (Notifications *ns)
+{
+  HDIncomingEventsPrivate *priv = hd_incoming_events_get ()->priv;
+
+  if (!ns->cb)
+    return;
+
+  if (!ns->coalesce_updates)
+    {
+      ns->cb (ns, ns->cb_data);
+      return;
+    }
+
+  if (ns->update_queued)
+    return;
+
+  ns->update_queued = TRUE;
+  g_queue_push_tail (priv->queued_updates, ns);
+
+  if (!priv->queued_updates_source)
+    priv->queued_updates_source = gdk_threads_add_idle_full (WINDOW_UPDATE_PRIORITY,
+                                                             (GSourceFunc) apply_queued_updates,
+                                                             hd_incoming_events_get (),
+                                                             NULL);
+}
+
 /* Check if category is mapped to a virtual category
  * and returns the virtual category in this case, 
  * else return category */
@@ -194,8 +452,38 @@ notification_closed_cb (HDNotification *n,
                                         ns);
   g_object_unref (n);
 
-  if (ns->cb)
-    ns->cb (ns, ns->cb_data);
+  notifications_queue_update (ns);
+}
+
+/*
+ * Returns the preview priority of @n derived from the category priority
+ * and the urgency hint.
+ */
+static gint
+notification_get_priority (HDNotification *n)
+{
+  HDIncomingEvents *ie = hd_incoming_events_get ();
+  const gchar *category;
+  CategoryInfo *info = NULL;
+  GValue *v;
+  gint urgency = DEFAULT_URGENCY;
+
+  category = hd_notification_get_category (n);
+  if (category)
+    info = g_hash_table_lookup (ie->priv->categories,
+                                category);
+
+  v = hd_notification_get_hint (n, "urgency");
+  if (v && G_VALUE_HOLDS_UCHAR (v))
+    urgency = g_value_get_uchar (v);
+  else if (v && G_VALUE_HOLDS_INT (v))
+    urgency = g_value_get_int (v);
+  else if (v && G_VALUE_HOLDS_UINT (v))
+    urgency = g_value_get_uint (v);
+
+  urgency = CLAMP (urgency, 0, 2);
+
+  return (info ? info->priority : 0) + urgency * URGENCY_WEIGHT;
 }
 
 /*
@@ -211,6 +499,7 @@ notifications_new_for_notification (HDNotification *n,
 
   ns = g_slice_new0 (Notifications);
   ns->notifications = notifications;
+  ns->priority = notification_get_priority (n);
 
   g_object_ref (n);
   g_ptr_array_add (notifications,
@@ -262,10 +551,13 @@ notifications_free (Notifications *ns)
 
   g_ptr_array_free (notifications, TRUE);
 
+  if (ns->update_queued)
+    g_queue_remove (hd_incoming_events_get ()->priv->queued_updates, ns);
+
   /* Last notification in this group was closed,
-   *  destroy window */
+   *  release window */
   if (GTK_IS_WIDGET (ns->window))
-    ns->window = (gtk_widget_destroy (ns->window), NULL);
+    ns->window = (hd_incoming_event_window_release (ns->window), NULL);
 
   g_slice_free (Notifications, ns);
 }
@@ -304,6 +596,8 @@ notifications_append (Notifications *ns,
       g_signal_connect (n, "closed",
                         G_CALLBACK (notification_closed_cb), ns);
     }
+
+  ns->priority = MAX (ns->priority, other->priority);
 }
 
 static gboolean
@@ -371,8 +665,7 @@ notifications_close_all (Notifications *ns,
  
   repack_ptr_array (ns->notifications);
 
-  if (ns->cb)
-    ns->cb (ns, ns->cb_data);
+  notifications_queue_update (ns);
 }
 
 static CategoryInfo *
@@ -548,10 +841,15 @@ notifications_update_window (Notifications *ns,
   const gchar *title_text, *secondary_text;
   const gchar *icon, *destination;
 
-  /* Destroy the window when all notifications are closed */
+  /* Release the window when all notifications are closed */
   if (notifications_is_empty (ns))
     {
-      gtk_widget_destroy (window);
+      HDIncomingEvents *ie = hd_incoming_events_get ();
+
+      if (window == ie->priv->preview_window)
+        preview_window_close (ie);
+      else
+        hd_incoming_event_window_release (window);
       return;
     }
 
@@ -642,9 +940,9 @@ notifications_update_switcher_window (Notifications *ns,
        * create a window if it does not exist yet */
       if (!GTK_IS_WIDGET (ns->window))
         {
-          ns->window = hd_incoming_event_window_new (FALSE,
-                                                     info->destination,
-                                                     NULL, NULL, -1, NULL);
+          ns->window = hd_incoming_event_window_acquire (FALSE,
+                                                         info->destination,
+                                                         NULL, NULL, -1, NULL);
           g_signal_connect (ns->window, "response",
                             G_CALLBACK (switcher_window_response),
                             ns);
@@ -722,6 +1020,15 @@ notifications_split_in_threads (Notifications *ns)
   return table;
 }
 
+static void
+single_switcher_window_cb (Notifications *ns,
+                           gpointer       data)
+{
+  /* Frees the window too */
+  if (notifications_is_empty (ns))
+    notifications_free (ns);
+}
+
 static void
 notifications_add_to_switcher (Notifications *ns)
 {
@@ -763,34 +1070,34 @@ notifications_add_to_switcher (Notifications *ns)
                                    thread_ns);
             }
 
-          notifications_update_switcher_window (group_ns,
-                                                NULL);
           group_ns->cb = (NotificationsCallback) notifications_update_switcher_window;
           group_ns->cb_data = NULL;
+          group_ns->coalesce_updates = TRUE;
+          notifications_queue_update (group_ns);
         }
 
       g_hash_table_destroy (threads);
     }
   else if (ns->notifications->len == 1)
     {
-      GtkWidget *switcher_window;
       HDNotification *notification = g_ptr_array_index (ns->notifications, 0);
 
-      switcher_window = hd_incoming_event_window_new (FALSE,
-                                                      NULL,
-                                                      hd_notification_get_summary (notification),
-                                                      hd_notification_get_body (notification),
-                                                      hd_notification_get_time (notification),
-                                                      hd_notification_get_icon (notification));
+      ns->window = hd_incoming_event_window_acquire (FALSE,
+                                                     NULL,
+                                                     hd_notification_get_summary (notification),
+                                                     hd_notification_get_body (notification),
+                                                     hd_notification_get_time (notification),
+                                                     hd_notification_get_icon (notification));
+
+      ns->cb = single_switcher_window_cb;
+      ns->cb_data = NULL;
+      ns->coalesce_updates = TRUE;
 
-      g_signal_connect (switcher_window, "response",
+      g_signal_connect (ns->window, "response",
                         G_CALLBACK (switcher_window_response),
                         ns);
-      g_signal_connect_object (notification, "closed",
-                               G_CALLBACK (gtk_widget_destroy), switcher_window,
-                               G_CONNECT_SWAPPED);
 
-      gtk_widget_show (switcher_window);
+      gtk_widget_show (ns->window);
     }
   else
     {
@@ -816,27 +1123,292 @@ preview_window_response (HDIncomingEventWindow *window,
   else
     g_warning ("%s. Unexpected response id: %d", __FUNCTION__, response_id);
 
-  gtk_widget_destroy (GTK_WIDGET (window));
+  preview_window_close (hd_incoming_events_get ());
 }
 
 static void show_preview_window (HDIncomingEvents *ie);
 
+static gboolean
+preview_window_map_event (GtkWidget        *window,
+                          GdkEvent         *event,
+                          HDIncomingEvents *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+  gint64 latency;
+  guint i;
+
+  latency = MAX (get_time_ms () - priv->preview_show_time, 0);
+
+  priv->preview_mapped++;
+  priv->preview_latency_total += latency;
+  priv->preview_latency_max = MAX (priv->preview_latency_max, latency);
+
+  for (i = 0; i < priv->preview_latency_ids->len; i++)
+    hd_notification_latency_mark (g_array_index (priv->preview_latency_ids, guint, i),
+                                  HD_NOTIFICATION_LATENCY_MAPPED);
+  g_array_set_size (priv->preview_latency_ids, 0);
+
+  g_debug ("%s. Preview mapped %" G_GINT64_FORMAT " ms after shown",
+           __FUNCTION__,
+           latency);
+
+  g_signal_handlers_disconnect_by_func (window,
+                                        preview_window_map_event,
+                                        ie);
+
+  return FALSE;
+}
+
+/*
+ * Hides the current preview window and shows the next one
+ */
 static void
-preview_window_destroy_cb (GtkWidget        *window,
-                           HDIncomingEvents *ie)
+preview_window_close (HDIncomingEvents *ie)
 {
   HDIncomingEventsPrivate *priv = ie->priv;
+  GtkWidget *window = priv->preview_window;
+
+  if (!window)
+    return;
 
   priv->preview_window = NULL;
 
+  g_signal_handlers_disconnect_by_func (window,
+                                        preview_window_map_event,
+                                        ie);
+  hd_incoming_event_window_release (window);
+
   show_preview_window (ie);
 }
 
+/*
+ * Count a notification for the preview pipeline and check if it arrived
+ * faster than the configured storm rate.
+ */
+static void
+storm_count_arrival (HDIncomingEvents *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+  time_t now;
+
+  if (!priv->storm_enabled)
+    return;
+
+  time (&now);
+
+  if (now < priv->storm_interval_start ||
+      now - priv->storm_interval_start >= (time_t) priv->storm_interval)
+    {
+      priv->storm_interval_start = now;
+      priv->storm_arrivals = 0;
+    }
+
+  priv->storm_arrivals++;
+}
+
+static gboolean
+storm_is_active (HDIncomingEvents *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+
+  if (!priv->storm_enabled)
+    return FALSE;
+
+  if (priv->storm_backlog &&
+      g_list_length (priv->preview_list) > priv->storm_backlog)
+    return TRUE;
+
+  if (priv->storm_rate &&
+      priv->storm_arrivals > priv->storm_rate &&
+      time (NULL) - priv->storm_interval_start < (time_t) priv->storm_interval)
+    return TRUE;
+
+  return FALSE;
+}
+
+static void
+storm_summary_response (HDIncomingEventWindow *window,
+                        gint                   response_id,
+                        gpointer               data)
+{
+  /* All summarized notifications are already in the switcher */
+  preview_window_close (hd_incoming_events_get ());
+}
+
+/*
+ * Move all pending previews to the switcher and show just one preview
+ * window summarizing them.
+ */
+static void
+show_storm_summary (HDIncomingEvents *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+  GHashTable *groups;
+  gchar *icon = NULL;
+  guint amount = 0, n_groups;
+  gchar *title, *message;
+
+  /* Mapped categories of the summarized notifications, notifications
+   * without category are counted as one */
+  groups = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                  g_free, NULL);
+
+  while (priv->preview_list)
+    {
+      Notifications *ns = priv->preview_list->data;
+      guint i;
+
+      priv->preview_list = g_list_delete_link (priv->preview_list,
+                                               priv->preview_list);
+
+      for (i = 0; i < ns->notifications->len; i++)
+        {
+          HDNotification *n = g_ptr_array_index (ns->notifications, i);
+          const gchar *group = notification_get_group (n);
+
+          if (!group)
+            group = "";
+
+          if (!g_hash_table_lookup (groups, group))
+            g_hash_table_insert (groups, g_strdup (group), GUINT_TO_POINTER (1));
+
+          g_free (icon);
+          icon = g_strdup (hd_notification_get_icon (n));
+        }
+
+      if (!notifications_is_empty (ns))
+        {
+          CategoryInfo *info = notifications_get_category_info (ns);
+
+          if (info && info->icon)
+            {
+              g_free (icon);
+              icon = g_strdup (info->icon);
+            }
+        }
+
+      amount += notifications_get_amount (ns);
+
+      ns->cb = NULL;
+      ns->cb_data = NULL;
+      ns->coalesce_updates = FALSE;
+      notifications_add_to_switcher (ns);
+    }
+
+  n_groups = MAX (g_hash_table_size (groups), 1);
+
+  title = g_strdup_printf (dngettext (GETTEXT_PACKAGE,
+                                      "home_ti_notification_storm_one_event",
+                                      "home_ti_notification_storm_events",
+                                      amount),
+                           amount);
+  message = g_strdup_printf (dngettext (GETTEXT_PACKAGE,
+                                        "home_va_notification_storm_one_category",
+                                        "home_va_notification_storm_categories",
+                                        n_groups),
+                             n_groups);
+
+  g_debug ("%s. %s %s", __FUNCTION__, title, message);
+
+  priv->preview_window = hd_incoming_event_window_acquire (TRUE,
+                                                           NULL,
+                                                           title,
+                                                           message,
+                                                           -1,
+                                                           icon);
+  g_object_set (priv->preview_window,
+                "amount", (gulong) MAX (amount, 1),
+                NULL);
+
+  g_signal_connect (priv->preview_window, "response",
+                    G_CALLBACK (storm_summary_response),
+                    NULL);
+
+  /* Send dbus request to mce to turn display backlight on */
+  if (priv->mce_proxy)
+    dbus_g_proxy_call_no_reply (priv->mce_proxy, MCE_DISPLAY_ON_REQ,
+                                G_TYPE_INVALID, G_TYPE_INVALID);
+
+  gtk_widget_show (priv->preview_window);
+
+  g_hash_table_destroy (groups);
+  g_free (icon);
+  g_free (title);
+  g_free (message);
+}
+
+/*
+ * Removes and returns the Notifications with the highest priority from
+ * the preview list. Waiting time increases the priority, on equal
+ * priority the oldest one is returned.
+ */
+static Notifications *
+preview_list_pop (HDIncomingEvents *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+  GList *l, *best = NULL;
+  gint64 now, best_priority = 0, wait;
+  Notifications *ns;
+
+  now = get_time_ms ();
+
+  for (l = priv->preview_list; l; l = l->next)
+    {
+      Notifications *candidate = l->data;
+      gint64 priority;
+
+      priority = candidate->priority +
+                 MAX (now - candidate->queued_time, 0) / PREVIEW_AGING_INTERVAL;
+
+      if (!best || priority > best_priority)
+        {
+          best = l;
+          best_priority = priority;
+        }
+    }
+
+  if (!best)
+    return NULL;
+
+  ns = best->data;
+  priv->preview_list = g_list_delete_link (priv->preview_list,
+                                           best);
+
+  wait = MAX (now - ns->queued_time, 0);
+  priv->preview_shown++;
+  priv->preview_wait_total += wait;
+  priv->preview_wait_max = MAX (priv->preview_wait_max, wait);
+
+  g_debug ("%s. Show %s (priority %d) after %" G_GINT64_FORMAT " ms, %u waiting",
+           __FUNCTION__,
+           ns->group,
+           ns->priority,
+           wait,
+           g_list_length (priv->preview_list));
+
+  return ns;
+}
+
+static void
+preview_list_push (HDIncomingEvents *ie,
+                   Notifications    *ns)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+
+  ns->queued_time = get_time_ms ();
+  priv->preview_list = g_list_append (priv->preview_list,
+                                      ns);
+
+  priv->preview_max_depth = MAX (priv->preview_max_depth,
+                                 g_list_length (priv->preview_list));
+}
+
 static void
 show_preview_window (HDIncomingEvents *ie)
 {
   HDIncomingEventsPrivate *priv = ie->priv;
   Notifications *ns;
+  guint i;
 
   if (priv->preview_window || !priv->preview_list)
     return;
@@ -856,27 +1428,43 @@ show_preview_window (HDIncomingEvents *ie)
       return;
     }
 
-  /* Pop first notification from preview ns */
-  ns = priv->preview_list->data;
-  priv->preview_list = g_list_delete_link (priv->preview_list,
-                                           priv->preview_list);
+  /* Too many previews pending, summarize them in one window */
+  if (storm_is_active (ie))
+    {
+      show_storm_summary (ie);
+      return;
+    }
+
+  priv->preview_show_time = get_time_ms ();
+
+  /* Pop the most important notification from preview ns */
+  ns = preview_list_pop (ie);
 
   /* Create the notification preview window */
-  priv->preview_window = hd_incoming_event_window_new (TRUE,
-                                                       NULL,
-                                                       NULL,
-                                                       NULL,
-                                                       -1,
-                                                       NULL);
+  priv->preview_window = hd_incoming_event_window_acquire (TRUE,
+                                                           NULL,
+                                                           NULL,
+                                                           NULL,
+                                                           -1,
+                                                           NULL);
+
+  g_array_set_size (priv->preview_latency_ids, 0);
+  for (i = 0; i < ns->notifications->len; i++)
+    {
+      guint id = hd_notification_get_id (g_ptr_array_index (ns->notifications, i));
+
+      g_array_append_val (priv->preview_latency_ids, id);
+    }
 
   ns->cb  = (NotificationsCallback) notifications_update_window;
   ns->cb_data = priv->preview_window;
+  ns->coalesce_updates = TRUE;
 
   g_signal_connect (priv->preview_window, "response",
                     G_CALLBACK (preview_window_response),
                     ns);
-  g_signal_connect (priv->preview_window, "destroy",
-                    G_CALLBACK (preview_window_destroy_cb), ie);
+  g_signal_connect (priv->preview_window, "map-event",
+                    G_CALLBACK (preview_window_map_event), ie);
 
   notifications_update_window (ns,
                                priv->preview_window);
@@ -921,6 +1509,55 @@ preview_list_notifications_cb (Notifications *ns,
     }
 }
 
+/* The only hints used by the sound/vibra plugin */
+static const gchar *sv_hint_keys[] = {
+  "category",
+  "sound-file",
+  "vibra",
+  "urgency",
+  NULL
+};
+
+static gboolean
+send_sv_stop_events (HDIncomingEvents *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+
+  priv->sv_stop_source = 0;
+
+  if (priv->sv_daemon_proxy && priv->sv_stop_ids->len)
+    dbus_g_proxy_call_no_reply (priv->sv_daemon_proxy,
+                                "StopEvents",
+                                DBUS_TYPE_G_INT_ARRAY,
+                                priv->sv_stop_ids,
+                                G_TYPE_INVALID);
+
+  g_array_set_size (priv->sv_stop_ids, 0);
+
+  return FALSE;
+}
+
+/*
+ * Stops a sound/vibra event. Stops for all notifications closed in one
+ * main loop iteration are sent in one call.
+ */
+static void
+queue_sv_stop_event (HDIncomingEvents *ie,
+                     gint              id)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+
+  /* Event was not queued by the daemon */
+  if (id < 0)
+    return;
+
+  g_array_append_val (priv->sv_stop_ids, id);
+
+  if (!priv->sv_stop_source)
+    priv->sv_stop_source = gdk_threads_add_idle ((GSourceFunc) send_sv_stop_events,
+                                                 ie);
+}
+
 static void
 notification_closed_sv_cb (HDNotification   *notification,
                            HDIncomingEvents *ie)
@@ -936,11 +1573,7 @@ notification_closed_sv_cb (HDNotification   *notification,
                                              quark_id));
   if (id)
     {
-      dbus_g_proxy_call_no_reply (priv->sv_daemon_proxy,
-                                  "StopEvent",
-                                  G_TYPE_INT,
-                                  id,
-                                  G_TYPE_INVALID);
+      queue_sv_stop_event (ie, (gint) id);
     }
   else
     {
@@ -968,17 +1601,16 @@ play_event_notify (DBusGProxy     *proxy,
                              G_TYPE_INT, &id,
                              G_TYPE_INVALID))
     {
+      hd_notification_latency_mark (hd_notification_get_id (notification),
+                                    HD_NOTIFICATION_LATENCY_SOUND);
+
       /* If the id is set the notification is
        * already closed else set the id
        */
       if (g_object_get_qdata (G_OBJECT (notification),
                               quark_id))
         {
-          dbus_g_proxy_call_no_reply (proxy,
-                                      "StopEvent",
-                                      G_TYPE_INT,
-                                      id,
-                                      G_TYPE_INVALID);
+          queue_sv_stop_event (hd_incoming_events_get (), (gint) id);
         }
       else
         {
@@ -1006,6 +1638,72 @@ unperceived_notification_closed (HDNotification *notification,
                        G_OBJECT (notification));
 }
 
+/*
+ * Add all replayed notifications to the switcher in one pass
+ */
+static void
+flush_replayed_notifications (HDIncomingEvents *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+  GList *list, *l;
+
+  if (!priv->replay_pending)
+    return;
+
+  priv->replay_pending = FALSE;
+
+  if (priv->replay_timeout_source)
+    priv->replay_timeout_source = (g_source_remove (priv->replay_timeout_source), 0);
+
+  list = g_list_reverse (priv->replayed_list);
+  priv->replayed_list = NULL;
+
+  g_debug ("%s. Adding %u replayed notifications to the switcher",
+           __FUNCTION__,
+           g_list_length (list));
+
+  for (l = list; l; l = l->next)
+    {
+      Notifications *ns = l->data;
+
+      /* Closed while waiting */
+      if (notifications_is_empty (ns))
+        notifications_free (ns);
+      else
+        notifications_add_to_switcher (ns);
+    }
+
+  g_list_free (list);
+}
+
+static void
+check_replay_ready (HDIncomingEvents *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+
+  if (priv->replay_pending &&
+      priv->plugins_loaded &&
+      gdk_screen_is_composited (gdk_screen_get_default ()))
+    flush_replayed_notifications (ie);
+}
+
+static void
+composited_changed_cb (GdkScreen        *screen,
+                       HDIncomingEvents *ie)
+{
+  check_replay_ready (ie);
+}
+
+static gboolean
+replay_timeout_cb (HDIncomingEvents *ie)
+{
+  ie->priv->replay_timeout_source = 0;
+
+  flush_replayed_notifications (ie);
+
+  return FALSE;
+}
+
 static void
 hd_incoming_events_notified (HDNotificationManager  *nm,
                              HDNotification         *notification,
@@ -1014,7 +1712,6 @@ hd_incoming_events_notified (HDNotificationManager  *nm,
 {
   HDIncomingEventsPrivate *priv = ie->priv;
   const gchar *category;
-/*  guint i; */
   GValue *p;
   const gchar *pattern = NULL;
   Notifications *ns;
@@ -1028,35 +1725,57 @@ hd_incoming_events_notified (HDNotificationManager  *nm,
   /* Do nothing for system.note.* notifications */
   if (category && g_str_has_prefix (category, "system.note."))
     {
-      /*
-      for (i = 0; i < priv->plugins->len; i++)
-        {
-          HDNotificationPlugin *plugin = g_ptr_array_index (priv->plugins, i);
-
-          hd_notification_plugin_notify (plugin, notification);
-        }
-      */
+      queue_for_plugins (ie, notification);
       return;
     }
 
   ns = notifications_new_for_notification (notification, NULL);
   info = notifications_get_category_info (ns);
 
-  /* Replayed events are just added to the switcher */
+  /* Replayed events are just added to the switcher, once the
+   * desktop is ready */
   if (replayed_event)
     {
-      notifications_add_to_switcher (ns);
+      if (priv->replay_pending)
+        priv->replayed_list = g_list_prepend (priv->replayed_list, ns);
+      else
+        notifications_add_to_switcher (ns);
 
       return;
     }
 
-  /* Call sound/vibra daemon */
-  if (priv->sv_daemon_proxy)
+  /* Keep the order in the switcher */
+  flush_replayed_notifications (ie);
+
+  hd_notification_latency_mark (hd_notification_get_id (notification),
+                                HD_NOTIFICATION_LATENCY_GROUPED);
+
+  /* Call sound/vibra daemon, once for a burst of the same category */
+  if (priv->sv_daemon_proxy &&
+      category &&
+      !g_strcmp0 (category, priv->sv_last_category) &&
+      get_time_ms () - priv->sv_last_time < SV_COALESCE_INTERVAL)
+    {
+      g_debug ("%s. Sound/vibra event for %s already played",
+               __FUNCTION__,
+               category);
+    }
+  else if (priv->sv_daemon_proxy)
     {
       GHashTable *hints;
       const gchar *sender;
+      guint i;
+
+      /* Only send the hints the plugin reads */
+      hints = g_hash_table_new (g_str_hash, g_str_equal);
+      for (i = 0; sv_hint_keys[i]; i++)
+        {
+          GValue *value = hd_notification_get_hint (notification,
+                                                    sv_hint_keys[i]);
+          if (value)
+            g_hash_table_insert (hints, (gpointer) sv_hint_keys[i], value);
+        }
 
-      hints = hd_notification_get_hints (notification);
       sender = hd_notification_get_sender (notification);
 
       g_signal_connect (notification, "closed",
@@ -1072,15 +1791,16 @@ hd_incoming_events_notified (HDNotificationManager  *nm,
                                G_TYPE_STRING,
                                sender,
                                G_TYPE_INVALID);
+
+      g_hash_table_destroy (hints);
+
+      g_free (priv->sv_last_category);
+      priv->sv_last_category = g_strdup (category);
+      priv->sv_last_time = get_time_ms ();
     }
 
   /* Call plugins */
-/*  for (i = 0; i < priv->plugins->len; i++)
-    {
-      HDNotificationPlugin *plugin = g_ptr_array_index (priv->plugins, i);
-
-      hd_notification_plugin_notify (plugin, notification);
-    }*/
+  queue_for_plugins (ie, notification);
 
   /* Lets see if we have any led event for this category */
   p = hd_notification_get_hint (notification, "led-pattern");
@@ -1124,6 +1844,8 @@ hd_incoming_events_notified (HDNotificationManager  *nm,
       return;      
     }
 
+  storm_count_arrival (ie);
+
   if (info)
     {
       GList *l  = g_list_find_custom (priv->preview_list,
@@ -1140,16 +1862,14 @@ hd_incoming_events_notified (HDNotificationManager  *nm,
         }
       else
         {
-          priv->preview_list = g_list_append (priv->preview_list,
-                                              ns);
+          preview_list_push (ie, ns);
           ns->cb = preview_list_notifications_cb;
           ns->cb_data = priv;
         }
     }
   else
     {
-      priv->preview_list = g_list_append (priv->preview_list,
-                                          ns);
+      preview_list_push (ie, ns);
     }
 
   show_preview_window (ie);
@@ -1172,6 +1892,18 @@ hd_incoming_events_dispose (GObject *object)
   if (priv->unperceived_notifications)
     priv->unperceived_notifications = (g_object_unref (priv->unperceived_notifications), NULL);
 
+  if (priv->queued_updates_source)
+    priv->queued_updates_source = (g_source_remove (priv->queued_updates_source), 0);
+
+  if (priv->replay_timeout_source)
+    priv->replay_timeout_source = (g_source_remove (priv->replay_timeout_source), 0);
+
+  if (priv->sv_stop_source)
+    priv->sv_stop_source = (g_source_remove (priv->sv_stop_source), 0);
+
+  if (priv->plugins_source)
+    priv->plugins_source = (g_source_remove (priv->plugins_source), 0);
+
   G_OBJECT_CLASS (hd_incoming_events_parent_class)->dispose (object);
 }
 
@@ -1187,7 +1919,27 @@ hd_incoming_events_finalize (GObject *object)
     priv->preview_list = (g_list_free (priv->preview_list), NULL);
 
   if (priv->plugins)
-    priv->plugins = (g_ptr_array_free (priv->plugins, TRUE), NULL);
+    {
+      g_ptr_array_foreach (priv->plugins, (GFunc) plugin_queue_free, NULL);
+      priv->plugins = (g_ptr_array_free (priv->plugins, TRUE), NULL);
+    }
+
+  if (priv->queued_updates)
+    priv->queued_updates = (g_queue_free (priv->queued_updates), NULL);
+
+  if (priv->sv_stop_ids)
+    priv->sv_stop_ids = (g_array_free (priv->sv_stop_ids, TRUE), NULL);
+
+  if (priv->preview_latency_ids)
+    priv->preview_latency_ids = (g_array_free (priv->preview_latency_ids, TRUE), NULL);
+
+  g_free (priv->sv_last_category);
+
+  if (priv->replayed_list)
+    {
+      g_list_foreach (priv->replayed_list, (GFunc) notifications_free, NULL);
+      priv->replayed_list = (g_list_free (priv->replayed_list), NULL);
+    }
 
   G_OBJECT_CLASS (hd_incoming_events_parent_class)->finalize (object);
 }
@@ -1385,6 +2137,11 @@ load_category_infos (HDIncomingEvents *ie)
                                            NOTIFICATION_GROUP_KEY_GROUP,
                                            NULL);
 
+      info->priority = g_key_file_get_integer (key_file,
+                                               infos[i],
+                                               NOTIFICATION_GROUP_KEY_PRIORITY,
+                                               NULL);
+
       g_debug ("Add category %s", infos[i]);
       g_hash_table_insert (ie->priv->categories,
                            infos[i],
@@ -1404,13 +2161,82 @@ load_key_error:
   g_object_unref (infos_file);
 }
 
+/*
+ * Loads the storm mode settings from /etc/hildon-desktop/notification.conf
+ */
+static void
+load_storm_settings (HDIncomingEvents *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+  HDConfigFile *config_file;
+  GKeyFile *key_file;
+  GError *error = NULL;
+
+  /* Defaults */
+  priv->storm_enabled = FALSE;
+  priv->storm_backlog = 5;
+  priv->storm_rate = 10;
+  priv->storm_interval = 10;
+
+  config_file = hd_config_file_new (HD_DESKTOP_CONFIG_PATH,
+                                    NULL,
+                                    "notification.conf");
+  key_file = hd_config_file_load_file (config_file, TRUE);
+  g_object_unref (config_file);
+
+  if (!key_file)
+    return;
+
+  priv->storm_enabled = g_key_file_get_boolean (key_file,
+                                                STORM_GROUP,
+                                                STORM_KEY_ENABLED,
+                                                NULL);
+  if (priv->storm_enabled)
+    {
+      guint value;
+
+      value = g_key_file_get_integer (key_file, STORM_GROUP, STORM_KEY_BACKLOG, &error);
+      if (error)
+        g_clear_error (&error);
+      else
+        priv->storm_backlog = value;
+
+      value = g_key_file_get_integer (key_file, STORM_GROUP, STORM_KEY_RATE, &error);
+      if (error)
+        g_clear_error (&error);
+      else
+        priv->storm_rate = value;
+
+      value = g_key_file_get_integer (key_file, STORM_GROUP, STORM_KEY_INTERVAL, &error);
+      if (error)
+        g_clear_error (&error);
+      else
+        priv->storm_interval = MAX (value, 1);
+
+      g_debug ("%s. Storm mode enabled, backlog: %u, rate: %u/%us",
+               __FUNCTION__,
+               priv->storm_backlog,
+               priv->storm_rate,
+               priv->storm_interval);
+    }
+
+  g_key_file_free (key_file);
+}
+
 static void
 hd_incoming_events_plugin_added (HDPluginManager  *pm,
                                  GObject          *plugin,
                                  HDIncomingEvents *ie)
 {
   if (HD_IS_NOTIFICATION_PLUGIN (plugin))
-    g_ptr_array_add (ie->priv->plugins, plugin);
+    {
+      PluginQueue *pq = g_slice_new0 (PluginQueue);
+
+      pq->plugin = HD_NOTIFICATION_PLUGIN (plugin);
+      pq->pending = g_queue_new ();
+
+      g_ptr_array_add (ie->priv->plugins, pq);
+    }
   else
     g_warning ("Plugin from type %s is no HDNotificationPlugin", G_OBJECT_TYPE_NAME (plugin));
 }
@@ -1421,17 +2247,44 @@ hd_incoming_events_plugin_removed (HDPluginManager  *pm,
                                    HDIncomingEvents *ie)
 {
   if (HD_IS_NOTIFICATION_PLUGIN (plugin))
-    g_ptr_array_remove_fast (ie->priv->plugins, plugin);
+    {
+      guint i;
+
+      for (i = 0; i < ie->priv->plugins->len; i++)
+        {
+          PluginQueue *pq = g_ptr_array_index (ie->priv->plugins, i);
+
+          if (pq->plugin == (HDNotificationPlugin *) plugin)
+            {
+              g_ptr_array_remove_index_fast (ie->priv->plugins, i);
+              plugin_queue_free (pq);
+              break;
+            }
+        }
+    }
   else
     g_warning ("Plugin from type %s is no HDNotificationPlugin", G_OBJECT_TYPE_NAME (plugin));
 }
 
+static gboolean
+preallocate_windows_idle (gpointer data)
+{
+  hd_incoming_event_window_preallocate (TRUE, 1);
+
+  return FALSE;
+}
+
 static gboolean
 load_plugins_idle (gpointer data)
 {
+  HDIncomingEvents *ie = hd_incoming_events_get ();
+
   /* Load the configuration of the plugin manager and load plugins */
   hd_plugin_manager_run (HD_PLUGIN_MANAGER (data));
 
+  ie->priv->plugins_loaded = TRUE;
+  check_replay_ready (ie);
+
   return FALSE;
 }
 
@@ -1441,77 +2294,96 @@ hd_incoming_events_system_bus_signal_handler (DBusConnection *conn,
                                               void           *data)
 {
   HDIncomingEvents *ie = data;
-  HDIncomingEventsPrivate *priv = ie->priv;
   const char *value;
 
-  if (dbus_message_is_signal(msg,
-                             MCE_SIGNAL_IF,
-                             MCE_DEVLOCK_MODE_SIG))
+  if (dbus_message_is_signal (msg,
+                              MCE_SIGNAL_IF,
+                              MCE_DEVLOCK_MODE_SIG) ||
+      dbus_message_is_signal (msg,
+                              MCE_SIGNAL_IF,
+                              MCE_DISPLAY_SIG))
     {
       if (dbus_message_get_args (msg, NULL,
                                  DBUS_TYPE_STRING, &value,
                                  DBUS_TYPE_INVALID))
-        {
-          gboolean locked = FALSE;
-
-          if (strcmp (value, MCE_DEVICE_LOCKED) == 0)
-            locked = TRUE;
-          else if (strcmp (value, MCE_DEVICE_UNLOCKED) == 0)
-            locked = FALSE;
-          else
-            g_warning ("%s. Unknown value %s for signal %s.%s",
-                       __FUNCTION__,
-                       value,
-                       MCE_SIGNAL_IF,
-                       MCE_DEVLOCK_MODE_SIG);
-
-          priv->device_locked = locked;
-          if (priv->device_locked && priv->preview_window)
-            gtk_dialog_response (GTK_DIALOG (priv->preview_window),
-                                 GTK_RESPONSE_DELETE_EVENT);
-        }
+        hd_incoming_events_handle_mce_signal (ie,
+                                              dbus_message_get_member (msg),
+                                              value);
     }
-  else if (dbus_message_is_signal (msg,
-                                   MCE_SIGNAL_IF,
-                                   MCE_DISPLAY_SIG))
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/**
+ * hd_incoming_events_handle_mce_signal:
+ * @ie: the #HDIncomingEvents
+ * @signal_name: %MCE_DEVLOCK_MODE_SIG or %MCE_DISPLAY_SIG
+ * @value: the string argument of the signal
+ *
+ * Updates the device lock or display state as for the MCE D-Bus signal
+ * @signal_name. Also used to replay notification traces.
+ */
+void
+hd_incoming_events_handle_mce_signal (HDIncomingEvents *ie,
+                                      const gchar      *signal_name,
+                                      const gchar      *value)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+
+  hd_notification_trace_record_mce (signal_name, value);
+
+  if (!strcmp (signal_name, MCE_DEVLOCK_MODE_SIG))
     {
-      if (dbus_message_get_args (msg, NULL,
-                                 DBUS_TYPE_STRING, &value,
-                                 DBUS_TYPE_INVALID))
-        {
-          gboolean display_on = TRUE;
-
-          if (strcmp (value, MCE_DISPLAY_ON_STRING) == 0)
-            display_on = TRUE;
-          else if (strcmp (value, MCE_DISPLAY_DIM_STRING) == 0)
-            display_on = TRUE;
-          else if (strcmp (value, MCE_DISPLAY_OFF_STRING) == 0)
-            display_on = FALSE;
-          else
-            g_warning ("%s. Unknown value %s for signal %s.%s",
-                       __FUNCTION__,
-                       value,
-                       MCE_SIGNAL_IF,
-                       MCE_DISPLAY_SIG);
+      gboolean locked = FALSE;
 
-          priv->display_on = display_on;
+      if (strcmp (value, MCE_DEVICE_LOCKED) == 0)
+        locked = TRUE;
+      else if (strcmp (value, MCE_DEVICE_UNLOCKED) == 0)
+        locked = FALSE;
+      else
+        g_warning ("%s. Unknown value %s for signal %s.%s",
+                   __FUNCTION__,
+                   value,
+                   MCE_SIGNAL_IF,
+                   MCE_DEVLOCK_MODE_SIG);
 
-          if (display_on && priv->task_switcher_shown)
-            {
-              hd_led_pattern_deactivate_all ();
-              hd_multi_map_remove_all (priv->unperceived_notifications);
-            }
+      priv->device_locked = locked;
+      if (priv->device_locked && priv->preview_window)
+        gtk_dialog_response (GTK_DIALOG (priv->preview_window),
+                             GTK_RESPONSE_DELETE_EVENT);
+    }
+  else if (!strcmp (signal_name, MCE_DISPLAY_SIG))
+    {
+      gboolean display_on = TRUE;
+
+      if (strcmp (value, MCE_DISPLAY_ON_STRING) == 0)
+        display_on = TRUE;
+      else if (strcmp (value, MCE_DISPLAY_DIM_STRING) == 0)
+        display_on = TRUE;
+      else if (strcmp (value, MCE_DISPLAY_OFF_STRING) == 0)
+        display_on = FALSE;
+      else
+        g_warning ("%s. Unknown value %s for signal %s.%s",
+                   __FUNCTION__,
+                   value,
+                   MCE_SIGNAL_IF,
+                   MCE_DISPLAY_SIG);
 
-          g_signal_emit (ie,
-                         incoming_events_signals[DISPLAY_STATUS_CHANGED],
-                         0, display_on);
+      priv->display_on = display_on;
 
-          if (!display_on)
-            hd_notification_manager_db_commit_now (hd_notification_manager_get ());
+      if (display_on && priv->task_switcher_shown)
+        {
+          hd_led_pattern_deactivate_all ();
+          hd_multi_map_remove_all (priv->unperceived_notifications);
         }
-    }
 
-  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+      g_signal_emit (ie,
+                     incoming_events_signals[DISPLAY_STATUS_CHANGED],
+                     0, display_on);
+
+      if (!display_on)
+        hd_notification_manager_db_commit_now (hd_notification_manager_get ());
+    }
 }
 
 
@@ -1593,6 +2465,7 @@ filter_property_changed (GdkXEvent *xevent,
                   if (*new_value == 0xFFFFFFFF)
                     {
                       priv->task_switcher_shown = TRUE;
+                      flush_replayed_notifications (hd_incoming_events_get ());
                       hd_led_pattern_deactivate_all ();
                       hd_multi_map_remove_all (priv->unperceived_notifications);
                     }
@@ -1646,10 +2519,24 @@ hd_incoming_events_init (HDIncomingEvents *ie)
                                                  (GDestroyNotify) notifications_free);
   priv->plugins = g_ptr_array_new ();
 
+  priv->queued_updates = g_queue_new ();
+
+  priv->sv_stop_ids = g_array_new (FALSE, FALSE, sizeof (gint));
+  priv->preview_latency_ids = g_array_new (FALSE, FALSE, sizeof (guint));
+
   priv->plugin_manager = hd_plugin_manager_new (hd_config_file_new_with_defaults ("notification.conf"));
 
   priv->display_on = TRUE;
 
+  /* Collect replayed notifications until plugins are loaded and the
+   * compositor is running */
+  priv->replay_pending = TRUE;
+  g_signal_connect_object (gdk_screen_get_default (), "composited-changed",
+                           G_CALLBACK (composited_changed_cb), ie, 0);
+  priv->replay_timeout_source = gdk_threads_add_timeout_seconds (REPLAY_FLUSH_TIMEOUT,
+                                                                 (GSourceFunc) replay_timeout_cb,
+                                                                 ie);
+
   /* Connect to plugin manager signals */
   g_signal_connect (priv->plugin_manager, "plugin-added",
                     G_CALLBACK (hd_incoming_events_plugin_added), ie);
@@ -1659,10 +2546,24 @@ hd_incoming_events_init (HDIncomingEvents *ie)
   /* Load notification plugins when idle */
   gdk_threads_add_idle (load_plugins_idle, priv->plugin_manager);
 
+  /* Have a preview window ready for the first notification */
+  gdk_threads_add_idle_full (G_PRIORITY_LOW,
+                             preallocate_windows_idle,
+                             NULL, NULL);
+
   /* Connect to notification manager signals */
   g_signal_connect_object (hd_notification_manager_get (), "notified",
                            G_CALLBACK (hd_incoming_events_notified), ie, 0);
   load_category_infos (ie);
+  load_storm_settings (ie);
+
+  priv->unperceived_notifications = hd_multi_map_new ();
+
+  initialize_filter_current_window_changes ();
+
+  /* No sound, vibration or display requests for replayed notifications */
+  if (headless)
+    return;
 
   /* Get D-Bus proxy for mce calls */
   connection = dbus_g_bus_get (DBUS_BUS_SYSTEM, &error);
@@ -1724,10 +2625,6 @@ hd_incoming_events_init (HDIncomingEvents *ie)
                                                          HD_SV_NOTIFICATION_DAEMON_DBUS_PATH,
                                                          HD_SV_NOTIFICATION_DAEMON_DBUS_NAME);
     }
-
-  priv->unperceived_notifications = hd_multi_map_new ();
-
-  initialize_filter_current_window_changes ();
 }
 
 HDIncomingEvents *
@@ -1741,6 +2638,22 @@ hd_incoming_events_get (void)
   return ie;
 }
 
+/**
+ * hd_incoming_events_set_headless:
+ * @headless_mode: %TRUE to run without MCE and sound/vibra daemon
+ *
+ * Headless incoming events do not connect to MCE and the sound/vibra
+ * daemon, so notifications do not play sounds, vibrate or turn on the
+ * display. Used with hd_led_pattern_set_stubbed() to replay
+ * notification traces on a device. Call it before
+ * hd_incoming_events_get().
+ */
+void
+hd_incoming_events_set_headless (gboolean headless_mode)
+{
+  headless = headless_mode;
+}
+
 gboolean
 hd_incoming_events_get_display_on (void)
 {
@@ -1748,3 +2661,55 @@ hd_incoming_events_get_display_on (void)
 
   return ie->priv->display_on;
 }
+
+/**
+ * hd_incoming_events_get_preview_stats:
+ * @depth: return location for the number of waiting previews, or %NULL
+ * @max_depth: return location for the maximal number of waiting previews, or %NULL
+ * @shown: return location for the number of shown previews, or %NULL
+ * @average_wait: return location for the average waiting time in ms, or %NULL
+ * @max_wait: return location for the maximal waiting time in ms, or %NULL
+ *
+ * Returns statistics about the preview window queue.
+ */
+void
+hd_incoming_events_get_preview_stats (guint  *depth,
+                                      guint  *max_depth,
+                                      guint  *shown,
+                                      gint64 *average_wait,
+                                      gint64 *max_wait)
+{
+  HDIncomingEventsPrivate *priv = hd_incoming_events_get ()->priv;
+
+  if (depth)
+    *depth = g_list_length (priv->preview_list);
+  if (max_depth)
+    *max_depth = priv->preview_max_depth;
+  if (shown)
+    *shown = priv->preview_shown;
+  if (average_wait)
+    *average_wait = priv->preview_shown ? priv->preview_wait_total / priv->preview_shown : 0;
+  if (max_wait)
+    *max_wait = priv->preview_wait_max;
+}
+
+/**
+ * hd_incoming_events_get_preview_latency:
+ * @average: return location for the average latency in ms, or %NULL
+ * @max: return location for the maximal latency in ms, or %NULL
+ *
+ * Returns the time from showing a preview window to its map. The time
+ * notifications wait in the preview queue before is not included, it
+ * is returned by hd_incoming_events_get_preview_stats().
+ */
+void
+hd_incoming_events_get_preview_latency (gint64 *average,
+                                        gint64 *max)
+{
+  HDIncomingEventsPrivate *priv = hd_incoming_events_get ()->priv;
+
+  if (average)
+    *average = priv->preview_mapped ? priv->preview_latency_total / priv->preview_mapped : 0;
+  if (max)
+    *max = priv->preview_latency_max;
+}
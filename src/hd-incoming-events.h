@@ -55,8 +55,22 @@ GType             hd_incoming_events_get_type (void);
 
 HDIncomingEvents *hd_incoming_events_get      (void);
 
+void              hd_incoming_events_set_headless (gboolean headless_mode);
+
 gboolean          hd_incoming_events_get_display_on (void);
 
+void              hd_incoming_events_get_preview_stats (guint  *depth,
+                                                        guint  *max_depth,
+                                                        guint  *shown,
+                                                        gint64 *average_wait,
+                                                        gint64 *max_wait);
+void              hd_incoming_events_get_preview_latency (gint64 *average,
+                                                          gint64 *max);
+
+void              hd_incoming_events_handle_mce_signal (HDIncomingEvents *ie,
+                                                        const gchar      *signal_name,
+                                                        const gchar      *value);
+
 G_END_DECLS
 
 #endif
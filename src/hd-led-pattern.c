@@ -34,6 +34,33 @@
 #define HD_LED_PATTERN_GET_PRIVATE(object) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_LED_PATTERN, HDLedPatternPrivate))
 
+/* Requests to MCE are collected for this time in ms. Requests which
+ * cancel each other out during that time are not sent at all. */
+#define LED_REQUEST_DELAY 200
+
+typedef enum
+{
+  LED_STATE_UNKNOWN,
+  LED_STATE_ACTIVE,
+  LED_STATE_INACTIVE
+} LedState;
+
+/* State of a pattern in MCE, the state requested since the last flush
+ * and the state of the first request since then */
+typedef struct
+{
+  LedState sent;
+  LedState requested;
+  LedState first;
+  gboolean force : 1;
+} LedRequest;
+
+typedef struct
+{
+  gchar    *name;
+  gboolean  activate;
+} LedCallData;
+
 struct _HDLedPatternPrivate
 {
   gchar *name;
@@ -59,9 +86,17 @@ static void hd_led_pattern_constructed  (GObject *object);
 static void            activate_pattern   (HDLedPattern *pattern);
 static void            deactivate_pattern (HDLedPattern *pattern);
 
+static void            queue_request      (const gchar *name,
+                                           gboolean     activate,
+                                           gboolean     force);
+
 static GHashTable      *get_pattern_map            (void);
+static GHashTable      *get_request_map            (void);
 static DBusGProxy      *get_mce_proxy              (void);
 
+/* Set by hd_led_pattern_set_stubbed () */
+static gboolean stubbed = FALSE;
+
 G_DEFINE_TYPE (HDLedPattern, hd_led_pattern, G_TYPE_INITIALLY_UNOWNED);
 
 HDLedPattern *
@@ -142,52 +177,177 @@ hd_led_pattern_constructed (GObject *object)
 static void
 activate_pattern (HDLedPattern *pattern)
 {
-  HDLedPatternPrivate *priv = pattern->priv;
+  queue_request (pattern->priv->name, TRUE, FALSE);
+}
+
+static void
+deactivate_pattern (HDLedPattern *pattern)
+{
+  queue_request (pattern->priv->name, FALSE, FALSE);
+}
+
+static void
+led_call_data_free (LedCallData *data)
+{
+  g_free (data->name);
+  g_slice_free (LedCallData, data);
+}
+
+static void
+request_notify (DBusGProxy     *proxy,
+                DBusGProxyCall *call,
+                LedCallData    *data)
+{
+  GError *error = NULL;
+
+  if (dbus_g_proxy_end_call (proxy,
+                             call,
+                             &error,
+                             G_TYPE_INVALID))
+    {
+      g_debug ("%s. %s LED pattern: %s",
+               __FUNCTION__,
+               data->activate ? "Activated" : "Deactivated",
+               data->name);
+    }
+  else
+    {
+      LedRequest *request = g_hash_table_lookup (get_request_map (),
+                                                 data->name);
+
+      /* We do not know the state in MCE anymore */
+      if (request)
+        request->sent = LED_STATE_UNKNOWN;
+
+      g_warning ("%s. Could not %s LED pattern: %s. %s",
+                 __FUNCTION__,
+                 data->activate ? "activate" : "deactivate",
+                 data->name,
+                 error->message);
+
+      g_error_free (error);
+    }
+}
+
+static gboolean
+flush_requests (gpointer data)
+{
+  guint *flush_source = data;
   DBusGProxy *mce_proxy;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  *flush_source = 0;
 
   mce_proxy = get_mce_proxy ();
 
-  if (mce_proxy)
+  g_hash_table_iter_init (&iter, get_request_map ());
+  while (g_hash_table_iter_next (&iter, &key, &value))
     {
-      GError *error = NULL;
+      const gchar *name = key;
+      LedRequest *request = value;
+      LedCallData *call_data;
 
-      dbus_g_proxy_call (mce_proxy,
-                         MCE_ACTIVATE_LED_PATTERN,
-                         &error,
-                         G_TYPE_STRING,
-                         priv->name,
-                         G_TYPE_INVALID,
-                         G_TYPE_INVALID);
+      if (request->requested == LED_STATE_UNKNOWN)
+        continue;
 
-      if (error)
+      /* Skip requests which do not change the state in MCE */
+      if (request->requested == request->sent && !request->force)
         {
-          g_debug ("%s. Could not activate LED pattern: %s. %s", __FUNCTION__, priv->name, error->message);
-          g_error_free (error);
+          request->requested = LED_STATE_UNKNOWN;
+          continue;
         }
-      else
-        g_debug ("%s. Activated LED pattern: %s", __FUNCTION__, priv->name);
+
+      request->sent = request->requested;
+      request->requested = LED_STATE_UNKNOWN;
+      request->force = FALSE;
+
+      if (!mce_proxy)
+        continue;
+
+      call_data = g_slice_new (LedCallData);
+      call_data->name = g_strdup (name);
+      call_data->activate = request->sent == LED_STATE_ACTIVE;
+
+      dbus_g_proxy_begin_call (mce_proxy,
+                               call_data->activate ? MCE_ACTIVATE_LED_PATTERN : MCE_DEACTIVATE_LED_PATTERN,
+                               (DBusGProxyCallNotify) request_notify,
+                               call_data,
+                               (GDestroyNotify) led_call_data_free,
+                               G_TYPE_STRING,
+                               name,
+                               G_TYPE_INVALID);
     }
+
+  return FALSE;
 }
 
+/*
+ * Queue an activation or deactivation request for pattern @name. If @force
+ * is not set the request is only sent when it changes the state of the
+ * pattern in MCE.
+ */
 static void
-deactivate_pattern (HDLedPattern *pattern)
+queue_request (const gchar *name,
+               gboolean     activate,
+               gboolean     force)
 {
-  HDLedPatternPrivate *priv = pattern->priv;
-  DBusGProxy *mce_proxy;
+  static guint flush_source = 0;
+  GHashTable *request_map = get_request_map ();
+  LedRequest *request;
 
-  mce_proxy = get_mce_proxy ();
+  request = g_hash_table_lookup (request_map,
+                                 name);
+  if (!request)
+    {
+      request = g_slice_new0 (LedRequest);
+      g_hash_table_insert (request_map,
+                           g_strdup (name),
+                           request);
+    }
+
+  if (request->requested == LED_STATE_UNKNOWN)
+    request->first = activate ? LED_STATE_ACTIVE : LED_STATE_INACTIVE;
+
+  /* A pattern activated and deactivated again before the flush is not
+   * sent, even if its state in MCE is unknown */
+  if (!activate && !force && !request->force &&
+      request->sent == LED_STATE_UNKNOWN &&
+      request->first == LED_STATE_ACTIVE)
+    {
+      request->requested = LED_STATE_UNKNOWN;
+      return;
+    }
+
+  request->requested = activate ? LED_STATE_ACTIVE : LED_STATE_INACTIVE;
+  if (force)
+    request->force = TRUE;
+
+  if (!flush_source)
+    flush_source = g_timeout_add (LED_REQUEST_DELAY,
+                                  flush_requests,
+                                  &flush_source);
+}
+
+static void
+led_request_free (LedRequest *request)
+{
+  g_slice_free (LedRequest, request);
+}
+
+static GHashTable *
+get_request_map (void)
+{
+  static GHashTable *request_map = NULL;
 
-  if (mce_proxy)
+  if (G_UNLIKELY (!request_map))
     {
-      g_debug ("%s. Dectivate LED pattern: %s", __FUNCTION__, priv->name);
-
-      dbus_g_proxy_call_no_reply (mce_proxy,
-                                  MCE_DEACTIVATE_LED_PATTERN,
-                                  G_TYPE_STRING,
-                                  priv->name,
-                                  G_TYPE_INVALID,
-                                  G_TYPE_INVALID);
+      request_map = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           (GDestroyNotify) g_free,
+                                           (GDestroyNotify) led_request_free);
     }
+
+  return request_map;
 }
 
 static DBusGProxy *
@@ -195,7 +355,7 @@ get_mce_proxy (void)
 {
   static DBusGProxy *mce_proxy = NULL;
 
-  if (G_UNLIKELY (!mce_proxy))
+  if (G_UNLIKELY (!mce_proxy) && !stubbed)
     {
       DBusGConnection *system_dbus = hd_get_system_dbus_connection ();
 
@@ -273,25 +433,24 @@ const static char *default_notification_pattern[] =
 void
 hd_led_pattern_deactivate_all (void)
 {
-  DBusGProxy *mce_proxy;
   guint i;
 
-  mce_proxy = get_mce_proxy ();
+  /* The patterns could also be activated by other processes,
+   * so always send the deactivation */
+  for (i = 0; default_notification_pattern[i]; i++)
+    queue_request (default_notification_pattern[i], FALSE, TRUE);
+}
 
-  if (mce_proxy)
-    {
-      for (i = 0; default_notification_pattern[i]; i++)
-        {
-          g_debug ("%s. Dectivate LED pattern: %s",
-                   __FUNCTION__,
-                   default_notification_pattern[i]);
-
-          dbus_g_proxy_call_no_reply (mce_proxy,
-                                      MCE_DEACTIVATE_LED_PATTERN,
-                                      G_TYPE_STRING,
-                                      default_notification_pattern[i],
-                                      G_TYPE_INVALID,
-                                      G_TYPE_INVALID);
-        }
-    }
+/**
+ * hd_led_pattern_set_stubbed:
+ * @stub: %TRUE to stub the patterns
+ *
+ * Requests for stubbed patterns are collected as usual but never sent
+ * to MCE, so the LED is not touched. Used to replay notification traces
+ * on a device. Call it before any pattern is activated.
+ */
+void
+hd_led_pattern_set_stubbed (gboolean stub)
+{
+  stubbed = stub;
 }
@@ -56,6 +56,8 @@ HDLedPattern    *hd_led_pattern_get            (const gchar  *name);
 
 void             hd_led_pattern_deactivate_all (void);
 
+void             hd_led_pattern_set_stubbed    (gboolean      stub);
+
 G_END_DECLS
 
 #endif
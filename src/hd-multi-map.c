@@ -31,16 +31,14 @@
 
 struct _HDMultiMapPrivate
 {
+  /* Maps each key to a hash table of values, which maps each
+   * value to the number of times it was inserted */
   GHashTable *map;
 };
 
 static void hd_multi_map_dispose     (GObject *object);
 
-static GList *remove_value_from_list (GList   *list,
-                                      GObject *value);
-
-static void remove_and_free_all_keys_and_values (GHashTable *map);
-static void free_values_list (GList *list);
+static GHashTable *values_new (void);
 
 G_DEFINE_TYPE (HDMultiMap, hd_multi_map, G_TYPE_INITIALLY_UNOWNED);
 
@@ -75,7 +73,7 @@ hd_multi_map_init (HDMultiMap *multi_map)
   priv->map = g_hash_table_new_full (g_direct_hash,
                                      g_direct_equal,
                                      (GDestroyNotify) g_object_unref,
-                                     NULL);
+                                     (GDestroyNotify) g_hash_table_destroy);
 }
 
 static void
@@ -85,30 +83,47 @@ hd_multi_map_dispose (GObject *object)
   HDMultiMapPrivate *priv = multi_map->priv;
 
   if (priv->map)
-    {
-      hd_multi_map_remove_all (multi_map);
-      priv->map = (g_hash_table_destroy (priv->map), NULL);
-    }
+    priv->map = (g_hash_table_destroy (priv->map), NULL);
 
   G_OBJECT_CLASS (hd_multi_map_parent_class)->dispose (object);
 }
 
+static GHashTable *
+values_new (void)
+{
+  return g_hash_table_new_full (g_direct_hash,
+                                g_direct_equal,
+                                (GDestroyNotify) g_object_unref,
+                                NULL);
+}
+
 void
 hd_multi_map_insert (HDMultiMap *multi_map,
                      GObject    *key,
                      GObject    *value)
 {
   HDMultiMapPrivate *priv = multi_map->priv;
-  GList *values;
+  GHashTable *values;
+  guint count;
 
   g_return_if_fail (HD_IS_MULTI_MAP (multi_map));
 
   values = g_hash_table_lookup (priv->map,
                                 key);
-  values = g_list_append (values, g_object_ref (value));
-  g_hash_table_insert (priv->map,
-                       g_object_ref (key),
-                       values);
+  if (!values)
+    {
+      values = values_new ();
+      g_hash_table_insert (priv->map,
+                           g_object_ref (key),
+                           values);
+    }
+
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (values,
+                                                 value));
+  /* An existing key is kept and the passed reference released */
+  g_hash_table_insert (values,
+                       g_object_ref (value),
+                       GUINT_TO_POINTER (count + 1));
 }
 
 void
@@ -117,67 +132,188 @@ hd_multi_map_remove (HDMultiMap *multi_map,
                      GObject    *value)
 {
   HDMultiMapPrivate *priv = multi_map->priv;
-  GList *values;
+  GHashTable *values;
+  guint count;
 
   g_return_if_fail (HD_IS_MULTI_MAP (multi_map));
 
   values = g_hash_table_lookup (priv->map,
                                 key);
-  values = remove_value_from_list (values,
-                                   value);
-  if (values)
-    g_hash_table_insert (priv->map,
-                         g_object_ref (key),
-                         values);
-  else
+  if (!values)
+    return;
+
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (values,
+                                                 value));
+  if (count > 1)
+    g_hash_table_insert (values,
+                         g_object_ref (value),
+                         GUINT_TO_POINTER (count - 1));
+  else if (count == 1)
+    g_hash_table_remove (values,
+                         value);
+
+  if (!g_hash_table_size (values))
     g_hash_table_remove (priv->map,
                          key);
 }
 
-static GList *
-remove_value_from_list (GList   *list,
-                        GObject *value)
+void
+hd_multi_map_remove_all (HDMultiMap *multi_map)
 {
-  GList *link;
+  HDMultiMapPrivate *priv = multi_map->priv;
 
-  link = g_list_find (list, value);
-  if (link)
-    {
-      g_object_unref (link->data);
-      list = g_list_delete_link (list, link);
-    }
+  g_return_if_fail (HD_IS_MULTI_MAP (multi_map));
+
+  g_hash_table_remove_all (priv->map);
+}
+
+gboolean
+hd_multi_map_contains (HDMultiMap *multi_map,
+                       GObject    *key,
+                       GObject    *value)
+{
+  HDMultiMapPrivate *priv = multi_map->priv;
+  GHashTable *values;
+
+  g_return_val_if_fail (HD_IS_MULTI_MAP (multi_map), FALSE);
+
+  values = g_hash_table_lookup (priv->map,
+                                key);
+
+  return values && g_hash_table_lookup (values, value);
+}
+
+/*
+ * Returns the number of distinct values stored for @key.
+ */
+guint
+hd_multi_map_size (HDMultiMap *multi_map,
+                   GObject    *key)
+{
+  HDMultiMapPrivate *priv = multi_map->priv;
+  GHashTable *values;
+
+  g_return_val_if_fail (HD_IS_MULTI_MAP (multi_map), 0);
+
+  values = g_hash_table_lookup (priv->map,
+                                key);
 
-  return list;
+  return values ? g_hash_table_size (values) : 0;
 }
 
+/*
+ * Calls @func for each distinct value stored for @key. The map must not
+ * be modified from @func.
+ */
 void
-hd_multi_map_remove_all (HDMultiMap *multi_map)
+hd_multi_map_foreach (HDMultiMap *multi_map,
+                      GObject    *key,
+                      GFunc       func,
+                      gpointer    data)
 {
   HDMultiMapPrivate *priv = multi_map->priv;
+  GHashTable *values;
+  GHashTableIter iter;
+  gpointer value;
 
   g_return_if_fail (HD_IS_MULTI_MAP (multi_map));
+  g_return_if_fail (func != NULL);
+
+  values = g_hash_table_lookup (priv->map,
+                                key);
+  if (!values)
+    return;
 
-  remove_and_free_all_keys_and_values (priv->map);
+  g_hash_table_iter_init (&iter, values);
+  while (g_hash_table_iter_next (&iter, &value, NULL))
+    func (value, data);
 }
 
+#ifdef COMPILE_FOR_TEST
+#define N_VALUES 10000
+
 static void
-remove_and_free_all_keys_and_values (GHashTable *map)
+test_multi_map_perf (void)
 {
-  GHashTableIter iter;
-  gpointer key, values;
-
-  g_hash_table_iter_init (&iter, map);
-  while (g_hash_table_iter_next (&iter, &key, &values)) 
-    {
-      free_values_list (values);
-      g_hash_table_iter_remove (&iter);
-    }
+  HDMultiMap *multi_map;
+  GObject *key;
+  GObject **values;
+  guint i;
+  gdouble elapsed;
+
+  multi_map = hd_multi_map_new ();
+  key = g_object_new (G_TYPE_OBJECT, NULL);
+  values = g_new (GObject *, N_VALUES);
+
+  for (i = 0; i < N_VALUES; i++)
+    values[i] = g_object_new (G_TYPE_OBJECT, NULL);
+
+  g_test_timer_start ();
+  for (i = 0; i < N_VALUES; i++)
+    hd_multi_map_insert (multi_map, key, values[i]);
+  elapsed = g_test_timer_elapsed ();
+  g_test_minimized_result (elapsed, "Insert %d values: %f s", N_VALUES, elapsed);
+
+  g_assert_cmpuint (hd_multi_map_size (multi_map, key), ==, N_VALUES);
+
+  g_test_timer_start ();
+  for (i = 0; i < N_VALUES; i++)
+    g_assert (hd_multi_map_contains (multi_map, key, values[i]));
+  elapsed = g_test_timer_elapsed ();
+  g_test_minimized_result (elapsed, "Lookup %d values: %f s", N_VALUES, elapsed);
+
+  /* Remove in reverse insertion order, the worst case for a list
+   * which values are appended to */
+  g_test_timer_start ();
+  for (i = 0; i < N_VALUES; i++)
+    hd_multi_map_remove (multi_map, key, values[N_VALUES - 1 - i]);
+  elapsed = g_test_timer_elapsed ();
+  g_test_minimized_result (elapsed, "Remove %d values: %f s", N_VALUES, elapsed);
+
+  g_assert_cmpuint (hd_multi_map_size (multi_map, key), ==, 0);
+
+  for (i = 0; i < N_VALUES; i++)
+    g_object_unref (values[i]);
+  g_free (values);
+  g_object_unref (key);
+  g_object_unref (multi_map);
 }
 
 static void
-free_values_list (GList *list)
+test_multi_map_count (void)
 {
-  g_list_foreach (list, (GFunc) g_object_unref, NULL);
-  g_list_free (list);
+  HDMultiMap *multi_map;
+  GObject *key, *value;
+
+  multi_map = hd_multi_map_new ();
+  key = g_object_new (G_TYPE_OBJECT, NULL);
+  value = g_object_new (G_TYPE_OBJECT, NULL);
+
+  hd_multi_map_insert (multi_map, key, value);
+  hd_multi_map_insert (multi_map, key, value);
+  g_assert_cmpuint (hd_multi_map_size (multi_map, key), ==, 1);
+
+  hd_multi_map_remove (multi_map, key, value);
+  g_assert (hd_multi_map_contains (multi_map, key, value));
+
+  hd_multi_map_remove (multi_map, key, value);
+  g_assert (!hd_multi_map_contains (multi_map, key, value));
+
+  g_object_unref (value);
+  g_object_unref (key);
+  g_object_unref (multi_map);
 }
 
+int main (int argc, char **argv)
+{
+  g_type_init ();
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/multi-map/count", test_multi_map_count);
+  if (g_test_perf ())
+    g_test_add_func ("/multi-map/perf", test_multi_map_perf);
+
+  return g_test_run ();
+}
+
+#endif
@@ -61,6 +61,15 @@ void        hd_multi_map_remove     (HDMultiMap *multi_map,
                                      GObject    *key,
                                      GObject    *value);
 void        hd_multi_map_remove_all (HDMultiMap *multi_map);
+gboolean    hd_multi_map_contains   (HDMultiMap *multi_map,
+                                     GObject    *key,
+                                     GObject    *value);
+guint       hd_multi_map_size       (HDMultiMap *multi_map,
+                                     GObject    *key);
+void        hd_multi_map_foreach    (HDMultiMap *multi_map,
+                                     GObject    *key,
+                                     GFunc       func,
+                                     gpointer    data);
 
 G_END_DECLS
 
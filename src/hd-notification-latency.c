@@ -0,0 +1,398 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+/*
+ * Measures how long a notification spends in each stage, from the
+ * D-Bus Notify call to the map of its preview window and the start of
+ * its sound/vibra event.
+ *
+ * Each stage is timed from the stage it follows:
+ *
+ *  SENT      time set by the sender in the "sent-time" hint (us since the epoch)
+ *  RECEIVED  Notify handler called                  (after SENT)
+ *  STORED    notification created and saved         (after RECEIVED)
+ *  REPLIED   D-Bus reply sent                       (after STORED)
+ *  EMITTED   "notified" emitted from the idle       (after REPLIED)
+ *  GROUPED   HDIncomingEvents added it to a group   (after EMITTED)
+ *  MAPPED    preview window mapped                  (after GROUPED)
+ *  SOUND     PlayEvent accepted by the daemon       (after GROUPED)
+ *
+ * The durations go into histograms with power of two buckets, so
+ * recording costs a few integer operations. An optional trace file gets
+ * one line per notification with the time of each stage relative to
+ * RECEIVED, or '-' if the stage was not reached.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "hd-notification-latency.h"
+
+/* Bucket i counts durations below 2^(i+1) us, the last one all longer */
+#define HISTOGRAM_BUCKETS 24
+
+/* Notifications which are not closed are dropped from the table after
+ * RECORD_MAX_AGE seconds once there are more than MAX_RECORDS */
+#define MAX_RECORDS 256
+#define RECORD_MAX_AGE 60
+
+#define TOTAL_HISTOGRAM HD_NOTIFICATION_LATENCY_N_STAGES
+
+typedef struct
+{
+  guint  buckets[HISTOGRAM_BUCKETS];
+  guint  count;
+  gint64 max;
+} Histogram;
+
+typedef struct
+{
+  guint  id;
+  gint64 times[HD_NOTIFICATION_LATENCY_N_STAGES];
+} Record;
+
+static const HDNotificationLatencyStage stage_parents[] =
+{
+  HD_NOTIFICATION_LATENCY_SENT,
+  HD_NOTIFICATION_LATENCY_SENT,
+  HD_NOTIFICATION_LATENCY_RECEIVED,
+  HD_NOTIFICATION_LATENCY_STORED,
+  HD_NOTIFICATION_LATENCY_REPLIED,
+  HD_NOTIFICATION_LATENCY_EMITTED,
+  HD_NOTIFICATION_LATENCY_GROUPED,
+  HD_NOTIFICATION_LATENCY_GROUPED
+};
+
+/* Names of the histograms, the duration before a stage is named after
+ * what happens in it */
+static const gchar *histogram_names[] =
+{
+  "sent",
+  "dbus",
+  "store",
+  "reply",
+  "emit",
+  "group",
+  "map",
+  "sound",
+  "total",
+  NULL
+};
+
+static Histogram histograms[HD_NOTIFICATION_LATENCY_N_STAGES + 1];
+static GHashTable *records = NULL;
+static FILE *trace_file = NULL;
+
+gint64
+hd_notification_latency_now (void)
+{
+  GTimeVal tv;
+
+  g_get_current_time (&tv);
+
+  return (gint64) tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+}
+
+static void
+histogram_add (Histogram *histogram,
+               gint64     duration)
+{
+  guint bucket = 0;
+
+  duration = MAX (duration, 0);
+
+  while (bucket < HISTOGRAM_BUCKETS - 1 && duration >> (bucket + 1))
+    bucket++;
+
+  histogram->buckets[bucket]++;
+  histogram->count++;
+  histogram->max = MAX (histogram->max, duration);
+}
+
+/* Returns the upper bound of the bucket containing the percentile */
+static guint
+histogram_percentile (Histogram *histogram,
+                      guint      percent)
+{
+  guint rank, seen = 0;
+  guint bucket;
+
+  if (!histogram->count)
+    return 0;
+
+  rank = ((guint64) histogram->count * percent + 99) / 100;
+
+  for (bucket = 0; bucket < HISTOGRAM_BUCKETS - 1; bucket++)
+    {
+      seen += histogram->buckets[bucket];
+      if (seen >= rank)
+        break;
+    }
+
+  return (guint) MIN ((G_GINT64_CONSTANT (2) << bucket) - 1, histogram->max);
+}
+
+static void
+record_write_trace (Record *record)
+{
+  guint stage;
+
+  if (!trace_file)
+    return;
+
+  fprintf (trace_file, "%u\t%" G_GINT64_FORMAT,
+           record->id,
+           record->times[HD_NOTIFICATION_LATENCY_RECEIVED]);
+
+  for (stage = 0; stage < HD_NOTIFICATION_LATENCY_N_STAGES; stage++)
+    {
+      if (stage == HD_NOTIFICATION_LATENCY_RECEIVED)
+        continue;
+
+      if (record->times[stage])
+        fprintf (trace_file, "\t%" G_GINT64_FORMAT,
+                 record->times[stage] - record->times[HD_NOTIFICATION_LATENCY_RECEIVED]);
+      else
+        fputs ("\t-", trace_file);
+    }
+
+  fputc ('\n', trace_file);
+}
+
+static void
+record_write_trace_cb (gpointer  key,
+                       Record   *record,
+                       gpointer  data)
+{
+  record_write_trace (record);
+}
+
+static void
+record_free (Record *record)
+{
+  record_write_trace (record);
+
+  g_slice_free (Record, record);
+}
+
+static gboolean
+record_expired (gpointer  key,
+                Record   *record,
+                gint64   *now)
+{
+  return *now - record->times[HD_NOTIFICATION_LATENCY_RECEIVED] >
+         (gint64) RECORD_MAX_AGE * G_USEC_PER_SEC;
+}
+
+/**
+ * hd_notification_latency_begin:
+ * @id: id of a new notification
+ * @received: time the Notify call was received
+ * @sent: time the sender sent the notification or 0 if unknown
+ *
+ * Starts measuring the stages of the notification @id.
+ */
+void
+hd_notification_latency_begin (guint  id,
+                               gint64 received,
+                               gint64 sent)
+{
+  Record *record;
+
+  if (G_UNLIKELY (!records))
+    records = g_hash_table_new_full (g_direct_hash,
+                                     g_direct_equal,
+                                     NULL,
+                                     (GDestroyNotify) record_free);
+
+  if (g_hash_table_size (records) >= MAX_RECORDS)
+    g_hash_table_foreach_remove (records,
+                                 (GHRFunc) record_expired,
+                                 &received);
+
+  record = g_slice_new0 (Record);
+  record->id = id;
+  record->times[HD_NOTIFICATION_LATENCY_SENT] = sent;
+  record->times[HD_NOTIFICATION_LATENCY_RECEIVED] = received;
+
+  if (sent)
+    histogram_add (&histograms[HD_NOTIFICATION_LATENCY_RECEIVED],
+                   received - sent);
+
+  g_hash_table_replace (records, GUINT_TO_POINTER (id), record);
+}
+
+/**
+ * hd_notification_latency_mark:
+ * @id: id of the notification
+ * @stage: the stage the notification reached
+ *
+ * Records the current time as the time @id reached @stage. Only the
+ * first time a stage is reached is recorded.
+ */
+void
+hd_notification_latency_mark (guint                      id,
+                              HDNotificationLatencyStage stage)
+{
+  HDNotificationLatencyStage parent;
+  Record *record;
+  gint64 now;
+
+  g_return_if_fail (stage > HD_NOTIFICATION_LATENCY_RECEIVED &&
+                    stage < HD_NOTIFICATION_LATENCY_N_STAGES);
+
+  if (!records)
+    return;
+
+  record = g_hash_table_lookup (records, GUINT_TO_POINTER (id));
+  if (!record || record->times[stage])
+    return;
+
+  now = hd_notification_latency_now ();
+  record->times[stage] = now;
+
+  /* Measure from the last reached stage before this one */
+  for (parent = stage_parents[stage];
+       parent > HD_NOTIFICATION_LATENCY_RECEIVED && !record->times[parent];
+       parent = stage_parents[parent]);
+
+  histogram_add (&histograms[stage], now - record->times[parent]);
+
+  if (stage == HD_NOTIFICATION_LATENCY_MAPPED)
+    histogram_add (&histograms[TOTAL_HISTOGRAM],
+                   now - record->times[HD_NOTIFICATION_LATENCY_RECEIVED]);
+}
+
+/**
+ * hd_notification_latency_end:
+ * @id: id of the notification
+ *
+ * Stops measuring the notification @id, it is written to the trace file.
+ */
+void
+hd_notification_latency_end (guint id)
+{
+  if (records)
+    g_hash_table_remove (records, GUINT_TO_POINTER (id));
+}
+
+/**
+ * hd_notification_latency_get_stats:
+ * @stages: return location for the %NULL terminated histogram names
+ * @counts: return location for the number of durations in each histogram
+ * @p50: return location for the median of each histogram in us
+ * @p99: return location for the 99th percentile of each histogram in us
+ * @max: return location for the longest duration of each histogram in us
+ *
+ * Returns the durations recorded for the stages. The percentiles are the
+ * upper bound of their histogram bucket. Free the result with
+ * g_strfreev () and g_array_free ().
+ */
+void
+hd_notification_latency_get_stats (gchar  ***stages,
+                                   GArray  **counts,
+                                   GArray  **p50,
+                                   GArray  **p99,
+                                   GArray  **max)
+{
+  guint i;
+
+  *stages = g_strdupv ((gchar **) histogram_names);
+  *counts = g_array_sized_new (FALSE, FALSE, sizeof (guint), G_N_ELEMENTS (histograms));
+  *p50 = g_array_sized_new (FALSE, FALSE, sizeof (guint), G_N_ELEMENTS (histograms));
+  *p99 = g_array_sized_new (FALSE, FALSE, sizeof (guint), G_N_ELEMENTS (histograms));
+  *max = g_array_sized_new (FALSE, FALSE, sizeof (guint), G_N_ELEMENTS (histograms));
+
+  for (i = 0; i < G_N_ELEMENTS (histograms); i++)
+    {
+      guint value;
+
+      g_array_append_val (*counts, histograms[i].count);
+
+      value = histogram_percentile (&histograms[i], 50);
+      g_array_append_val (*p50, value);
+
+      value = histogram_percentile (&histograms[i], 99);
+      g_array_append_val (*p99, value);
+
+      value = (guint) MIN (histograms[i].max, G_MAXUINT);
+      g_array_append_val (*max, value);
+    }
+}
+
+/**
+ * hd_notification_latency_start_trace:
+ * @filename: the trace file
+ * @error: return location for a #GError or %NULL
+ *
+ * Writes the stage times of each notification to @filename, when it is
+ * closed.
+ *
+ * Returns: %TRUE if the file could be created
+ */
+gboolean
+hd_notification_latency_start_trace (const gchar  *filename,
+                                     GError      **error)
+{
+  guint i;
+
+  g_return_val_if_fail (filename, FALSE);
+
+  hd_notification_latency_stop_trace ();
+
+  trace_file = fopen (filename, "w");
+  if (!trace_file)
+    {
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   g_file_error_from_errno (errno),
+                   "Could not create notification latency trace %s",
+                   filename);
+      return FALSE;
+    }
+
+  fputs ("id\treceived", trace_file);
+  for (i = 0; i < HD_NOTIFICATION_LATENCY_N_STAGES; i++)
+    if (i != HD_NOTIFICATION_LATENCY_RECEIVED)
+      fprintf (trace_file, "\t%s", histogram_names[i]);
+  fputc ('\n', trace_file);
+
+  return TRUE;
+}
+
+void
+hd_notification_latency_stop_trace (void)
+{
+  if (!trace_file)
+    return;
+
+  /* Write the notifications which are still open */
+  if (records)
+    g_hash_table_foreach (records, (GHFunc) record_write_trace_cb, NULL);
+
+  trace_file = (fclose (trace_file), NULL);
+}
@@ -0,0 +1,66 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_NOTIFICATION_LATENCY_H__
+#define __HD_NOTIFICATION_LATENCY_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Stages of a notification, each one is measured from the stage before
+ * it (see hd-notification-latency.c) */
+typedef enum
+{
+  HD_NOTIFICATION_LATENCY_SENT,
+  HD_NOTIFICATION_LATENCY_RECEIVED,
+  HD_NOTIFICATION_LATENCY_STORED,
+  HD_NOTIFICATION_LATENCY_REPLIED,
+  HD_NOTIFICATION_LATENCY_EMITTED,
+  HD_NOTIFICATION_LATENCY_GROUPED,
+  HD_NOTIFICATION_LATENCY_MAPPED,
+  HD_NOTIFICATION_LATENCY_SOUND,
+  HD_NOTIFICATION_LATENCY_N_STAGES
+} HDNotificationLatencyStage;
+
+gint64   hd_notification_latency_now         (void);
+
+void     hd_notification_latency_begin       (guint                        id,
+                                              gint64                       received,
+                                              gint64                       sent);
+void     hd_notification_latency_mark        (guint                        id,
+                                              HDNotificationLatencyStage   stage);
+void     hd_notification_latency_end         (guint                        id);
+
+void     hd_notification_latency_get_stats   (gchar                     ***stages,
+                                              GArray                     **counts,
+                                              GArray                     **p50,
+                                              GArray                     **p99,
+                                              GArray                     **max);
+
+gboolean hd_notification_latency_start_trace (const gchar                 *filename,
+                                              GError                     **error);
+void     hd_notification_latency_stop_trace  (void);
+
+G_END_DECLS
+
+#endif
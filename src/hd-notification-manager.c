@@ -32,6 +32,8 @@
 
 #include "hd-notification-manager.h"
 #include "hd-notification-manager-glue.h"
+#include "hd-notification-latency.h"
+#include "hd-notification-trace.h"
 #include "hd-marshal.h"
 
 #include <libgnomevfs/gnome-vfs.h>
@@ -111,6 +113,9 @@ struct _HDNotificationManagerPrivate
 
 };
 
+/* Set by hd_notification_manager_set_headless () */
+static gboolean headless = FALSE;
+
 /* IPC structure between _insert_hints() and _insert_hint(). */
 typedef struct 
 {
@@ -930,6 +935,29 @@ hd_notification_manager_setup_interface (HDNotificationManager *nm,
                                        G_OBJECT (nm));
 }
 
+static void
+hd_notification_manager_db_open (HDNotificationManager *nm,
+                                 const gchar           *filename)
+{
+  guint result;
+
+  result = sqlite3_open (filename, &nm->priv->db);
+
+  if (result != SQLITE_OK)
+    {
+      g_warning ("Can't open database: %s", sqlite3_errmsg (nm->priv->db));
+      sqlite3_close (nm->priv->db);
+      nm->priv->db = NULL;
+    } else {
+        result = hd_notification_manager_db_create (nm);
+
+        if (result != SQLITE_OK)
+          {
+            g_warning ("Can't create database: %s", sqlite3_errmsg (nm->priv->db));
+          }
+    }
+}
+
 static void
 hd_notification_manager_init (HDNotificationManager *nm)
 {
@@ -948,6 +976,16 @@ hd_notification_manager_init (HDNotificationManager *nm)
                                                    NULL,
                                                    (GDestroyNotify) g_object_unref);
 
+  nm->priv->db = NULL;
+
+  /* Neither take the bus names from the running hildon-home nor touch
+   * its stored notifications */
+  if (headless)
+    {
+      hd_notification_manager_db_open (nm, ":memory:");
+      return;
+    }
+
   nm->priv->connection = dbus_g_bus_get (DBUS_BUS_SESSION, &error);
   if (error != NULL)
     {
@@ -975,8 +1013,6 @@ hd_notification_manager_init (HDNotificationManager *nm)
   g_debug ("%s registered to dbus at %s", HD_NOTIFICATION_MANAGER_DBUS_NAME,
            HD_NOTIFICATION_MANAGER_DBUS_PATH);
 
-  nm->priv->db = NULL;
-
   config_dir = g_build_filename (g_get_home_dir (),
                                  ".config",
                                  "hildon-desktop",
@@ -994,23 +1030,9 @@ hd_notification_manager_init (HDNotificationManager *nm)
                                            "notifications.db",
                                            NULL); 
 
-      result = sqlite3_open (notifications_db, &nm->priv->db);
+      hd_notification_manager_db_open (nm, notifications_db);
 
       g_free (notifications_db);
-
-      if (result != SQLITE_OK)
-        {
-          g_warning ("Can't open database: %s", sqlite3_errmsg (nm->priv->db));
-          sqlite3_close (nm->priv->db);
-          nm->priv->db = NULL;
-        } else {
-            result = hd_notification_manager_db_create (nm);
-
-            if (result != SQLITE_OK)
-              {
-                g_warning ("Can't create database: %s", sqlite3_errmsg (nm->priv->db));
-              }
-        }
     }
   else
     {
@@ -1086,6 +1108,17 @@ hd_notification_manager_class_init (HDNotificationManagerClass *class)
   g_type_class_add_private (class, sizeof (HDNotificationManagerPrivate));
 }
 
+/* Sends @message on the session bus, if hildon-home is connected to it */
+static void
+hd_notification_manager_send (HDNotificationManager *nm,
+                              DBusMessage           *message)
+{
+  if (nm->priv->connection)
+    dbus_connection_send (dbus_g_connection_get_connection (nm->priv->connection),
+                          message,
+                          NULL);
+}
+
 static DBusMessage *
 hd_notification_manager_create_signal (HDNotificationManager *nm, 
                                        guint id,
@@ -1116,14 +1149,14 @@ hd_notification_manager_notification_closed (HDNotificationManager *nm,
 
   if (message == NULL) return;
 
-  dbus_connection_send (dbus_g_connection_get_connection (nm->priv->connection), 
-                        message, 
-                        NULL);
+  hd_notification_manager_send (nm, message);
 
   dbus_message_unref (message);
 
   if (hd_notification_get_persistent (notification))
     hd_notification_manager_db_delete (nm, hd_notification_get_id (notification));
+
+  hd_notification_latency_end (hd_notification_get_id (notification));
 }
 
 static gboolean 
@@ -1173,6 +1206,22 @@ hd_notification_manager_get (void)
   return nm;
 }
 
+/**
+ * hd_notification_manager_set_headless:
+ * @headless_mode: %TRUE to keep the manager off the buses
+ *
+ * A headless manager does not register on the session and system
+ * buses, sends no signals or action callbacks and keeps persistent
+ * notifications in an in-memory database instead of notifications.db.
+ * Used to replay notification traces next to a running hildon-home.
+ * Call it before hd_notification_manager_get().
+ */
+void
+hd_notification_manager_set_headless (gboolean headless_mode)
+{
+  headless = headless_mode;
+}
+
 static void 
 copy_hash_table_item (gchar *key, GValue *value, GHashTable *new_hash_table)
 {
@@ -1190,6 +1239,9 @@ idle_emit (gpointer data)
 {
   HDNotificationManager *nm = hd_notification_manager_get ();
 
+  hd_notification_latency_mark (hd_notification_get_id (data),
+                                HD_NOTIFICATION_LATENCY_EMITTED);
+
   if (nm)
     g_signal_emit (nm, signals[NOTIFIED], 0, data, FALSE);
 
@@ -1209,6 +1261,61 @@ hd_notification_manager_notify (HDNotificationManager *nm,
                                 GHashTable            *hints,
                                 gint                   timeout, 
                                 DBusGMethodInvocation *context)
+{
+  gchar *sender;
+  guint new_id;
+
+  sender = dbus_g_method_get_sender (context);
+
+  new_id = hd_notification_manager_notify_from_sender (nm,
+                                                       app_name,
+                                                       id,
+                                                       icon,
+                                                       summary,
+                                                       body,
+                                                       actions,
+                                                       hints,
+                                                       timeout,
+                                                       sender);
+
+  hd_notification_trace_record_notify (app_name,
+                                       id,
+                                       new_id,
+                                       icon,
+                                       summary,
+                                       body,
+                                       actions,
+                                       hints,
+                                       timeout);
+
+  dbus_g_method_return (context, new_id);
+
+  hd_notification_latency_mark (new_id, HD_NOTIFICATION_LATENCY_REPLIED);
+
+  g_free (sender);
+
+  return TRUE;
+}
+
+/**
+ * hd_notification_manager_notify_from_sender:
+ *
+ * Does the work of the Notify D-Bus method for a notification from the
+ * D-Bus name @sender, which may be %NULL.
+ *
+ * Returns: the id of the notification
+ */
+guint
+hd_notification_manager_notify_from_sender (HDNotificationManager *nm,
+                                            const gchar           *app_name,
+                                            guint                  id,
+                                            const gchar           *icon,
+                                            const gchar           *summary,
+                                            const gchar           *body,
+                                            gchar                **actions,
+                                            GHashTable            *hints,
+                                            gint                   timeout,
+                                            const gchar           *sender)
 {
   GHashTable *hints_copy;
   GValue *hint;
@@ -1219,6 +1326,9 @@ hd_notification_manager_notify (HDNotificationManager *nm,
   HDNotification *notification;
   gboolean replace = FALSE;
   const gchar *category;
+  gint64 received, sent = 0;
+
+  received = hd_notification_latency_now ();
 
 /*  g_return_val_if_fail (summary != '\0', FALSE);
   g_return_val_if_fail (body != '\0', FALSE);*/
@@ -1238,6 +1348,11 @@ hd_notification_manager_notify (HDNotificationManager *nm,
   hint = g_hash_table_lookup (hints, "category");
   category = G_VALUE_HOLDS_STRING (hint) ? g_value_get_string (hint) : NULL;
 
+  /* Get "sent-time" hint, set by senders which trace latency */
+  hint = g_hash_table_lookup (hints, "sent-time");
+  if (G_VALUE_HOLDS_INT64 (hint))
+    sent = g_value_get_int64 (hint);
+
   /* Try to find an existing notification */
   if (id)
     {
@@ -1249,8 +1364,6 @@ hd_notification_manager_notify (HDNotificationManager *nm,
 
   if (!replace)
     {
-      gchar *sender;
-
       /* Test if we have a valid list of actions */
       for (i = 0; actions && actions[i] != NULL; i += 2)
         {
@@ -1295,10 +1408,10 @@ hd_notification_manager_notify (HDNotificationManager *nm,
           g_hash_table_insert (hints_copy, g_strdup ("time"), value);
         }
 
-      sender = dbus_g_method_get_sender (context);
-
       id = hd_notification_manager_next_id (nm);
 
+      hd_notification_latency_begin (id, received, sent);
+
       notification = hd_notification_new (id,
                                           icon,
                                           summary,
@@ -1330,9 +1443,10 @@ hd_notification_manager_notify (HDNotificationManager *nm,
                                              sender);
         }
 
+      hd_notification_latency_mark (id, HD_NOTIFICATION_LATENCY_STORED);
+
       g_strfreev (actions_copy);
       g_object_unref (notification);
-      g_free (sender);
     }
   else 
     {
@@ -1364,9 +1478,7 @@ hd_notification_manager_notify (HDNotificationManager *nm,
                      GUINT_TO_POINTER (id));
     }
 
-  dbus_g_method_return (context, id);
-
-  return TRUE;
+  return id;
 }
 
 gboolean
@@ -1507,6 +1619,20 @@ hd_notification_manager_get_server_info (HDNotificationManager *nm,
   return TRUE;
 }
 
+gboolean
+hd_notification_manager_get_latency_stats (HDNotificationManager  *nm,
+                                           gchar                ***stages,
+                                           GArray                **counts,
+                                           GArray                **p50,
+                                           GArray                **p99,
+                                           GArray                **max,
+                                           GError                **error)
+{
+  hd_notification_latency_get_stats (stages, counts, p50, p99, max);
+
+  return TRUE;
+}
+
 gboolean
 hd_notification_manager_close_notification (HDNotificationManager *nm,
                                             guint                  id, 
@@ -1546,6 +1672,20 @@ hd_notification_manager_close_notification (HDNotificationManager *nm,
     return FALSE;
 }
 
+/*
+ * The CloseNotification D-Bus method. Only closes of clients are
+ * recorded, the closes of hildon-home itself happen again on replay.
+ */
+gboolean
+hd_notification_manager_client_close_notification (HDNotificationManager *nm,
+                                                   guint                  id,
+                                                   GError               **error)
+{
+  hd_notification_trace_record_close (id);
+
+  return hd_notification_manager_close_notification (nm, id, error);
+}
+
 static guint
 parse_parameter (GScanner *scanner, DBusMessage *message)
 {
@@ -1687,6 +1827,9 @@ hd_notification_manager_call_action (HDNotificationManager *nm,
   g_return_if_fail (nm != NULL);
   g_return_if_fail (HD_IS_NOTIFICATION_MANAGER (nm));
 
+  hd_notification_trace_record_action (hd_notification_get_id (notification),
+                                       action_id);
+
   dbus_cb = hd_notification_get_dbus_cb (notification, action_id);
 
   if (dbus_cb != NULL)
@@ -1697,9 +1840,7 @@ hd_notification_manager_call_action (HDNotificationManager *nm,
 
   if (message != NULL)
     {
-      dbus_connection_send (dbus_g_connection_get_connection (nm->priv->connection), 
-                            message, 
-                            NULL);
+      hd_notification_manager_send (nm, message);
       dbus_message_unref (message);
     }
 
@@ -1714,9 +1855,7 @@ hd_notification_manager_call_action (HDNotificationManager *nm,
       dbus_message_append_args (message,
                                 DBUS_TYPE_STRING, &action_id,
                                 DBUS_TYPE_INVALID);
-      dbus_connection_send (dbus_g_connection_get_connection (nm->priv->connection), 
-                            message, 
-                            NULL);
+      hd_notification_manager_send (nm, message);
 
       dbus_message_unref (message);
     }
@@ -1755,9 +1894,7 @@ hd_notification_manager_call_dbus_callback (HDNotificationManager *nm,
 
   if (message != NULL)
     {
-      dbus_connection_send (dbus_g_connection_get_connection (nm->priv->connection), 
-                            message, 
-                            NULL);
+      hd_notification_manager_send (nm, message);
       dbus_message_unref (message);
     }
 }
@@ -1779,9 +1916,7 @@ hd_notification_manager_call_dbus_callback_with_arg (HDNotificationManager *nm,
       dbus_message_append_args (message,
                                 DBUS_TYPE_STRING, &arg,
                                 DBUS_TYPE_INVALID);
-      dbus_connection_send (dbus_g_connection_get_connection (nm->priv->connection), 
-                            message, 
-                            NULL);
+      hd_notification_manager_send (nm, message);
       dbus_message_unref (message);
     }
 }
@@ -1793,7 +1928,5 @@ hd_notification_manager_call_message (HDNotificationManager *nm,
   g_return_if_fail (HD_IS_NOTIFICATION_MANAGER (nm));
 
   if (message != NULL)
-    dbus_connection_send (dbus_g_connection_get_connection (nm->priv->connection), 
-                          message, 
-                          NULL);
+    hd_notification_manager_send (nm, message);
 } 
@@ -68,6 +68,8 @@ GType                  hd_notification_manager_get_type              (void);
 
 HDNotificationManager *hd_notification_manager_get                   (void);
 
+void                   hd_notification_manager_set_headless          (gboolean               headless_mode);
+
 void                  hd_notification_manager_db_load                (HDNotificationManager *nm);
 void                  hd_notification_manager_db_commit_now          (HDNotificationManager *nm);
 
@@ -81,6 +83,16 @@ gboolean               hd_notification_manager_notify                (HDNotifica
                                                                       GHashTable            *hints,
                                                                       gint                   timeout, 
                                                                       DBusGMethodInvocation *context);
+guint                  hd_notification_manager_notify_from_sender    (HDNotificationManager *nm,
+                                                                      const gchar           *app_name,
+                                                                      guint                  id,
+                                                                      const gchar           *icon,
+                                                                      const gchar           *summary,
+                                                                      const gchar           *body,
+                                                                      gchar                **actions,
+                                                                      GHashTable            *hints,
+                                                                      gint                   timeout,
+                                                                      const gchar           *sender);
 
 gboolean               hd_notification_manager_system_note_infoprint (HDNotificationManager *nm,
                                                                       const gchar           *message,
@@ -100,9 +112,20 @@ gboolean               hd_notification_manager_get_server_info       (HDNotifica
                                                                       gchar                **out_vendor,
                                                                       gchar                **out_version);
 
+gboolean               hd_notification_manager_get_latency_stats     (HDNotificationManager  *nm,
+                                                                      gchar                ***stages,
+                                                                      GArray                **counts,
+                                                                      GArray                **p50,
+                                                                      GArray                **p99,
+                                                                      GArray                **max,
+                                                                      GError                **error);
+
 gboolean               hd_notification_manager_close_notification    (HDNotificationManager *nm,
                                                                       guint id, 
                                                                       GError **error);
+gboolean               hd_notification_manager_client_close_notification (HDNotificationManager *nm,
+                                                                          guint                  id,
+                                                                          GError               **error);
 
 void                   hd_notification_manager_close_all             (HDNotificationManager *nm);
 
@@ -0,0 +1,824 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/*
+ * Records the notification traffic of hildon-home to a trace file and
+ * replays such a trace through HDNotificationManager and
+ * HDIncomingEvents.
+ *
+ * A trace is a text file. The first line is TRACE_HEADER, every
+ * following line is one event with tab separated fields. The first field
+ * is the kind of the event, the second one the time in ms since the
+ * start of the recording. Strings are escaped with g_strescape () and
+ * prefixed with '=', an empty field is a NULL string.
+ *
+ *  N time requested-id id app-name icon summary body timeout
+ *    n-actions [action label]... n-hints [key type value]...
+ *  C time id
+ *  A time id action-id
+ *  M time signal value
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <gtk/gtk.h>
+#include <glib-object.h>
+
+#include "hd-incoming-event-window.h"
+#include "hd-incoming-events.h"
+#include "hd-notification-manager.h"
+#include "hd-notification-trace.h"
+#include "hd-system-notifications.h"
+
+#define TRACE_HEADER "hildon-home-notification-trace 1"
+
+#define TRACE_NOTIFY 'N'
+#define TRACE_CLOSE  'C'
+#define TRACE_ACTION 'A'
+#define TRACE_MCE    'M'
+
+typedef struct
+{
+  gint64   time;
+  gchar  **fields;
+  guint    n_fields;
+} TraceEvent;
+
+typedef struct
+{
+  GQueue     *events;
+  gboolean    max_speed;
+  gboolean    headless;
+
+  /* Maps ids of the trace to ids of the replayed notifications */
+  GHashTable *ids;
+  /* Replayed notification id to time of the notify call in us */
+  GHashTable *notify_times;
+
+  gint64      start_time;
+  gint64      first_event_time;
+
+  guint       n_notify;
+  guint       n_close;
+  guint       n_action;
+  guint       n_mce;
+
+  gint64      notify_total;
+  gint64      notify_max;
+  guint       n_notified;
+  gint64      notified_total;
+  gint64      notified_max;
+
+  gulong      notified_handler;
+} TraceReplay;
+
+typedef struct
+{
+  GString *str;
+  guint    n;
+} TraceHints;
+
+static FILE *record_file = NULL;
+static gint64 record_start = 0;
+
+/* Returns the current time in microseconds */
+static gint64
+get_time_us (void)
+{
+  GTimeVal tv;
+
+  g_get_current_time (&tv);
+
+  return (gint64) tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+}
+
+static void
+append_string (GString     *line,
+               const gchar *value)
+{
+  g_string_append_c (line, '\t');
+
+  if (value)
+    {
+      gchar *escaped = g_strescape (value, NULL);
+
+      g_string_append_c (line, '=');
+      g_string_append (line, escaped);
+
+      g_free (escaped);
+    }
+}
+
+static GString *
+record_line_new (gchar kind)
+{
+  GString *line = g_string_new (NULL);
+
+  g_string_append_printf (line, "%c\t%" G_GINT64_FORMAT,
+                          kind,
+                          (get_time_us () - record_start) / 1000);
+
+  return line;
+}
+
+static void
+record_line_write (GString *line)
+{
+  g_string_append_c (line, '\n');
+
+  if (fwrite (line->str, 1, line->len, record_file) != line->len)
+    g_warning ("%s. Could not write to notification trace", __FUNCTION__);
+
+  g_string_free (line, TRUE);
+}
+
+/**
+ * hd_notification_trace_start_recording:
+ * @filename: the trace file
+ * @error: return location for a #GError, or %NULL
+ *
+ * Starts recording notification, action and MCE traffic to @filename.
+ *
+ * Returns: %TRUE if the trace file could be created
+ */
+gboolean
+hd_notification_trace_start_recording (const gchar  *filename,
+                                       GError      **error)
+{
+  g_return_val_if_fail (filename, FALSE);
+
+  hd_notification_trace_stop_recording ();
+
+  record_file = fopen (filename, "w");
+  if (!record_file)
+    {
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   g_file_error_from_errno (errno),
+                   "Could not create notification trace %s",
+                   filename);
+      return FALSE;
+    }
+
+  record_start = get_time_us ();
+
+  fputs (TRACE_HEADER "\n", record_file);
+
+  return TRUE;
+}
+
+void
+hd_notification_trace_stop_recording (void)
+{
+  if (record_file)
+    record_file = (fclose (record_file), NULL);
+}
+
+static void
+record_hint (const gchar *key,
+             GValue      *value,
+             TraceHints  *hints)
+{
+  gchar type;
+  gchar *str;
+
+  switch (G_VALUE_TYPE (value))
+    {
+      case G_TYPE_STRING:
+        type = 's';
+        str = g_value_dup_string (value);
+        break;
+      case G_TYPE_INT:
+        type = 'i';
+        str = g_strdup_printf ("%d", g_value_get_int (value));
+        break;
+      case G_TYPE_UINT:
+        type = 'u';
+        str = g_strdup_printf ("%u", g_value_get_uint (value));
+        break;
+      case G_TYPE_UCHAR:
+        type = 'y';
+        str = g_strdup_printf ("%u", g_value_get_uchar (value));
+        break;
+      case G_TYPE_BOOLEAN:
+        type = 'b';
+        str = g_strdup_printf ("%d", g_value_get_boolean (value));
+        break;
+      case G_TYPE_INT64:
+        type = 'x';
+        str = g_strdup_printf ("%" G_GINT64_FORMAT, g_value_get_int64 (value));
+        break;
+      default:
+        g_debug ("%s. Hint %s of type %s is not recorded",
+                 __FUNCTION__,
+                 key,
+                 G_VALUE_TYPE_NAME (value));
+        return;
+    }
+
+  append_string (hints->str, key);
+  g_string_append_printf (hints->str, "\t%c", type);
+  append_string (hints->str, str);
+  hints->n++;
+
+  g_free (str);
+}
+
+void
+hd_notification_trace_record_notify (const gchar  *app_name,
+                                     guint         requested_id,
+                                     guint         id,
+                                     const gchar  *icon,
+                                     const gchar  *summary,
+                                     const gchar  *body,
+                                     gchar       **actions,
+                                     GHashTable   *hints,
+                                     gint          timeout)
+{
+  GString *line;
+  TraceHints trace_hints = { NULL, 0 };
+  guint i, n_actions;
+
+  if (G_LIKELY (!record_file))
+    return;
+
+  line = record_line_new (TRACE_NOTIFY);
+
+  g_string_append_printf (line, "\t%u\t%u", requested_id, id);
+  append_string (line, app_name);
+  append_string (line, icon);
+  append_string (line, summary);
+  append_string (line, body);
+  g_string_append_printf (line, "\t%d", timeout);
+
+  n_actions = actions ? g_strv_length (actions) / 2 : 0;
+  g_string_append_printf (line, "\t%u", n_actions);
+  for (i = 0; i < n_actions; i++)
+    {
+      append_string (line, actions[2 * i]);
+      append_string (line, actions[2 * i + 1]);
+    }
+
+  trace_hints.str = g_string_new (NULL);
+  if (hints)
+    g_hash_table_foreach (hints, (GHFunc) record_hint, &trace_hints);
+  g_string_append_printf (line, "\t%u%s",
+                          trace_hints.n,
+                          trace_hints.str->str);
+  g_string_free (trace_hints.str, TRUE);
+
+  record_line_write (line);
+}
+
+void
+hd_notification_trace_record_close (guint id)
+{
+  GString *line;
+
+  if (G_LIKELY (!record_file))
+    return;
+
+  line = record_line_new (TRACE_CLOSE);
+  g_string_append_printf (line, "\t%u", id);
+
+  record_line_write (line);
+}
+
+void
+hd_notification_trace_record_action (guint        id,
+                                     const gchar *action_id)
+{
+  GString *line;
+
+  if (G_LIKELY (!record_file))
+    return;
+
+  line = record_line_new (TRACE_ACTION);
+  g_string_append_printf (line, "\t%u", id);
+  append_string (line, action_id);
+
+  record_line_write (line);
+}
+
+void
+hd_notification_trace_record_mce (const gchar *signal_name,
+                                  const gchar *value)
+{
+  GString *line;
+
+  if (G_LIKELY (!record_file))
+    return;
+
+  line = record_line_new (TRACE_MCE);
+  append_string (line, signal_name);
+  append_string (line, value);
+
+  record_line_write (line);
+}
+
+/* Returns the unescaped string of a field, or %NULL */
+static gchar *
+field_get_string (TraceEvent *event,
+                  guint       i)
+{
+  const gchar *field;
+
+  if (i >= event->n_fields)
+    return NULL;
+
+  field = event->fields[i];
+  if (field[0] != '=')
+    return NULL;
+
+  return g_strcompress (field + 1);
+}
+
+static gint64
+field_get_int (TraceEvent *event,
+               guint       i)
+{
+  if (i >= event->n_fields)
+    return 0;
+
+  return g_ascii_strtoll (event->fields[i], NULL, 10);
+}
+
+static void
+trace_event_free (TraceEvent *event)
+{
+  g_strfreev (event->fields);
+  g_slice_free (TraceEvent, event);
+}
+
+static void
+hint_value_free (GValue *value)
+{
+  g_value_unset (value);
+  g_free (value);
+}
+
+static GValue *
+hint_value_new (gchar        type,
+                const gchar *str)
+{
+  GValue *value = g_new0 (GValue, 1);
+
+  switch (type)
+    {
+      case 's':
+        g_value_init (value, G_TYPE_STRING);
+        g_value_set_string (value, str);
+        break;
+      case 'i':
+        g_value_init (value, G_TYPE_INT);
+        g_value_set_int (value, atoi (str));
+        break;
+      case 'u':
+        g_value_init (value, G_TYPE_UINT);
+        g_value_set_uint (value, strtoul (str, NULL, 10));
+        break;
+      case 'y':
+        g_value_init (value, G_TYPE_UCHAR);
+        g_value_set_uchar (value, atoi (str));
+        break;
+      case 'b':
+        g_value_init (value, G_TYPE_BOOLEAN);
+        g_value_set_boolean (value, atoi (str));
+        break;
+      case 'x':
+        g_value_init (value, G_TYPE_INT64);
+        g_value_set_int64 (value, g_ascii_strtoll (str, NULL, 10));
+        break;
+      default:
+        g_free (value);
+        return NULL;
+    }
+
+  return value;
+}
+
+static guint
+replay_lookup_id (TraceReplay *replay,
+                  guint        trace_id)
+{
+  return GPOINTER_TO_UINT (g_hash_table_lookup (replay->ids,
+                                                GUINT_TO_POINTER (trace_id)));
+}
+
+static void
+replay_notify (TraceReplay *replay,
+               TraceEvent  *event)
+{
+  guint requested_id, trace_id, id, n_actions, n_hints, i, f;
+  gchar *app_name, *icon, *summary, *body;
+  gchar **actions;
+  GHashTable *hints;
+  gint timeout;
+  gint64 start, duration;
+
+  requested_id = field_get_int (event, 2);
+  trace_id = field_get_int (event, 3);
+  app_name = field_get_string (event, 4);
+  icon = field_get_string (event, 5);
+  summary = field_get_string (event, 6);
+  body = field_get_string (event, 7);
+  timeout = field_get_int (event, 8);
+
+  n_actions = field_get_int (event, 9);
+  actions = g_new0 (gchar *, 2 * n_actions + 1);
+  for (i = 0, f = 10; i < 2 * n_actions; i++, f++)
+    {
+      actions[i] = field_get_string (event, f);
+      if (!actions[i])
+        actions[i] = g_strdup ("");
+    }
+
+  hints = g_hash_table_new_full (g_str_hash,
+                                 g_str_equal,
+                                 (GDestroyNotify) g_free,
+                                 (GDestroyNotify) hint_value_free);
+  n_hints = field_get_int (event, f++);
+  for (i = 0; i < n_hints && f + 2 < event->n_fields; i++, f += 3)
+    {
+      gchar *key = field_get_string (event, f);
+      gchar *str = field_get_string (event, f + 2);
+      GValue *value = key && str ? hint_value_new (event->fields[f + 1][0], str) : NULL;
+
+      if (value)
+        g_hash_table_insert (hints, key, value);
+      else
+        g_free (key);
+
+      g_free (str);
+    }
+
+  if (requested_id)
+    requested_id = replay_lookup_id (replay, requested_id);
+
+  start = get_time_us ();
+  id = hd_notification_manager_notify_from_sender (hd_notification_manager_get (),
+                                                   app_name,
+                                                   requested_id,
+                                                   icon,
+                                                   summary,
+                                                   body,
+                                                   actions,
+                                                   hints,
+                                                   timeout,
+                                                   NULL);
+  duration = get_time_us () - start;
+
+  replay->n_notify++;
+  replay->notify_total += duration;
+  replay->notify_max = MAX (replay->notify_max, duration);
+
+  g_hash_table_insert (replay->ids,
+                       GUINT_TO_POINTER (trace_id),
+                       GUINT_TO_POINTER (id));
+  g_hash_table_insert (replay->notify_times,
+                       GUINT_TO_POINTER (id),
+                       g_memdup (&start, sizeof (start)));
+
+  g_hash_table_destroy (hints);
+  g_strfreev (actions);
+  g_free (app_name);
+  g_free (icon);
+  g_free (summary);
+  g_free (body);
+}
+
+static void
+replay_event (TraceReplay *replay,
+              TraceEvent  *event)
+{
+  switch (event->fields[0][0])
+    {
+      case TRACE_NOTIFY:
+        replay_notify (replay, event);
+        break;
+
+      case TRACE_CLOSE:
+        replay->n_close++;
+        hd_notification_manager_close_notification (hd_notification_manager_get (),
+                                                    replay_lookup_id (replay,
+                                                                      field_get_int (event, 2)),
+                                                    NULL);
+        break;
+
+      case TRACE_ACTION:
+        /* Actions would call the applications. A close which follows
+         * is in the trace if the application sent it. */
+        replay->n_action++;
+        break;
+
+      case TRACE_MCE:
+        {
+          gchar *signal_name = field_get_string (event, 2);
+          gchar *value = field_get_string (event, 3);
+
+          replay->n_mce++;
+          if (signal_name && value)
+            hd_incoming_events_handle_mce_signal (hd_incoming_events_get (),
+                                                  signal_name,
+                                                  value);
+
+          g_free (signal_name);
+          g_free (value);
+        }
+        break;
+
+      default:
+        g_warning ("%s. Unknown trace event %s", __FUNCTION__, event->fields[0]);
+    }
+}
+
+static void
+replay_notified (HDNotificationManager *nm,
+                 HDNotification        *notification,
+                 gboolean               replayed_event,
+                 TraceReplay           *replay)
+{
+  gint64 *start, duration;
+
+  start = g_hash_table_lookup (replay->notify_times,
+                               GUINT_TO_POINTER (hd_notification_get_id (notification)));
+  if (!start)
+    return;
+
+  /* Includes the dispatch to HDIncomingEvents and its processing */
+  duration = get_time_us () - *start;
+
+  replay->n_notified++;
+  replay->notified_total += duration;
+  replay->notified_max = MAX (replay->notified_max, duration);
+
+  g_hash_table_remove (replay->notify_times,
+                       GUINT_TO_POINTER (hd_notification_get_id (notification)));
+}
+
+/* Returns the peak resident set size in kB */
+static guint
+get_peak_memory (void)
+{
+  gchar *status, *line;
+  guint peak = 0;
+
+  if (!g_file_get_contents ("/proc/self/status", &status, NULL, NULL))
+    return 0;
+
+  line = strstr (status, "VmHWM:");
+  if (line)
+    peak = strtoul (line + strlen ("VmHWM:"), NULL, 10);
+
+  g_free (status);
+
+  return peak;
+}
+
+static void
+replay_report (TraceReplay *replay)
+{
+  guint depth, max_depth, shown, created, reused, updates;
+  gint64 average_wait, max_wait, average_latency, max_latency;
+  guint suppressed_infoprints, merged_dialogs;
+
+  hd_incoming_events_get_preview_stats (&depth, &max_depth, &shown,
+                                        &average_wait, &max_wait);
+  hd_incoming_events_get_preview_latency (&average_latency, &max_latency);
+  hd_incoming_event_window_get_stats (&created, &reused, &updates);
+  hd_system_notifications_get_stats (&suppressed_infoprints, &merged_dialogs);
+
+#define AVERAGE(total, n) ((n) ? (total) / (n) : 0)
+  g_message ("Notification trace replayed in %" G_GINT64_FORMAT " ms\n"
+             "  events: %u notify, %u close, %u action, %u mce\n"
+             "  notify call: average %" G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT " us\n"
+             "  notify to processed: average %" G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT " us\n"
+             "  preview queue: %u shown, max depth %u, average wait %" G_GINT64_FORMAT " ms, max wait %" G_GINT64_FORMAT " ms\n"
+             "  preview show to map: average %" G_GINT64_FORMAT " ms, max %" G_GINT64_FORMAT " ms\n"
+             "  windows: %u created, %u reused, %u updates\n"
+             "  system notes: %u infoprints suppressed, %u dialogs merged\n"
+             "  peak memory: %u kB",
+             (get_time_us () - replay->start_time) / 1000,
+             replay->n_notify, replay->n_close, replay->n_action, replay->n_mce,
+             AVERAGE (replay->notify_total, replay->n_notify), replay->notify_max,
+             AVERAGE (replay->notified_total, replay->n_notified), replay->notified_max,
+             shown, max_depth, average_wait, max_wait,
+             average_latency, max_latency,
+             created, reused, updates,
+             suppressed_infoprints, merged_dialogs,
+             get_peak_memory ());
+#undef AVERAGE
+}
+
+static void
+replay_free (TraceReplay *replay)
+{
+  g_signal_handler_disconnect (hd_notification_manager_get (),
+                               replay->notified_handler);
+
+  g_queue_foreach (replay->events, (GFunc) trace_event_free, NULL);
+  g_queue_free (replay->events);
+  g_hash_table_destroy (replay->ids);
+  g_hash_table_destroy (replay->notify_times);
+
+  g_slice_free (TraceReplay, replay);
+}
+
+static void replay_schedule_next (TraceReplay *replay);
+
+static gboolean
+replay_next (TraceReplay *replay)
+{
+  TraceEvent *event;
+
+  event = g_queue_pop_head (replay->events);
+
+  if (event)
+    {
+      replay_event (replay, event);
+      trace_event_free (event);
+    }
+
+  replay_schedule_next (replay);
+
+  return FALSE;
+}
+
+static gboolean
+replay_finish (TraceReplay *replay)
+{
+  gboolean headless = replay->headless;
+
+  replay_report (replay);
+  replay_free (replay);
+
+  if (headless)
+    gtk_main_quit ();
+
+  return FALSE;
+}
+
+static void
+replay_schedule_next (TraceReplay *replay)
+{
+  TraceEvent *event = g_queue_peek_head (replay->events);
+
+  if (!event)
+    {
+      /* Let the pending window updates run first */
+      gdk_threads_add_idle_full (G_PRIORITY_LOW,
+                                 (GSourceFunc) replay_finish,
+                                 replay, NULL);
+    }
+  else if (replay->max_speed)
+    {
+      /* Run the idle sources of the pipeline between two events */
+      gdk_threads_add_idle_full (G_PRIORITY_LOW,
+                                 (GSourceFunc) replay_next,
+                                 replay, NULL);
+    }
+  else
+    {
+      gint64 elapsed, due;
+
+      elapsed = (get_time_us () - replay->start_time) / 1000;
+      due = event->time - replay->first_event_time;
+
+      gdk_threads_add_timeout (MAX (due - elapsed, 0),
+                               (GSourceFunc) replay_next,
+                               replay);
+    }
+}
+
+/**
+ * hd_notification_trace_replay:
+ * @filename: the trace file
+ * @max_speed: %TRUE to replay the events as fast as possible, %FALSE to
+ * keep the recorded timing
+ * @headless: %TRUE if hildon-home runs only to replay the trace, the
+ * main loop is quit once all events are replayed
+ * @error: return location for a #GError, or %NULL
+ *
+ * Feeds the events of a trace recorded with
+ * hd_notification_trace_start_recording () into HDNotificationManager
+ * and HDIncomingEvents. The hints are replayed unchanged, so persistent
+ * notifications are written to the notification database. A report
+ * with timings, window counts and peak memory is logged when all events
+ * are replayed.
+ *
+ * For a headless replay the windows should be stubbed with
+ * hd_incoming_event_window_set_stubbed () before HDIncomingEvents is
+ * created.
+ *
+ * Returns: %TRUE if the trace could be loaded
+ */
+gboolean
+hd_notification_trace_replay (const gchar  *filename,
+                              gboolean      max_speed,
+                              gboolean      headless,
+                              GError      **error)
+{
+  TraceReplay *replay;
+  gchar *contents;
+  gchar **lines;
+  guint i;
+
+  g_return_val_if_fail (filename, FALSE);
+
+  if (!g_file_get_contents (filename, &contents, NULL, error))
+    return FALSE;
+
+  lines = g_strsplit (contents, "\n", -1);
+  g_free (contents);
+
+  if (!lines[0] || strcmp (lines[0], TRACE_HEADER))
+    {
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   G_FILE_ERROR_INVAL,
+                   "%s is no notification trace",
+                   filename);
+      g_strfreev (lines);
+      return FALSE;
+    }
+
+  replay = g_slice_new0 (TraceReplay);
+  replay->events = g_queue_new ();
+  replay->max_speed = max_speed;
+  replay->headless = headless;
+  replay->ids = g_hash_table_new (g_direct_hash, g_direct_equal);
+  replay->notify_times = g_hash_table_new_full (g_direct_hash,
+                                                g_direct_equal,
+                                                NULL,
+                                                g_free);
+
+  for (i = 1; lines[i]; i++)
+    {
+      TraceEvent *event;
+      gchar **fields;
+
+      if (!lines[i][0])
+        continue;
+
+      fields = g_strsplit (lines[i], "\t", -1);
+      if (g_strv_length (fields) < 2 || strlen (fields[0]) != 1)
+        {
+          g_warning ("%s. Skipping invalid line %u of %s",
+                     __FUNCTION__,
+                     i + 1,
+                     filename);
+          g_strfreev (fields);
+          continue;
+        }
+
+      event = g_slice_new (TraceEvent);
+      event->fields = fields;
+      event->n_fields = g_strv_length (fields);
+      event->time = g_ascii_strtoll (fields[1], NULL, 10);
+
+      g_queue_push_tail (replay->events, event);
+    }
+
+  g_strfreev (lines);
+
+  if (!g_queue_is_empty (replay->events))
+    replay->first_event_time = ((TraceEvent *) g_queue_peek_head (replay->events))->time;
+
+  replay->notified_handler = g_signal_connect (hd_notification_manager_get (), "notified",
+                                               G_CALLBACK (replay_notified), replay);
+
+  g_message ("Replaying %u events of notification trace %s",
+             g_queue_get_length (replay->events),
+             filename);
+
+  replay->start_time = get_time_us ();
+  replay_schedule_next (replay);
+
+  return TRUE;
+}
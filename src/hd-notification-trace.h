@@ -0,0 +1,56 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_NOTIFICATION_TRACE_H__
+#define __HD_NOTIFICATION_TRACE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gboolean hd_notification_trace_start_recording (const gchar  *filename,
+                                                GError      **error);
+void     hd_notification_trace_stop_recording  (void);
+
+void     hd_notification_trace_record_notify   (const gchar  *app_name,
+                                                guint         requested_id,
+                                                guint         id,
+                                                const gchar  *icon,
+                                                const gchar  *summary,
+                                                const gchar  *body,
+                                                gchar       **actions,
+                                                GHashTable   *hints,
+                                                gint          timeout);
+void     hd_notification_trace_record_close    (guint         id);
+void     hd_notification_trace_record_action   (guint         id,
+                                                const gchar  *action_id);
+void     hd_notification_trace_record_mce      (const gchar  *signal_name,
+                                                const gchar  *value);
+
+gboolean hd_notification_trace_replay          (const gchar  *filename,
+                                                gboolean      max_speed,
+                                                gboolean      headless,
+                                                GError      **error);
+
+G_END_DECLS
+
+#endif
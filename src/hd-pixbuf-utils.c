@@ -24,8 +24,45 @@
 #include <config.h>
 #endif
 
+#include <stdlib.h>
+#include <string.h>
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#elif defined (__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 #include "hd-pixbuf-utils.h"
 
+/*
+ * Scaling backends, selected with the HD_PIXBUF_SCALER environment
+ * variable ("gdk", "scalar" or "simd"). The default is "simd" if the
+ * row accumulation is vectorized for the target, else "scalar".
+ *
+ * "simd" only vectorizes the vertical accumulation of rows in
+ * accumulate_row (). The horizontal box sum in box_downscale_pixbuf ()
+ * and the bilinear stage in orient_scale_and_crop_pixbuf () are scalar
+ * for both backends.
+ */
+typedef enum
+{
+  SCALER_UNKNOWN,
+  SCALER_GDK,
+  SCALER_SCALAR,
+  SCALER_SIMD
+} Scaler;
+
+static Scaler scaler = SCALER_UNKNOWN;
+
+#ifdef COMPILE_FOR_TEST
+/* Number of box_downscale_pixbuf () calls */
+static guint box_downscales = 0;
+#endif
+
+/* zlib level of cached PNG images */
+#define PNG_COMPRESSION "3"
+
 /*
  * Background image should be resized and cropped. That means the image
  * is centered and scaled to make sure the shortest side fit the home 
@@ -49,28 +86,46 @@ get_scale_for_aspect_ratio (HDImageSize *image_size,
   return scale;
 }
 
+/*
+ * Lets the JPEG decoder skip detail with its 1/2, 1/4 or 1/8 DCT
+ * scaling, but only down to twice the size needed for any orientation
+ * of the destination, so resample_pixbuf () still box filters the rest.
+ * The requested size is exactly what the decoder produces, else the
+ * loader would scale the image once more with gdk. Other formats are
+ * loaded at full size, the loader could only scale them after decoding.
+ */
 static void
 size_prepared_cb (GdkPixbufLoader *loader,
                   gint             width,
                   gint             height,
                   HDImageSize     *size)
 {
-  HDImageSize image_size = {width, height};
-  HDImageSize minimum_size;
-  double scale;
+  GdkPixbufFormat *format;
+  gchar *name;
+  gboolean jpeg;
+  gint coarse_size, denominator;
 
-  minimum_size.width = minimum_size.height = MAX (size->width, size->height);
+  format = gdk_pixbuf_loader_get_format (loader);
+  if (!format)
+    return;
 
-  scale = get_scale_for_aspect_ratio (&image_size, &minimum_size);
+  name = gdk_pixbuf_format_get_name (format);
+  jpeg = !g_strcmp0 (name, "jpeg");
+  g_free (name);
 
-  /* Do not load images bigger than neccesary */
-  if (scale < 1)
-    {
-      image_size.width *= scale;
-      image_size.height *= scale;
-    }
+  if (!jpeg)
+    return;
+
+  coarse_size = 2 * MAX (size->width, size->height);
 
-  gdk_pixbuf_loader_set_size (loader, image_size.width, image_size.height);
+  for (denominator = 8; denominator > 1; denominator /= 2)
+    if (MIN (width, height) / denominator >= coarse_size)
+      break;
+
+  if (denominator > 1)
+    gdk_pixbuf_loader_set_size (loader,
+                                (width + denominator - 1) / denominator,
+                                (height + denominator - 1) / denominator);
 }
 
 static GdkPixbuf *
@@ -106,6 +161,339 @@ scale_and_crop_pixbuf (const GdkPixbuf *source,
   return pixbuf;
 }
 
+/* Returns the EXIF orientation (1 to 8) stored by the loader */
+static gint
+get_embedded_orientation (const GdkPixbuf *pixbuf)
+{
+  const gchar *option;
+  gint orientation;
+
+  option = gdk_pixbuf_get_option ((GdkPixbuf *) pixbuf, "orientation");
+  if (!option)
+    return 1;
+
+  orientation = atoi (option);
+  if (orientation < 1 || orientation > 8)
+    return 1;
+
+  return orientation;
+}
+
+/*
+ * Like gdk_pixbuf_apply_embedded_orientation () followed by
+ * scale_and_crop_pixbuf (), but samples the source directly, so the
+ * only pixbuf allocated is the destination.
+ *
+ * Source coordinates are an affine function of the coordinates in the
+ * oriented image: sx = xx * u + xy * v + x0, sy = yx * u + yy * v + y0.
+ * Pixels are sampled bilinearly with 16.16 fixed point coordinates.
+ */
+static GdkPixbuf *
+orient_scale_and_crop_pixbuf (const GdkPixbuf *source,
+                              gint             orientation,
+                              HDImageSize     *destination_size)
+{
+  HDImageSize image_size;
+  gint width, height, n_channels, src_rowstride, dest_rowstride;
+  const guchar *src_pixels;
+  guchar *dest_pixels;
+  double xx = 0, xy = 0, x0 = 0, yx = 0, yy = 0, y0 = 0;
+  double scale, offset_x, offset_y;
+  GdkPixbuf *pixbuf;
+  gint x, y, c;
+
+  width = gdk_pixbuf_get_width (source);
+  height = gdk_pixbuf_get_height (source);
+
+  switch (orientation)
+    {
+    case 2: /* Flipped horizontally */
+      xx = -1; x0 = width - 1; yy = 1;
+      break;
+    case 3: /* Rotated by 180 degrees */
+      xx = -1; x0 = width - 1; yy = -1; y0 = height - 1;
+      break;
+    case 4: /* Flipped vertically */
+      xx = 1; yy = -1; y0 = height - 1;
+      break;
+    case 5: /* Transposed */
+      xy = 1; yx = 1;
+      break;
+    case 6: /* Rotated clockwise */
+      xy = 1; yx = -1; y0 = height - 1;
+      break;
+    case 7: /* Transversed */
+      xy = -1; x0 = width - 1; yx = -1; y0 = height - 1;
+      break;
+    case 8: /* Rotated counterclockwise */
+      xy = -1; x0 = width - 1; yx = 1;
+      break;
+    default:
+      xx = 1; yy = 1;
+      break;
+    }
+
+  /* Size of the oriented image */
+  if (orientation >= 5)
+    {
+      image_size.width = height;
+      image_size.height = width;
+    }
+  else
+    {
+      image_size.width = width;
+      image_size.height = height;
+    }
+
+  scale = get_scale_for_aspect_ratio (&image_size, destination_size);
+  offset_x = (image_size.width * scale - destination_size->width) / 2;
+  offset_y = (image_size.height * scale - destination_size->height) / 2;
+
+  pixbuf = gdk_pixbuf_new (gdk_pixbuf_get_colorspace (source),
+                           gdk_pixbuf_get_has_alpha (source),
+                           gdk_pixbuf_get_bits_per_sample (source),
+                           destination_size->width,
+                           destination_size->height);
+
+  n_channels = gdk_pixbuf_get_n_channels (source);
+  src_rowstride = gdk_pixbuf_get_rowstride (source);
+  src_pixels = gdk_pixbuf_get_pixels (source);
+  dest_rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  dest_pixels = gdk_pixbuf_get_pixels (pixbuf);
+
+  for (y = 0; y < destination_size->height; y++)
+    {
+      /* Pixel centers in the oriented image */
+      double u = (0.5 + offset_x) / scale - 0.5;
+      double v = (y + 0.5 + offset_y) / scale - 0.5;
+      gint fx = (xx * u + xy * v + x0) * 65536;
+      gint fy = (yx * u + yy * v + y0) * 65536;
+      gint dfx = xx / scale * 65536;
+      gint dfy = yx / scale * 65536;
+      guchar *dest = dest_pixels + y * dest_rowstride;
+
+      for (x = 0; x < destination_size->width; x++, fx += dfx, fy += dfy)
+        {
+          gint sx = CLAMP (fx, 0, (width - 1) << 16);
+          gint sy = CLAMP (fy, 0, (height - 1) << 16);
+          gint ix = sx >> 16, iy = sy >> 16;
+          gint wx = (sx >> 8) & 0xff, wy = (sy >> 8) & 0xff;
+          const guchar *p00, *p01, *p10, *p11;
+
+          p00 = src_pixels + iy * src_rowstride + ix * n_channels;
+          p01 = ix < width - 1 ? p00 + n_channels : p00;
+          p10 = iy < height - 1 ? p00 + src_rowstride : p00;
+          p11 = ix < width - 1 ? p10 + n_channels : p10;
+
+          for (c = 0; c < n_channels; c++)
+            {
+              guint top = p00[c] * (256 - wx) + p01[c] * wx;
+              guint bottom = p10[c] * (256 - wx) + p11[c] * wx;
+
+              *dest++ = (top * (256 - wy) + bottom * wy + 32768) >> 16;
+            }
+        }
+    }
+
+  return pixbuf;
+}
+
+static Scaler
+get_scaler (void)
+{
+  if (G_UNLIKELY (scaler == SCALER_UNKNOWN))
+    {
+      const gchar *name = g_getenv ("HD_PIXBUF_SCALER");
+
+      if (!g_strcmp0 (name, "gdk"))
+        scaler = SCALER_GDK;
+      else if (!g_strcmp0 (name, "scalar"))
+        scaler = SCALER_SCALAR;
+      else
+#if defined (__SSE2__) || defined (__ARM_NEON__)
+        scaler = SCALER_SIMD;
+#else
+        scaler = SCALER_SCALAR;
+#endif
+    }
+
+  return scaler;
+}
+
+/*
+ * Adds the @n bytes of @row to the 16 bit sums in @sums. This is the
+ * only vectorized part of the scaler.
+ */
+static void
+accumulate_row (guint16      *sums,
+                const guchar *row,
+                gint          n,
+                gboolean      simd)
+{
+  gint i = 0;
+
+#if defined (__SSE2__)
+  if (simd)
+    {
+      const __m128i zero = _mm_setzero_si128 ();
+
+      for (; i + 16 <= n; i += 16)
+        {
+          __m128i bytes = _mm_loadu_si128 ((const __m128i *) (row + i));
+          __m128i *sum = (__m128i *) (sums + i);
+
+          _mm_storeu_si128 (sum,
+                            _mm_add_epi16 (_mm_loadu_si128 (sum),
+                                           _mm_unpacklo_epi8 (bytes, zero)));
+          _mm_storeu_si128 (sum + 1,
+                            _mm_add_epi16 (_mm_loadu_si128 (sum + 1),
+                                           _mm_unpackhi_epi8 (bytes, zero)));
+        }
+    }
+#elif defined (__ARM_NEON__)
+  if (simd)
+    {
+      for (; i + 8 <= n; i += 8)
+        vst1q_u16 (sums + i, vaddw_u8 (vld1q_u16 (sums + i), vld1_u8 (row + i)));
+    }
+#endif
+
+  for (; i < n; i++)
+    sums[i] += row[i];
+}
+
+/*
+ * Box filters @source into a pixbuf @factor times smaller. Rows of a
+ * block are summed column-wise first, this is the part which is
+ * vectorized; the columns of a block are then summed per channel with
+ * scalar code. Pixels not filling a whole block at the right and bottom
+ * edge are dropped.
+ */
+static GdkPixbuf *
+box_downscale_pixbuf (const GdkPixbuf *source,
+                      gint             factor,
+                      gboolean         simd)
+{
+  gint width, height, n_channels, src_rowstride, dest_rowstride;
+  gint dest_width, dest_height, row_bytes;
+  const guchar *src_pixels;
+  guchar *dest_pixels;
+  guint16 *sums;
+  guint area;
+  GdkPixbuf *pixbuf;
+  gint x, y, i, c;
+
+  width = gdk_pixbuf_get_width (source);
+  height = gdk_pixbuf_get_height (source);
+  n_channels = gdk_pixbuf_get_n_channels (source);
+  src_rowstride = gdk_pixbuf_get_rowstride (source);
+  src_pixels = gdk_pixbuf_get_pixels (source);
+
+  dest_width = MAX (width / factor, 1);
+  dest_height = MAX (height / factor, 1);
+  factor = MIN (factor, MIN (width, height));
+  area = factor * factor;
+
+#ifdef COMPILE_FOR_TEST
+  box_downscales++;
+#endif
+
+  pixbuf = gdk_pixbuf_new (gdk_pixbuf_get_colorspace (source),
+                           gdk_pixbuf_get_has_alpha (source),
+                           gdk_pixbuf_get_bits_per_sample (source),
+                           dest_width,
+                           dest_height);
+  dest_rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  dest_pixels = gdk_pixbuf_get_pixels (pixbuf);
+
+  row_bytes = dest_width * factor * n_channels;
+  sums = g_new (guint16, row_bytes);
+
+  for (y = 0; y < dest_height; y++)
+    {
+      const guint16 *sum = sums;
+      guchar *dest = dest_pixels + y * dest_rowstride;
+
+      memset (sums, 0, row_bytes * sizeof (guint16));
+      for (i = 0; i < factor; i++)
+        accumulate_row (sums,
+                        src_pixels + (y * factor + i) * src_rowstride,
+                        row_bytes,
+                        simd);
+
+      for (x = 0; x < dest_width; x++)
+        {
+          for (c = 0; c < n_channels; c++)
+            {
+              guint total = 0;
+
+              for (i = 0; i < factor; i++)
+                total += sum[i * n_channels + c];
+
+              *dest++ = (total + area / 2) / area;
+            }
+
+          sum += factor * n_channels;
+        }
+    }
+
+  g_free (sums);
+
+  return pixbuf;
+}
+
+/*
+ * Scales and crops @source with orientation @orientation to
+ * @destination_size. Large downscale factors are first reduced by an
+ * integer box filter, so the bilinear sampling does not alias.
+ */
+static GdkPixbuf *
+resample_pixbuf (const GdkPixbuf *source,
+                 gint             orientation,
+                 HDImageSize     *destination_size)
+{
+  HDImageSize image_size;
+  gint factor;
+  GdkPixbuf *reduced, *pixbuf;
+
+  if (get_scaler () == SCALER_GDK)
+    {
+      GdkPixbuf *rotated;
+
+      if (orientation == 1)
+        return scale_and_crop_pixbuf (source, destination_size);
+
+      rotated = gdk_pixbuf_apply_embedded_orientation ((GdkPixbuf *) source);
+      pixbuf = scale_and_crop_pixbuf (rotated, destination_size);
+      g_object_unref (rotated);
+
+      return pixbuf;
+    }
+
+  image_size.width = gdk_pixbuf_get_width (source);
+  image_size.height = gdk_pixbuf_get_height (source);
+  if (orientation >= 5)
+    {
+      HDImageSize destination_unrotated = {destination_size->height,
+                                           destination_size->width};
+
+      factor = 1. / get_scale_for_aspect_ratio (&image_size, &destination_unrotated);
+    }
+  else
+    factor = 1. / get_scale_for_aspect_ratio (&image_size, destination_size);
+
+  if (factor < 2)
+    return orient_scale_and_crop_pixbuf (source, orientation, destination_size);
+
+  reduced = box_downscale_pixbuf (source,
+                                  MIN (factor, 255),
+                                  get_scaler () == SCALER_SIMD);
+  pixbuf = orient_scale_and_crop_pixbuf (reduced, orientation, destination_size);
+  g_object_unref (reduced);
+
+  return pixbuf;
+}
+
 static gboolean
 read_from_input_stream_into_pixbuf_loader (GInputStream     *stream,
                                            GdkPixbufLoader  *loader,
@@ -212,9 +600,11 @@ hd_pixbuf_utils_load_scaled_and_cropped (GFile         *file,
   pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
   if (pixbuf)
     {
-      GdkPixbuf *rotated = gdk_pixbuf_apply_embedded_orientation (pixbuf);
-      pixbuf = scale_and_crop_pixbuf (rotated, size);
-      g_object_unref (rotated);
+      /* Rotated images are oriented while scaling, instead of
+       * allocating a rotated copy of the full image */
+      pixbuf = resample_pixbuf (pixbuf,
+                                get_embedded_orientation (pixbuf),
+                                size);
     }
   else
     g_set_error_literal (error,
@@ -231,6 +621,37 @@ cleanup:
   return pixbuf;
 }
 
+typedef struct
+{
+  GOutputStream *stream;
+  GCancellable  *cancellable;
+} SaveData;
+
+/* Writes a chunk of the encoded image, stops encoding when cancelled */
+static gboolean
+save_to_stream_cb (const gchar  *buffer,
+                   gsize         count,
+                   GError      **error,
+                   SaveData     *data)
+{
+  gsize bytes_written;
+
+  return g_output_stream_write_all (data->stream,
+                                    buffer,
+                                    count,
+                                    &bytes_written,
+                                    data->cancellable,
+                                    error);
+}
+
+/*
+ * Encodes @pixbuf chunk by chunk into a temporary file next to @file,
+ * which is renamed to @file when the whole image is written. Only the
+ * chunk being written is held in memory besides the pixbuf. When
+ * cancelled or on errors @file is left as it was, existing or not.
+ * Concurrent saves to the same @file have to be serialized by the
+ * caller.
+ */
 gboolean
 hd_pixbuf_utils_save (GFile         *file,
                       GdkPixbuf     *pixbuf,
@@ -238,29 +659,75 @@ hd_pixbuf_utils_save (GFile         *file,
                       GCancellable  *cancellable,
                       GError       **error)
 {
-  gchar *buffer = NULL;
-  gsize buffer_size;
+  GFile *parent, *tmp_file;
+  GFileOutputStream *stream;
+  SaveData data;
+  gchar *basename, *tmp_basename;
   gboolean result;
 
-  if (!gdk_pixbuf_save_to_buffer (pixbuf,
-                                  &buffer,
-                                  &buffer_size,
-                                  type,
-                                  error,
-                                  NULL))
-    return FALSE;
+  parent = g_file_get_parent (file);
+  basename = g_file_get_basename (file);
+  tmp_basename = g_strconcat (basename, ".new", NULL);
+  tmp_file = g_file_get_child (parent, tmp_basename);
+  g_object_unref (parent);
+  g_free (basename);
+  g_free (tmp_basename);
 
-  result = g_file_replace_contents (file,
-                                    buffer,
-                                    buffer_size,
-                                    NULL,
-                                    FALSE,
-                                    G_FILE_CREATE_NONE,
-                                    NULL,
+  stream = g_file_replace (tmp_file,
+                           NULL,
+                           FALSE,
+                           G_FILE_CREATE_NONE,
+                           cancellable,
+                           error);
+  if (!stream)
+    {
+      g_object_unref (tmp_file);
+      return FALSE;
+    }
+
+  data.stream = G_OUTPUT_STREAM (stream);
+  data.cancellable = cancellable;
+
+  /* Cached images are rewritten often, favour speed over size */
+  if (!g_strcmp0 (type, "png"))
+    result = gdk_pixbuf_save_to_callback (pixbuf,
+                                          (GdkPixbufSaveFunc) save_to_stream_cb,
+                                          &data,
+                                          type,
+                                          error,
+                                          "compression", PNG_COMPRESSION,
+                                          NULL);
+  else
+    result = gdk_pixbuf_save_to_callback (pixbuf,
+                                          (GdkPixbufSaveFunc) save_to_stream_cb,
+                                          &data,
+                                          type,
+                                          error,
+                                          NULL);
+
+  if (result)
+    result = g_output_stream_close (G_OUTPUT_STREAM (stream),
                                     cancellable,
                                     error);
+  else
+    g_output_stream_close (G_OUTPUT_STREAM (stream), NULL, NULL);
 
-  g_free (buffer);
+  g_object_unref (stream);
+
+  /* Only a complete image gets the final name */
+  if (result)
+    result = g_file_move (tmp_file,
+                          file,
+                          G_FILE_COPY_OVERWRITE,
+                          NULL,
+                          NULL,
+                          NULL,
+                          error);
+
+  if (!result)
+    g_file_delete (tmp_file, NULL, NULL);
+
+  g_object_unref (tmp_file);
 
   return result;
 }
@@ -340,3 +807,362 @@ cleanup:
 
   return pixbuf;
 }
+
+#ifdef COMPILE_FOR_TEST
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+/* Side of the blocks whose means are compared for the checkerboard */
+#define TEST_BLOCK_SIZE 16
+
+typedef struct
+{
+  gint width;
+  gint height;
+  gint orientation;
+} TestData;
+
+static const TestData test_data[] =
+{
+    { 800, 480, 1 },
+    { 1280, 720, 1 },
+    { 2048, 1536, 1 },
+    { 3264, 2448, 1 },
+    { 1280, 720, 3 },
+    { 2048, 1536, 6 },
+    { 3264, 2448, 3 },
+    { 3264, 2448, 6 },
+    { 3264, 2448, 8 },
+};
+
+static GdkPixbuf *
+create_gradient (gint width,
+                 gint height)
+{
+  GdkPixbuf *pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+  gint rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  guchar *pixels = gdk_pixbuf_get_pixels (pixbuf);
+  gint x, y;
+
+  for (y = 0; y < height; y++)
+    for (x = 0; x < width; x++)
+      {
+        guchar *p = pixels + y * rowstride + x * 3;
+
+        p[0] = x * 255 / width;
+        p[1] = y * 255 / height;
+        p[2] = (x + y) * 255 / (width + height);
+      }
+
+  return pixbuf;
+}
+
+/* One pixel black and white checkerboard, the worst case for aliasing */
+static GdkPixbuf *
+create_checkerboard (gint width,
+                     gint height)
+{
+  GdkPixbuf *pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+  gint rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  guchar *pixels = gdk_pixbuf_get_pixels (pixbuf);
+  gint x, y;
+
+  for (y = 0; y < height; y++)
+    for (x = 0; x < width; x++)
+      memset (pixels + y * rowstride + x * 3, (x + y) & 1 ? 0xff : 0, 3);
+
+  return pixbuf;
+}
+
+static void
+set_orientation (GdkPixbuf *pixbuf,
+                 gint       orientation)
+{
+  gchar *option;
+
+  if (orientation == 1)
+    return;
+
+  /* The gdk scaler takes the orientation from the pixbuf option */
+  option = g_strdup_printf ("%d", orientation);
+  gdk_pixbuf_set_option (pixbuf, "orientation", option);
+  g_free (option);
+}
+
+static void
+compare_pixbufs (GdkPixbuf *a,
+                 GdkPixbuf *b,
+                 guint      max_tolerance,
+                 gdouble    mean_tolerance)
+{
+  gint width = gdk_pixbuf_get_width (a);
+  gint height = gdk_pixbuf_get_height (a);
+  guint max = 0;
+  guint64 total = 0;
+  gint x, y;
+
+  g_assert_cmpint (width, ==, gdk_pixbuf_get_width (b));
+  g_assert_cmpint (height, ==, gdk_pixbuf_get_height (b));
+
+  for (y = 0; y < height; y++)
+    {
+      const guchar *pa = gdk_pixbuf_get_pixels (a) + y * gdk_pixbuf_get_rowstride (a);
+      const guchar *pb = gdk_pixbuf_get_pixels (b) + y * gdk_pixbuf_get_rowstride (b);
+
+      for (x = 0; x < width * 3; x++)
+        {
+          guint diff = ABS (pa[x] - pb[x]);
+
+          max = MAX (max, diff);
+          total += diff;
+        }
+    }
+
+  g_assert_cmpuint (max, <=, max_tolerance);
+  g_assert_cmpfloat ((gdouble) total / (width * height * 3), <=, mean_tolerance);
+}
+
+/*
+ * Compares the means of TEST_BLOCK_SIZE squares. A pixel exact
+ * comparison is meaningless for a checkerboard, since the bilinear
+ * stage samples it where gdk averages it, but aliasing shows up as
+ * blocks brighter or darker than the average.
+ */
+static void
+compare_block_means (GdkPixbuf *a,
+                     GdkPixbuf *b,
+                     guint      max_tolerance)
+{
+  gint width = gdk_pixbuf_get_width (a);
+  gint height = gdk_pixbuf_get_height (a);
+  gint bx, by, x, y;
+
+  g_assert_cmpint (width, ==, gdk_pixbuf_get_width (b));
+  g_assert_cmpint (height, ==, gdk_pixbuf_get_height (b));
+
+  for (by = 0; by + TEST_BLOCK_SIZE <= height; by += TEST_BLOCK_SIZE)
+    for (bx = 0; bx + TEST_BLOCK_SIZE <= width; bx += TEST_BLOCK_SIZE)
+      {
+        guint total_a = 0, total_b = 0;
+
+        for (y = by; y < by + TEST_BLOCK_SIZE; y++)
+          {
+            const guchar *pa = gdk_pixbuf_get_pixels (a) + y * gdk_pixbuf_get_rowstride (a);
+            const guchar *pb = gdk_pixbuf_get_pixels (b) + y * gdk_pixbuf_get_rowstride (b);
+
+            for (x = bx * 3; x < (bx + TEST_BLOCK_SIZE) * 3; x++)
+              {
+                total_a += pa[x];
+                total_b += pb[x];
+              }
+          }
+
+        g_assert_cmpuint (ABS ((gint) (total_a - total_b)) / (TEST_BLOCK_SIZE * TEST_BLOCK_SIZE * 3),
+                          <=,
+                          max_tolerance);
+      }
+}
+
+/* Scales @source with all three scalers and checks they agree */
+static void
+resample_and_compare (GdkPixbuf *source,
+                      gint       orientation,
+                      gboolean   high_frequency)
+{
+  HDImageSize size = { 800, 480 };
+  GdkPixbuf *expected, *scalar, *simd;
+  gdouble elapsed;
+
+  set_orientation (source, orientation);
+
+  scaler = SCALER_GDK;
+  g_test_timer_start ();
+  expected = resample_pixbuf (source, orientation, &size);
+  elapsed = g_test_timer_elapsed ();
+  g_test_minimized_result (elapsed, "gdk: %f s", elapsed);
+
+  scaler = SCALER_SCALAR;
+  g_test_timer_start ();
+  scalar = resample_pixbuf (source, orientation, &size);
+  elapsed = g_test_timer_elapsed ();
+  g_test_minimized_result (elapsed, "scalar: %f s", elapsed);
+
+  scaler = SCALER_SIMD;
+  g_test_timer_start ();
+  simd = resample_pixbuf (source, orientation, &size);
+  elapsed = g_test_timer_elapsed ();
+  g_test_minimized_result (elapsed, "simd: %f s", elapsed);
+
+  if (high_frequency)
+    compare_block_means (expected, scalar, 8);
+  else
+    compare_pixbufs (expected, scalar, 8, 2.);
+  compare_pixbufs (scalar, simd, 0, 0.);
+
+  g_object_unref (expected);
+  g_object_unref (scalar);
+  g_object_unref (simd);
+}
+
+static void
+test_resample (gconstpointer test_data)
+{
+  const TestData *data = test_data;
+  GdkPixbuf *source;
+
+  g_test_message ("Test resample: %dx%d, orientation %d\n",
+                  data->width, data->height, data->orientation);
+
+  source = create_gradient (data->width, data->height);
+  resample_and_compare (source, data->orientation, FALSE);
+  g_object_unref (source);
+
+  source = create_checkerboard (data->width, data->height);
+  resample_and_compare (source, data->orientation, TRUE);
+  g_object_unref (source);
+}
+
+typedef struct
+{
+  gint         width;
+  gint         height;
+  const gchar *type;
+} LoadTestData;
+
+static const LoadTestData load_test_data[] =
+{
+    { 1280, 720, "jpeg" },
+    { 2048, 1536, "jpeg" },
+    { 3264, 2448, "jpeg" },
+    { 4000, 3200, "jpeg" }, /* decoded at half size */
+    { 2048, 1536, "png" },
+};
+
+/* Loads @file with all three scalers and checks they agree */
+static void
+load_and_compare (GFile    *file,
+                  gboolean  high_frequency,
+                  gboolean  box_filtered)
+{
+  HDImageSize size = { 800, 480 };
+  GdkPixbuf *expected, *scalar, *simd;
+  GError *error = NULL;
+  guint box_downscales_before;
+  gdouble elapsed;
+
+  scaler = SCALER_GDK;
+  g_test_timer_start ();
+  expected = hd_pixbuf_utils_load_scaled_and_cropped (file, &size, NULL, NULL, &error);
+  elapsed = g_test_timer_elapsed ();
+  g_assert_no_error (error);
+  g_test_minimized_result (elapsed, "gdk: %f s", elapsed);
+
+  box_downscales_before = box_downscales;
+
+  scaler = SCALER_SCALAR;
+  g_test_timer_start ();
+  scalar = hd_pixbuf_utils_load_scaled_and_cropped (file, &size, NULL, NULL, &error);
+  elapsed = g_test_timer_elapsed ();
+  g_assert_no_error (error);
+  g_test_minimized_result (elapsed, "scalar: %f s", elapsed);
+
+  scaler = SCALER_SIMD;
+  g_test_timer_start ();
+  simd = hd_pixbuf_utils_load_scaled_and_cropped (file, &size, NULL, NULL, &error);
+  elapsed = g_test_timer_elapsed ();
+  g_assert_no_error (error);
+  g_test_minimized_result (elapsed, "simd: %f s", elapsed);
+
+  /* The decoder must leave the box filter something to do */
+  g_assert_cmpuint (box_downscales - box_downscales_before, ==, box_filtered ? 2 : 0);
+
+  g_assert_cmpint (gdk_pixbuf_get_width (scalar), ==, size.width);
+  g_assert_cmpint (gdk_pixbuf_get_height (scalar), ==, size.height);
+
+  if (high_frequency)
+    compare_block_means (expected, scalar, 8);
+  else
+    compare_pixbufs (expected, scalar, 8, 2.);
+  compare_pixbufs (scalar, simd, 0, 0.);
+
+  g_object_unref (expected);
+  g_object_unref (scalar);
+  g_object_unref (simd);
+}
+
+/* Saves @source as @type to a temporary file and loads it back scaled */
+static void
+save_load_and_compare (GdkPixbuf   *source,
+                       const gchar *type,
+                       gboolean     high_frequency,
+                       gboolean     box_filtered)
+{
+  GError *error = NULL;
+  gchar *filename;
+  GFile *file;
+  gint fd;
+
+  fd = g_file_open_tmp ("test-pixbuf-utils-XXXXXX", &filename, &error);
+  g_assert_no_error (error);
+  close (fd);
+
+  if (!g_strcmp0 (type, "jpeg"))
+    gdk_pixbuf_save (source, filename, type, &error, "quality", "95", NULL);
+  else
+    gdk_pixbuf_save (source, filename, type, &error, NULL);
+  g_assert_no_error (error);
+
+  file = g_file_new_for_path (filename);
+  load_and_compare (file, high_frequency, box_filtered);
+  g_object_unref (file);
+
+  g_unlink (filename);
+  g_free (filename);
+}
+
+static void
+test_load (gconstpointer test_data)
+{
+  const LoadTestData *data = test_data;
+  GdkPixbuf *source;
+  gboolean box_filtered;
+
+  g_test_message ("Test load: %dx%d %s\n",
+                  data->width, data->height, data->type);
+
+  /* The image is at least twice the size of the destination after
+   * decoding, see size_prepared_cb () */
+  box_filtered = data->width >= 2 * 800 && data->height >= 2 * 480;
+
+  source = create_gradient (data->width, data->height);
+  save_load_and_compare (source, data->type, FALSE, box_filtered);
+  g_object_unref (source);
+
+  source = create_checkerboard (data->width, data->height);
+  save_load_and_compare (source, data->type, TRUE, box_filtered);
+  g_object_unref (source);
+}
+
+int main (int argc, char **argv)
+{
+  guint i;
+
+  g_type_init ();
+  g_test_init (&argc, &argv, NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (test_data); i++)
+    {
+      gconstpointer data = &test_data[i];
+      g_test_add_data_func ("/pixbuf-utils/resample", data, test_resample);
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (load_test_data); i++)
+    {
+      gconstpointer data = &load_test_data[i];
+      g_test_add_data_func ("/pixbuf-utils/load", data, test_load);
+    }
+
+  return g_test_run ();
+}
+
+#endif
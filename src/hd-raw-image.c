@@ -0,0 +1,375 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hd-raw-image.h"
+
+#define ALIGN_16(n) (((n) + 15) & ~15)
+
+typedef struct
+{
+  gpointer address;
+  gsize    length;
+} MappedFile;
+
+static const cairo_user_data_key_t mapped_file_key;
+
+/* Fletcher like checksum of @data, @length is a multiple of 4 */
+static guint32
+compute_checksum (const guchar *data,
+                  gsize         length)
+{
+  const guint32 *words = (const guint32 *) data;
+  guint32 a = 0, b = 0;
+  gsize i;
+
+  for (i = 0; i < length / 4; i++)
+    {
+      a += words[i];
+      b += a;
+    }
+
+  return a ^ ((b << 16) | (b >> 16));
+}
+
+/* Converts @pixbuf to premultiplied cairo pixels */
+static void
+copy_pixels (GdkPixbuf *pixbuf,
+             guchar    *data,
+             gint       stride)
+{
+  gint width = gdk_pixbuf_get_width (pixbuf);
+  gint height = gdk_pixbuf_get_height (pixbuf);
+  gint n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+  gint rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  gboolean has_alpha = gdk_pixbuf_get_has_alpha (pixbuf);
+  const guchar *pixels = gdk_pixbuf_get_pixels (pixbuf);
+  gint x, y;
+
+  for (y = 0; y < height; y++)
+    {
+      const guchar *p = pixels + y * rowstride;
+      guint32 *q = (guint32 *) (data + y * stride);
+
+      for (x = 0; x < width; x++, p += n_channels)
+        {
+          if (has_alpha)
+            {
+              guint a = p[3];
+
+              *q++ = (a << 24) |
+                     ((p[0] * a + 127) / 255) << 16 |
+                     ((p[1] * a + 127) / 255) << 8 |
+                     ((p[2] * a + 127) / 255);
+            }
+          else
+            *q++ = 0xff000000 | p[0] << 16 | p[1] << 8 | p[2];
+        }
+    }
+}
+
+/**
+ * hd_raw_image_save:
+ * @file: the destination file
+ * @pixbuf: the image
+ * @etag: etag of the source of @pixbuf or %NULL
+ * @cancellable: a #GCancellable or %NULL
+ * @error: return location for a #GError or %NULL
+ *
+ * Saves @pixbuf as raw image. The file is replaced atomically.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+hd_raw_image_save (GFile         *file,
+                   GdkPixbuf     *pixbuf,
+                   const char    *etag,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  HDRawImageHeader header;
+  cairo_format_t format;
+  gsize etag_length, length;
+  guchar *buffer;
+  gboolean result;
+
+  format = gdk_pixbuf_get_has_alpha (pixbuf) ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24;
+  etag_length = etag ? strlen (etag) : 0;
+
+  header.magic = HD_RAW_IMAGE_MAGIC;
+  header.version = HD_RAW_IMAGE_VERSION;
+  header.format = format;
+  header.width = gdk_pixbuf_get_width (pixbuf);
+  header.height = gdk_pixbuf_get_height (pixbuf);
+  header.stride = cairo_format_stride_for_width (format, header.width);
+  header.data_offset = ALIGN_16 (sizeof (HDRawImageHeader) + etag_length);
+  header.etag_length = etag_length;
+
+  length = header.data_offset + (gsize) header.stride * header.height;
+  buffer = g_malloc0 (length);
+
+  copy_pixels (pixbuf, buffer + header.data_offset, header.stride);
+  header.checksum = compute_checksum (buffer + header.data_offset,
+                                      (gsize) header.stride * header.height);
+
+  memcpy (buffer, &header, sizeof (HDRawImageHeader));
+  if (etag_length)
+    memcpy (buffer + sizeof (HDRawImageHeader), etag, etag_length);
+
+  result = g_file_replace_contents (file,
+                                    (const char *) buffer,
+                                    length,
+                                    NULL,
+                                    FALSE,
+                                    G_FILE_CREATE_NONE,
+                                    NULL,
+                                    cancellable,
+                                    error);
+
+  g_free (buffer);
+
+  return result;
+}
+
+static void
+mapped_file_free (MappedFile *mapped_file)
+{
+  munmap (mapped_file->address, mapped_file->length);
+
+  g_slice_free (MappedFile, mapped_file);
+}
+
+/**
+ * hd_raw_image_load:
+ * @filename: a raw image file
+ * @etag: return location for the etag of the source image or %NULL
+ * @error: return location for a #GError or %NULL
+ *
+ * Maps the raw image @filename. The pixels of the returned surface stay
+ * mapped from the file until the surface is destroyed.
+ *
+ * Returns: a new cairo image surface or %NULL
+ */
+cairo_surface_t *
+hd_raw_image_load (const gchar  *filename,
+                   gchar       **etag,
+                   GError      **error)
+{
+  HDRawImageHeader header;
+  MappedFile *mapped_file;
+  cairo_surface_t *surface;
+  struct stat st;
+  guchar *address;
+  gsize data_length;
+  int fd;
+
+  fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    {
+      int saved_errno = errno;
+
+      g_set_error (error,
+                   G_IO_ERROR,
+                   g_io_error_from_errno (saved_errno),
+                   "Could not open %s. %s",
+                   filename,
+                   g_strerror (saved_errno));
+      return NULL;
+    }
+
+  if (fstat (fd, &st) < 0 ||
+      st.st_size < (off_t) sizeof (HDRawImageHeader))
+    {
+      close (fd);
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_DATA,
+                   "Raw image %s is truncated",
+                   filename);
+      return NULL;
+    }
+
+  /* Private and writable, cairo wants writable pixels */
+  address = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close (fd);
+
+  if (address == MAP_FAILED)
+    {
+      int saved_errno = errno;
+
+      g_set_error (error,
+                   G_IO_ERROR,
+                   g_io_error_from_errno (saved_errno),
+                   "Could not map %s. %s",
+                   filename,
+                   g_strerror (saved_errno));
+      return NULL;
+    }
+
+  memcpy (&header, address, sizeof (HDRawImageHeader));
+  data_length = (gsize) header.stride * header.height;
+
+  if (header.magic != HD_RAW_IMAGE_MAGIC ||
+      header.version != HD_RAW_IMAGE_VERSION ||
+      (header.format != CAIRO_FORMAT_ARGB32 &&
+       header.format != CAIRO_FORMAT_RGB24) ||
+      header.stride != (guint32) cairo_format_stride_for_width (header.format, header.width) ||
+      header.data_offset % 16 ||
+      header.data_offset < sizeof (HDRawImageHeader) + header.etag_length ||
+      header.data_offset + data_length > (gsize) st.st_size ||
+      header.checksum != compute_checksum (address + header.data_offset, data_length))
+    {
+      munmap (address, st.st_size);
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_DATA,
+                   "Invalid raw image %s",
+                   filename);
+      return NULL;
+    }
+
+  surface = cairo_image_surface_create_for_data (address + header.data_offset,
+                                                 header.format,
+                                                 header.width,
+                                                 header.height,
+                                                 header.stride);
+
+  mapped_file = g_slice_new (MappedFile);
+  mapped_file->address = address;
+  mapped_file->length = st.st_size;
+  cairo_surface_set_user_data (surface,
+                               &mapped_file_key,
+                               mapped_file,
+                               (cairo_destroy_func_t) mapped_file_free);
+
+  if (etag)
+    *etag = g_strndup ((const gchar *) address + sizeof (HDRawImageHeader),
+                       header.etag_length);
+
+  return surface;
+}
+
+/**
+ * hd_raw_image_load_thumbnail:
+ * @filename: a raw image file
+ * @width: the maximal width
+ * @height: the maximal height
+ * @error: return location for a #GError or %NULL
+ *
+ * Loads the raw image @filename scaled to fit into @width x @height,
+ * keeping its aspect ratio.
+ *
+ * Returns: a new #GdkPixbuf or %NULL
+ */
+GdkPixbuf *
+hd_raw_image_load_thumbnail (const gchar  *filename,
+                             gint          width,
+                             gint          height,
+                             GError      **error)
+{
+  cairo_surface_t *surface, *thumbnail;
+  cairo_t *cr;
+  gboolean has_alpha;
+  gint src_width, src_height, stride, x, y;
+  double scale;
+  const guchar *data;
+  guchar *pixels;
+  gint rowstride;
+  GdkPixbuf *pixbuf;
+
+  surface = hd_raw_image_load (filename, NULL, error);
+  if (!surface)
+    return NULL;
+
+  src_width = cairo_image_surface_get_width (surface);
+  src_height = cairo_image_surface_get_height (surface);
+  has_alpha = cairo_image_surface_get_format (surface) == CAIRO_FORMAT_ARGB32;
+
+  scale = MIN ((double) width / src_width, (double) height / src_height);
+  width = MAX (src_width * scale + 0.5, 1);
+  height = MAX (src_height * scale + 0.5, 1);
+
+  thumbnail = cairo_image_surface_create (cairo_image_surface_get_format (surface),
+                                          width,
+                                          height);
+  cr = cairo_create (thumbnail);
+  cairo_scale (cr, scale, scale);
+  cairo_set_source_surface (cr, surface, 0, 0);
+  cairo_pattern_set_filter (cairo_get_source (cr), CAIRO_FILTER_GOOD);
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+  cairo_paint (cr);
+  cairo_destroy (cr);
+  cairo_surface_destroy (surface);
+
+  /* Convert back to not premultiplied RGB(A) */
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, has_alpha, 8, width, height);
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  data = cairo_image_surface_get_data (thumbnail);
+  stride = cairo_image_surface_get_stride (thumbnail);
+
+  for (y = 0; y < height; y++)
+    {
+      const guint32 *p = (const guint32 *) (data + y * stride);
+      guchar *q = pixels + y * rowstride;
+
+      for (x = 0; x < width; x++, p++)
+        {
+          guint a = *p >> 24;
+          guint r = (*p >> 16) & 0xff, g = (*p >> 8) & 0xff, b = *p & 0xff;
+
+          if (has_alpha)
+            {
+              if (a)
+                {
+                  r = (r * 255 + a / 2) / a;
+                  g = (g * 255 + a / 2) / a;
+                  b = (b * 255 + a / 2) / a;
+                }
+              *q++ = r;
+              *q++ = g;
+              *q++ = b;
+              *q++ = a;
+            }
+          else
+            {
+              *q++ = r;
+              *q++ = g;
+              *q++ = b;
+            }
+        }
+    }
+
+  cairo_surface_destroy (thumbnail);
+
+  return pixbuf;
+}
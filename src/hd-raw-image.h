@@ -0,0 +1,70 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_RAW_IMAGE_H__
+#define __HD_RAW_IMAGE_H__
+
+#include <gdk/gdk.h>
+#include <gio/gio.h>
+#include <cairo.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Raw cached images can be mapped and used as cairo image surface
+ * without decoding. A file starts with a HDRawImageHeader in host byte
+ * order, followed by the source etag and, at data_offset, the pixels in
+ * the cairo image format HDRawImageHeader.format.
+ */
+#define HD_RAW_IMAGE_MAGIC   0x49434448 /* "HDCI" */
+#define HD_RAW_IMAGE_VERSION 1
+
+typedef struct
+{
+  guint32 magic;
+  guint16 version;
+  guint16 format;       /* cairo_format_t, CAIRO_FORMAT_ARGB32 or CAIRO_FORMAT_RGB24 */
+  guint32 width;
+  guint32 height;
+  guint32 stride;
+  guint32 data_offset;  /* 16 byte aligned */
+  guint32 checksum;     /* of the pixels, see hd-raw-image.c */
+  guint32 etag_length;  /* etag follows the header, not NUL terminated */
+} HDRawImageHeader;
+
+gboolean         hd_raw_image_save           (GFile         *file,
+                                              GdkPixbuf     *pixbuf,
+                                              const char    *etag,
+                                              GCancellable  *cancellable,
+                                              GError       **error);
+
+cairo_surface_t *hd_raw_image_load           (const gchar   *filename,
+                                              gchar        **etag,
+                                              GError       **error);
+GdkPixbuf       *hd_raw_image_load_thumbnail (const gchar   *filename,
+                                              gint           width,
+                                              gint           height,
+                                              GError       **error);
+
+G_END_DECLS
+
+#endif
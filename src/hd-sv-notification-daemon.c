@@ -5,8 +5,12 @@
 
 #define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 
@@ -20,6 +24,7 @@
 
 #include "hd-sv-notification-daemon.h"
 #include "hd-sv-notification-daemon-glue.h"
+#include "hd-marshal.h"
 
 #define HD_SV_NOTIFICATION_DAEMON_GET_PRIVATE(object) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_SV_NOTIFICATION_DAEMON, HDSVNotificationDaemonPrivate))
@@ -30,6 +35,45 @@ typedef gint (* NSVPluginPlayEvent) (GHashTable *hints,
                                      const char *sender);
 typedef void (* NSVPluginStopEvent) (gint        id);
 
+typedef enum
+{
+  EVENT_JOB_PLAY,
+  EVENT_JOB_STOP
+} EventJobType;
+
+/* A request queued for the plugin */
+typedef struct
+{
+  EventJobType  type;
+  gint          id;
+  gint          priority;
+  GHashTable   *hints;
+  gchar        *sender;
+  gint64        queued_time;
+} EventJob;
+
+/* A sound file mapped and locked in memory */
+typedef struct
+{
+  gpointer data;
+  gsize    size;
+} WarmTone;
+
+/* A mapping of the plugin or its libraries locked in memory */
+typedef struct
+{
+  gulong start;
+  gsize  size;
+} LockedRange;
+
+/* Settings of the warm mode from notification.conf */
+typedef struct
+{
+  gboolean   enabled;
+  gsize      budget;
+  gchar    **files;
+} WarmSettings;
+
 struct _HDSVNotificationDaemonPrivate
 {
   GModule            *nsv_module;
@@ -38,6 +82,38 @@ struct _HDSVNotificationDaemonPrivate
   NSVPluginUnload     nsv_plugin_unload;
   NSVPluginPlayEvent  nsv_plugin_play_event;
   NSVPluginStopEvent  nsv_plugin_stop_event;
+
+  /* The D-Bus methods only queue jobs. They are passed to the plugin
+   * one per main loop iteration from an idle, so requests which arrive
+   * meanwhile are answered, and stop requests cancel queued events,
+   * before the next job. The plugin is only entered from the main
+   * thread, like the main loop sources it adds itself. */
+  gboolean            plugin_loaded;
+  guint               dispatch_source;
+
+  /* Jobs sorted by descending priority, stop jobs first */
+  GQueue             *jobs;
+  /* Daemon event id to the id the plugin returned for it, for events
+   * which are played and not stopped yet. hildon-home stops the event of
+   * each notification when it is closed. */
+  GHashTable         *playing;
+
+  gint                last_id;
+
+  /* Sound files and plugin pages locked in memory in warm mode, both
+   * count against the budget in warm_size */
+  GHashTable         *warm_tones;
+  GArray             *plugin_pages;
+  gsize               plugin_size;
+  gsize               warm_size;
+  DBusGProxy         *profiled_proxy;
+
+  /* Queue statistics */
+  guint               played;
+  guint               cancelled;
+  guint               dropped;
+  gint64              latency_total;
+  gint64              latency_max;
 };
 
 #define HD_SV_NOTIFICATION_DAEMON_DBUS_NAME  "com.nokia.HildonSVNotificationDaemon" 
@@ -47,6 +123,26 @@ struct _HDSVNotificationDaemonPrivate
 
 #define MEMLOCK_LIMIT (1024 * 1024 * 64) /* 64 megabytes */
 
+/* Maximal number of play requests waiting for the plugin */
+#define MAX_QUEUED_EVENTS 8
+
+#define DEFAULT_URGENCY 1
+
+#define NOTIFICATION_CONF_FILE HD_DESKTOP_CONFIG_PATH "/notification.conf"
+
+#define WARM_GROUP "Warm"
+#define WARM_KEY_ENABLED "enabled"
+#define WARM_KEY_BUDGET "budget"
+#define WARM_KEY_FILES "files"
+#define WARM_DEFAULT_BUDGET 8192 /* kilobytes */
+
+#define PROFILED_SERVICE "com.nokia.profiled"
+#define PROFILED_PATH "/com/nokia/profiled"
+#define PROFILED_INTERFACE "com.nokia.profiled"
+#define PROFILED_TYPE_SOUNDFILE "SOUNDFILE"
+
+static WarmSettings warm_settings = { FALSE, 0, NULL };
+
 G_DEFINE_TYPE (HDSVNotificationDaemon, hd_sv_notification_daemon, G_TYPE_OBJECT);
 
 static void
@@ -123,11 +219,610 @@ close_module:
   priv->nsv_module = NULL;
 }
 
+/* Returns the current time in milliseconds */
+static gint64
+get_time_ms (void)
+{
+  GTimeVal tv;
+
+  g_get_current_time (&tv);
+
+  return (gint64) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void
+hint_value_free (GValue *value)
+{
+  g_value_unset (value);
+  g_free (value);
+}
+
+static void
+copy_hint (const gchar  *key,
+           const GValue *value,
+           GHashTable   *hints)
+{
+  GValue *copy = g_new0 (GValue, 1);
+
+  g_value_init (copy, G_VALUE_TYPE (value));
+  g_value_copy (value, copy);
+
+  g_hash_table_insert (hints, g_strdup (key), copy);
+}
+
+static gint
+get_priority_for_hints (GHashTable *hints)
+{
+  GValue *urgency = g_hash_table_lookup (hints, "urgency");
+
+  if (urgency && G_VALUE_HOLDS_UCHAR (urgency))
+    return g_value_get_uchar (urgency);
+
+  return DEFAULT_URGENCY;
+}
+
+static EventJob *
+event_job_new (EventJobType  type,
+               gint          id,
+               GHashTable   *hints,
+               const gchar  *sender)
+{
+  EventJob *job = g_slice_new0 (EventJob);
+
+  job->type = type;
+  job->id = id;
+  job->queued_time = get_time_ms ();
+
+  if (type == EVENT_JOB_PLAY)
+    {
+      job->hints = g_hash_table_new_full (g_str_hash,
+                                          g_str_equal,
+                                          g_free,
+                                          (GDestroyNotify) hint_value_free);
+      g_hash_table_foreach (hints, (GHFunc) copy_hint, job->hints);
+      job->sender = g_strdup (sender);
+      job->priority = get_priority_for_hints (hints);
+    }
+  else
+    job->priority = G_MAXINT;
+
+  return job;
+}
+
+static void
+event_job_free (EventJob *job)
+{
+  if (job->hints)
+    g_hash_table_destroy (job->hints);
+  g_free (job->sender);
+
+  g_slice_free (EventJob, job);
+}
+
+static gint
+compare_event_job_priority (const EventJob *a,
+                            const EventJob *b,
+                            gpointer        data)
+{
+  /* Higher priority first, equal priority in order of arrival */
+  return b->priority > a->priority ? 1 : -1;
+}
+
+static gint
+compare_event_job_play_id (const EventJob *job,
+                           gconstpointer   id)
+{
+  return job->type == EVENT_JOB_PLAY && job->id == GPOINTER_TO_INT (id) ? 0 : 1;
+}
+
+static void
+play_event_job (HDSVNotificationDaemon *sv_nd,
+                EventJob               *job)
+{
+  HDSVNotificationDaemonPrivate *priv = sv_nd->priv;
+  gint plugin_id;
+  gint64 latency;
+
+  latency = MAX (get_time_ms () - job->queued_time, 0);
+
+  priv->played++;
+  priv->latency_total += latency;
+  priv->latency_max = MAX (priv->latency_max, latency);
+
+  g_debug ("%s. Playing event %d after %" G_GINT64_FORMAT " ms in queue",
+           __FUNCTION__,
+           job->id,
+           latency);
+
+  plugin_id = priv->nsv_plugin_play_event (job->hints,
+                                           job->sender);
+
+  /* Kept until the event is stopped */
+  if (plugin_id >= 0)
+    g_hash_table_insert (priv->playing,
+                         GINT_TO_POINTER (job->id),
+                         GINT_TO_POINTER (plugin_id));
+}
+
+static void
+stop_event_job (HDSVNotificationDaemon *sv_nd,
+                EventJob               *job)
+{
+  HDSVNotificationDaemonPrivate *priv = sv_nd->priv;
+  gpointer plugin_id;
+
+  if (g_hash_table_lookup_extended (priv->playing,
+                                    GINT_TO_POINTER (job->id),
+                                    NULL,
+                                    &plugin_id))
+    {
+      priv->nsv_plugin_stop_event (GPOINTER_TO_INT (plugin_id));
+      g_hash_table_remove (priv->playing, GINT_TO_POINTER (job->id));
+    }
+}
+
+/* Passes the most important queued job to the plugin */
+static gboolean
+dispatch_event_job (HDSVNotificationDaemon *sv_nd)
+{
+  HDSVNotificationDaemonPrivate *priv = sv_nd->priv;
+  EventJob *job;
+
+  job = g_queue_pop_head (priv->jobs);
+  if (job)
+    {
+      if (job->type == EVENT_JOB_PLAY)
+        play_event_job (sv_nd, job);
+      else
+        stop_event_job (sv_nd, job);
+
+      event_job_free (job);
+    }
+
+  if (g_queue_is_empty (priv->jobs))
+    {
+      priv->dispatch_source = 0;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Returns FALSE if the queue is full of more important events */
+static gboolean
+push_event_job (HDSVNotificationDaemon *sv_nd,
+                EventJob               *job)
+{
+  HDSVNotificationDaemonPrivate *priv = sv_nd->priv;
+
+  if (job->type == EVENT_JOB_PLAY)
+    {
+      guint queued = 0;
+      GList *l;
+
+      for (l = priv->jobs->head; l; l = l->next)
+        if (((EventJob *) l->data)->type == EVENT_JOB_PLAY)
+          queued++;
+
+      if (queued >= MAX_QUEUED_EVENTS)
+        {
+          EventJob *last = g_queue_peek_tail (priv->jobs);
+
+          priv->dropped++;
+
+          if (last->type != EVENT_JOB_PLAY ||
+              last->priority >= job->priority)
+            return FALSE;
+
+          g_debug ("%s. Queue full, dropping event %d", __FUNCTION__, last->id);
+
+          event_job_free (g_queue_pop_tail (priv->jobs));
+        }
+    }
+
+  g_queue_insert_sorted (priv->jobs,
+                         job,
+                         (GCompareDataFunc) compare_event_job_priority,
+                         NULL);
+
+  /* Below the priority of D-Bus messages, so pending stop requests are
+   * handled first */
+  if (!priv->dispatch_source)
+    priv->dispatch_source = g_idle_add ((GSourceFunc) dispatch_event_job,
+                                        sv_nd);
+
+  return TRUE;
+}
+
+static void
+load_warm_settings (void)
+{
+  GKeyFile *conf;
+  GError *error = NULL;
+  gint budget;
+
+  conf = g_key_file_new ();
+
+  if (!g_key_file_load_from_file (conf, NOTIFICATION_CONF_FILE,
+                                  G_KEY_FILE_NONE, NULL) ||
+      !g_key_file_get_boolean (conf, WARM_GROUP, WARM_KEY_ENABLED, NULL))
+    goto cleanup;
+
+  warm_settings.enabled = TRUE;
+
+  budget = g_key_file_get_integer (conf, WARM_GROUP, WARM_KEY_BUDGET, &error);
+  if (error || budget <= 0)
+    {
+      budget = WARM_DEFAULT_BUDGET;
+      g_clear_error (&error);
+    }
+  /* The locked memory limit is set to the budget */
+  warm_settings.budget = MIN ((gsize) budget * 1024, MEMLOCK_LIMIT);
+
+  warm_settings.files = g_key_file_get_string_list (conf,
+                                                    WARM_GROUP,
+                                                    WARM_KEY_FILES,
+                                                    NULL,
+                                                    NULL);
+
+cleanup:
+  g_key_file_free (conf);
+}
+
+/* mlock() locks whole pages */
+static gsize
+page_align (gsize size)
+{
+  gsize page_size = sysconf (_SC_PAGESIZE);
+
+  return (size + page_size - 1) / page_size * page_size;
+}
+
+/* Returns the set of files mapped into the process */
+static GHashTable *
+get_mapped_files (void)
+{
+  GHashTable *files;
+  gchar *maps, **lines;
+  guint i;
+
+  files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  if (!g_file_get_contents ("/proc/self/maps", &maps, NULL, NULL))
+    return files;
+
+  lines = g_strsplit (maps, "\n", -1);
+  for (i = 0; lines[i]; i++)
+    {
+      gchar *path = strchr (lines[i], '/');
+
+      if (path)
+        g_hash_table_insert (files, g_strdup (path), GINT_TO_POINTER (1));
+    }
+
+  g_strfreev (lines);
+  g_free (maps);
+
+  return files;
+}
+
+/*
+ * Locks the readable mappings of files which were not mapped before
+ * the plugin was loaded, that is the plugin and the libraries it
+ * pulled in. The rest of the process is not needed to play a sound.
+ */
+static void
+lock_plugin_pages (HDSVNotificationDaemon *sv_nd,
+                   GHashTable             *mapped_before)
+{
+  HDSVNotificationDaemonPrivate *priv = sv_nd->priv;
+  gchar *maps, **lines;
+  guint i;
+
+  priv->plugin_pages = g_array_new (FALSE, FALSE, sizeof (LockedRange));
+
+  if (!g_file_get_contents ("/proc/self/maps", &maps, NULL, NULL))
+    return;
+
+  lines = g_strsplit (maps, "\n", -1);
+  for (i = 0; lines[i]; i++)
+    {
+      gchar *path = strchr (lines[i], '/');
+      gulong start, end;
+      gchar perms[5];
+      LockedRange range;
+
+      if (!path || g_hash_table_lookup (mapped_before, path))
+        continue;
+
+      if (sscanf (lines[i], "%lx-%lx %4s", &start, &end, perms) != 3 ||
+          perms[0] != 'r')
+        continue;
+
+      range.start = start;
+      range.size = end - start;
+
+      if (priv->plugin_size + range.size > warm_settings.budget)
+        {
+          g_warning ("%s. Not enough memory budget to lock %s",
+                     __FUNCTION__,
+                     path);
+          continue;
+        }
+
+      if (mlock ((gpointer) range.start, range.size) != 0)
+        {
+          g_warning ("%s. Could not lock %s. %s",
+                     __FUNCTION__,
+                     path,
+                     g_strerror (errno));
+          continue;
+        }
+
+      g_array_append_val (priv->plugin_pages, range);
+      priv->plugin_size += range.size;
+    }
+
+  g_strfreev (lines);
+  g_free (maps);
+
+  priv->warm_size = priv->plugin_size;
+}
+
+static void
+warm_tone_free (WarmTone *tone)
+{
+  munlock (tone->data, tone->size);
+  munmap (tone->data, tone->size);
+
+  g_slice_free (WarmTone, tone);
+}
+
+/*
+ * Maps a sound file and locks it in memory, so the plugin can read it
+ * without waiting for the disk
+ */
+static void
+warm_tone_load (HDSVNotificationDaemon *sv_nd,
+                const gchar            *filename)
+{
+  HDSVNotificationDaemonPrivate *priv = sv_nd->priv;
+  WarmTone *tone;
+  struct stat st;
+  gpointer data;
+  int fd;
+
+  if (g_hash_table_lookup (priv->warm_tones, filename))
+    return;
+
+  fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    {
+      g_debug ("%s. Could not open %s. %s",
+               __FUNCTION__,
+               filename,
+               g_strerror (errno));
+      return;
+    }
+
+  if (fstat (fd, &st) != 0 || st.st_size == 0)
+    goto close_fd;
+
+  if (priv->warm_size + page_align (st.st_size) > warm_settings.budget)
+    {
+      g_warning ("%s. Not enough memory budget to lock %s",
+                 __FUNCTION__,
+                 filename);
+      goto close_fd;
+    }
+
+  data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    goto close_fd;
+
+  /* Locking reads in all pages */
+  if (mlock (data, st.st_size) != 0)
+    {
+      g_warning ("%s. Could not lock %s. %s",
+                 __FUNCTION__,
+                 filename,
+                 g_strerror (errno));
+      munmap (data, st.st_size);
+      goto close_fd;
+    }
+
+  tone = g_slice_new (WarmTone);
+  tone->data = data;
+  tone->size = st.st_size;
+
+  g_hash_table_insert (priv->warm_tones, g_strdup (filename), tone);
+  priv->warm_size += page_align (tone->size);
+
+  g_debug ("%s. Locked %s (%" G_GSIZE_FORMAT " bytes)",
+           __FUNCTION__,
+           filename,
+           tone->size);
+
+close_fd:
+  close (fd);
+}
+
+static gboolean
+warm_tone_is_stale (const gchar *filename,
+                    WarmTone    *tone,
+                    GHashTable  *current)
+{
+  return !g_hash_table_lookup (current, filename);
+}
+
+static void
+add_warm_tone_size (const gchar            *filename,
+                    WarmTone               *tone,
+                    HDSVNotificationDaemon *sv_nd)
+{
+  sv_nd->priv->warm_size += page_align (tone->size);
+}
+
+/*
+ * Locks the configured files and the sound files of the profile
+ * values @values (a GPtrArray of (key, value, type) GValueArrays), and
+ * unlocks files which are no longer used.
+ */
+static void
+warm_tones_update (HDSVNotificationDaemon *sv_nd,
+                   GPtrArray              *values)
+{
+  HDSVNotificationDaemonPrivate *priv = sv_nd->priv;
+  GHashTable *current;
+  GHashTableIter iter;
+  gpointer filename;
+  guint i;
+
+  current = g_hash_table_new (g_str_hash, g_str_equal);
+
+  for (i = 0; warm_settings.files && warm_settings.files[i]; i++)
+    g_hash_table_insert (current, warm_settings.files[i], GINT_TO_POINTER (1));
+
+  for (i = 0; values && i < values->len; i++)
+    {
+      GValueArray *value = g_ptr_array_index (values, i);
+      const gchar *file, *type;
+
+      if (value->n_values < 3)
+        continue;
+
+      file = g_value_get_string (g_value_array_get_nth (value, 1));
+      type = g_value_get_string (g_value_array_get_nth (value, 2));
+
+      if (file && *file && type && !strcmp (type, PROFILED_TYPE_SOUNDFILE))
+        g_hash_table_insert (current, (gpointer) file, GINT_TO_POINTER (1));
+    }
+
+  /* Unlock old files first to make room in the budget */
+  g_hash_table_foreach_remove (priv->warm_tones,
+                               (GHRFunc) warm_tone_is_stale,
+                               current);
+  priv->warm_size = priv->plugin_size;
+  g_hash_table_foreach (priv->warm_tones,
+                        (GHFunc) add_warm_tone_size,
+                        sv_nd);
+
+  g_hash_table_iter_init (&iter, current);
+  while (g_hash_table_iter_next (&iter, &filename, NULL))
+    warm_tone_load (sv_nd, filename);
+
+  g_hash_table_destroy (current);
+
+  g_message ("Warm mode locked %" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT
+             " kB (plugin %" G_GSIZE_FORMAT " kB, %u sound files)",
+             priv->warm_size / 1024,
+             warm_settings.budget / 1024,
+             priv->plugin_size / 1024,
+             g_hash_table_size (priv->warm_tones));
+}
+
+static void
+profile_changed_cb (DBusGProxy             *proxy,
+                    gboolean                changed,
+                    gboolean                active,
+                    const gchar            *profile,
+                    GPtrArray              *values,
+                    HDSVNotificationDaemon *sv_nd)
+{
+  /* Only the values of the active profile are played */
+  if (active)
+    warm_tones_update (sv_nd, values);
+}
+
+static GType
+profile_values_type (void)
+{
+  return dbus_g_type_get_collection ("GPtrArray",
+                                     dbus_g_type_get_struct ("GValueArray",
+                                                             G_TYPE_STRING,
+                                                             G_TYPE_STRING,
+                                                             G_TYPE_STRING,
+                                                             G_TYPE_INVALID));
+}
+
+static void
+get_values_notify (DBusGProxy             *proxy,
+                   DBusGProxyCall         *call,
+                   HDSVNotificationDaemon *sv_nd)
+{
+  GPtrArray *values = NULL;
+  GError *error = NULL;
+
+  if (dbus_g_proxy_end_call (proxy, call, &error,
+                             profile_values_type (), &values,
+                             G_TYPE_INVALID))
+    {
+      warm_tones_update (sv_nd, values);
+      g_boxed_free (profile_values_type (), values);
+    }
+  else
+    {
+      g_warning ("%s. Could not get profile values. %s",
+                 __FUNCTION__,
+                 error->message);
+      g_error_free (error);
+
+      warm_tones_update (sv_nd, NULL);
+    }
+}
+
+static void
+start_warm_mode (HDSVNotificationDaemon *sv_nd,
+                 DBusGConnection        *connection)
+{
+  HDSVNotificationDaemonPrivate *priv = sv_nd->priv;
+
+  priv->warm_tones = g_hash_table_new_full (g_str_hash,
+                                            g_str_equal,
+                                            g_free,
+                                            (GDestroyNotify) warm_tone_free);
+
+  priv->profiled_proxy = dbus_g_proxy_new_for_name (connection,
+                                                    PROFILED_SERVICE,
+                                                    PROFILED_PATH,
+                                                    PROFILED_INTERFACE);
+
+  dbus_g_object_register_marshaller (hd_cclosure_marshal_VOID__BOOLEAN_BOOLEAN_STRING_BOXED,
+                                     G_TYPE_NONE,
+                                     G_TYPE_BOOLEAN,
+                                     G_TYPE_BOOLEAN,
+                                     G_TYPE_STRING,
+                                     profile_values_type (),
+                                     G_TYPE_INVALID);
+  dbus_g_proxy_add_signal (priv->profiled_proxy,
+                           "profile_changed",
+                           G_TYPE_BOOLEAN,
+                           G_TYPE_BOOLEAN,
+                           G_TYPE_STRING,
+                           profile_values_type (),
+                           G_TYPE_INVALID);
+  dbus_g_proxy_connect_signal (priv->profiled_proxy,
+                               "profile_changed",
+                               G_CALLBACK (profile_changed_cb),
+                               sv_nd,
+                               NULL);
+
+  /* Values of the active profile */
+  dbus_g_proxy_begin_call (priv->profiled_proxy,
+                           "get_values",
+                           (DBusGProxyCallNotify) get_values_notify,
+                           sv_nd,
+                           NULL,
+                           G_TYPE_STRING, "",
+                           G_TYPE_INVALID);
+}
+
 static void
 hd_sv_notification_daemon_init (HDSVNotificationDaemon *sv_nd)
 {
   DBusGConnection *connection;
   DBusGProxy *bus_proxy = NULL;
+  GHashTable *mapped_before = NULL;
   guint result;
   GError *error = NULL;
   HDSVNotificationDaemonPrivate *priv;
@@ -135,6 +830,9 @@ hd_sv_notification_daemon_init (HDSVNotificationDaemon *sv_nd)
   sv_nd->priv = HD_SV_NOTIFICATION_DAEMON_GET_PRIVATE (sv_nd);
   priv = sv_nd->priv;
 
+  priv->jobs = g_queue_new ();
+  priv->playing = g_hash_table_new (NULL, NULL);
+
   connection = dbus_g_bus_get (DBUS_BUS_SESSION, &error);
   if (error != NULL)
     {
@@ -178,10 +876,24 @@ hd_sv_notification_daemon_init (HDSVNotificationDaemon *sv_nd)
                                        HD_SV_NOTIFICATION_DAEMON_DBUS_PATH,
                                        G_OBJECT (sv_nd));
 
+  if (warm_settings.enabled)
+    mapped_before = get_mapped_files ();
+
   load_sv_plugin (sv_nd);
 
   if (priv->nsv_plugin_load)
-    priv->nsv_plugin_load ();
+    {
+      priv->nsv_plugin_load ();
+      priv->plugin_loaded = TRUE;
+    }
+
+  if (warm_settings.enabled)
+    {
+      lock_plugin_pages (sv_nd, mapped_before);
+      g_hash_table_destroy (mapped_before);
+
+      start_warm_mode (sv_nd, connection);
+    }
 
 cleanup:
   if (bus_proxy)
@@ -193,6 +905,32 @@ hd_sv_notification_daemon_finalize (GObject *object)
 {
   HDSVNotificationDaemonPrivate *priv = HD_SV_NOTIFICATION_DAEMON (object)->priv;
 
+  if (priv->dispatch_source)
+    priv->dispatch_source = (g_source_remove (priv->dispatch_source), 0);
+
+  g_queue_foreach (priv->jobs, (GFunc) event_job_free, NULL);
+  g_queue_free (priv->jobs);
+  g_hash_table_destroy (priv->playing);
+
+  if (priv->profiled_proxy)
+    priv->profiled_proxy = (g_object_unref (priv->profiled_proxy), NULL);
+
+  if (priv->warm_tones)
+    priv->warm_tones = (g_hash_table_destroy (priv->warm_tones), NULL);
+
+  if (priv->plugin_pages)
+    {
+      guint i;
+
+      for (i = 0; i < priv->plugin_pages->len; i++)
+        {
+          LockedRange *range = &g_array_index (priv->plugin_pages, LockedRange, i);
+
+          munlock ((gpointer) range->start, range->size);
+        }
+      priv->plugin_pages = (g_array_free (priv->plugin_pages, TRUE), NULL);
+    }
+
   if (priv->nsv_plugin_unload)
     priv->nsv_plugin_unload ();
 
@@ -222,15 +960,52 @@ hd_sv_notification_daemon_play_event (HDSVNotificationDaemon *sv_nd,
   HDSVNotificationDaemonPrivate *priv = sv_nd->priv;
   gint id = -1;
 
-  if (priv->nsv_plugin_play_event)
-    id = priv->nsv_plugin_play_event (hints,
-                                      notification_sender);
+  if (priv->plugin_loaded)
+    {
+      EventJob *job;
+
+      /* Ids are positive, -1 is returned on failure */
+      if (++priv->last_id <= 0)
+        priv->last_id = 1;
+
+      job = event_job_new (EVENT_JOB_PLAY,
+                           priv->last_id,
+                           hints,
+                           notification_sender);
 
+      if (push_event_job (sv_nd, job))
+        id = job->id;
+      else
+        event_job_free (job);
+    }
+
+  /* Return before the event is played */
   dbus_g_method_return (context, id);
 
   return TRUE;
 }
 
+static void
+stop_event (HDSVNotificationDaemon *sv_nd,
+            gint                    id)
+{
+  HDSVNotificationDaemonPrivate *priv = sv_nd->priv;
+  GList *queued;
+
+  /* Cancel the event if it is not played yet */
+  queued = g_queue_find_custom (priv->jobs,
+                                GINT_TO_POINTER (id),
+                                (GCompareFunc) compare_event_job_play_id);
+  if (queued)
+    {
+      event_job_free (queued->data);
+      g_queue_delete_link (priv->jobs, queued);
+      priv->cancelled++;
+    }
+  else
+    push_event_job (sv_nd, event_job_new (EVENT_JOB_STOP, id, NULL, NULL));
+}
+
 gboolean
 hd_sv_notification_daemon_stop_event  (HDSVNotificationDaemon *sv_nd,
                                        gint                    id,
@@ -238,21 +1013,61 @@ hd_sv_notification_daemon_stop_event  (HDSVNotificationDaemon *sv_nd,
 {
   HDSVNotificationDaemonPrivate *priv = sv_nd->priv;
 
-  if (priv->nsv_plugin_stop_event)
-    priv->nsv_plugin_stop_event (id);
+  if (priv->plugin_loaded)
+    stop_event (sv_nd, id);
 
   dbus_g_method_return (context, id);
 
   return TRUE;
 }
 
+gboolean
+hd_sv_notification_daemon_stop_events (HDSVNotificationDaemon *sv_nd,
+                                       GArray                 *ids,
+                                       DBusGMethodInvocation  *context)
+{
+  HDSVNotificationDaemonPrivate *priv = sv_nd->priv;
+
+  if (priv->plugin_loaded)
+    {
+      guint i;
+
+      for (i = 0; i < ids->len; i++)
+        stop_event (sv_nd, g_array_index (ids, gint, i));
+    }
+
+  dbus_g_method_return (context);
+
+  return TRUE;
+}
+
+gboolean
+hd_sv_notification_daemon_get_queue_stats (HDSVNotificationDaemon  *sv_nd,
+                                           guint                   *queued,
+                                           guint                   *played,
+                                           guint                   *cancelled,
+                                           guint                   *dropped,
+                                           guint                   *average_latency,
+                                           guint                   *max_latency,
+                                           GError                 **error)
+{
+  HDSVNotificationDaemonPrivate *priv = sv_nd->priv;
+
+  *queued = g_queue_get_length (priv->jobs);
+  *played = priv->played;
+  *cancelled = priv->cancelled;
+  *dropped = priv->dropped;
+  *average_latency = priv->played ? priv->latency_total / priv->played : 0;
+  *max_latency = priv->latency_max;
+
+  return TRUE;
+}
+
 static void
 mlock_process ()
 {
   uid_t ruid, euid, suid;
-#if 0
   struct rlimit rl;
-#endif
 
   if (getresuid (&ruid, &euid, &suid) != 0)
     {
@@ -263,16 +1078,15 @@ mlock_process ()
 /*  g_debug ("process running as ruid: %u, euid: %u, suid: %u",
            ruid, euid, suid);*/
 
-#if 0
-  rl.rlim_cur = MEMLOCK_LIMIT;
-  rl.rlim_max = MEMLOCK_LIMIT;
-  if (setrlimit (RLIMIT_MEMLOCK, &rl) != 0)
+  /* Raise the limit while still privileged, the plugin pages and the
+   * sound files are locked later and are kept within the budget */
+  if (warm_settings.enabled)
     {
-      g_warning ("setrlimit failed: %s, no mlock performed",
-                 g_strerror (errno));
-      return;
+      rl.rlim_cur = page_align (warm_settings.budget);
+      rl.rlim_max = page_align (warm_settings.budget);
+      if (setrlimit (RLIMIT_MEMLOCK, &rl) != 0)
+        g_warning ("setrlimit failed: %s", g_strerror (errno));
     }
-#endif
 
   if (euid != ruid &&
       setresuid (ruid, ruid, ruid) != 0)
@@ -280,17 +1094,6 @@ mlock_process ()
       g_warning ("setresuid failed: %s, process still running as %u",
                  g_strerror (errno), euid);
     }
-
-#if 0
-  if (mlockall (MCL_CURRENT | MCL_FUTURE) != 0)
-    {
-      g_warning ("mlockall failed: %s", g_strerror (errno));
-    }
-/*  else
-    {
-      g_warning ("process sucessful mlocked");
-    }*/
-#endif
 }
 
 /* Log handler which ignores debug output */
@@ -313,6 +1116,8 @@ main (int argc, char **argv)
   GMainLoop *loop;
   GObject *hd_sv_notification_daemon;
 
+  load_warm_settings ();
+
   mlock_process ();
 
   /* Ignore debug output */
@@ -61,6 +61,19 @@ gboolean               hd_sv_notification_daemon_stop_event  (HDSVNotificationDa
                                                               gint                    id,
                                                               DBusGMethodInvocation  *context);
 
+gboolean               hd_sv_notification_daemon_stop_events (HDSVNotificationDaemon *nd,
+                                                              GArray                 *ids,
+                                                              DBusGMethodInvocation  *context);
+
+gboolean               hd_sv_notification_daemon_get_queue_stats (HDSVNotificationDaemon  *nd,
+                                                                  guint                   *queued,
+                                                                  guint                   *played,
+                                                                  guint                   *cancelled,
+                                                                  guint                   *dropped,
+                                                                  guint                   *average_latency,
+                                                                  guint                   *max_latency,
+                                                                  GError                 **error);
+
 G_END_DECLS
 
 #endif
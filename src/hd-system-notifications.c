@@ -41,14 +41,192 @@
 #define HD_SYSTEM_NOTIFICATIONS_GET_PRIVATE(object) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_SYSTEM_NOTIFICATIONS, HDSystemNotificationsPrivate))
 
+/* An equal infoprint refreshes the shown one and is dropped if that one
+ * is gone already, an equal dialog is merged into the queued or shown
+ * one within this interval in ms */
+#define REPEAT_INTERVAL 3000
+
+/* Time in ms an infoprint is shown after its last repeat */
+#define INFOPRINT_TIMEOUT 3000
+
+/* Last shown infoprint or dialog with a given sender and content */
+typedef struct
+{
+  GtkWidget *widget;
+  gint64     shown_time;
+} RecentNote;
+
+/* Notifications merged into a shown dialog */
+typedef struct
+{
+  GSList *notifications;
+} MergedNotifications;
+
 struct _HDSystemNotificationsPrivate
 {
   HDNotificationManager *nm;
   GQueue                *dialog_queue;
+
+  GHashTable            *recent_notes;
 };
 
+/* Statistics for hd_system_notifications_get_stats () */
+static guint suppressed_infoprints = 0;
+static guint merged_dialogs = 0;
+
 G_DEFINE_TYPE (HDSystemNotifications, hd_system_notifications, G_TYPE_OBJECT);
 
+/* Returns the current time in milliseconds */
+static gint64
+get_time_ms (void)
+{
+  GTimeVal tv;
+
+  g_get_current_time (&tv);
+
+  return (gint64) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void
+recent_note_free (RecentNote *note)
+{
+  if (note->widget)
+    g_object_remove_weak_pointer (G_OBJECT (note->widget),
+                                  (gpointer *) &note->widget);
+
+  g_slice_free (RecentNote, note);
+}
+
+static gboolean
+recent_note_expired (const gchar *key,
+                     RecentNote  *note,
+                     gint64      *now)
+{
+  return !note->widget && *now - note->shown_time >= REPEAT_INTERVAL;
+}
+
+static gchar *
+recent_note_key (HDNotification *notification)
+{
+  const gchar *sender = hd_notification_get_sender (notification);
+  const gchar *body = hd_notification_get_body (notification);
+
+  return g_strdup_printf ("%s\n%s\n%s",
+                          hd_notification_get_category (notification),
+                          sender ? sender : "",
+                          body ? body : "");
+}
+
+/*
+ * Returns the still shown or recently shown widget for an equal
+ * notification, or registers @notification as shown.
+ */
+static RecentNote *
+lookup_recent_note (HDSystemNotifications *sn,
+                    HDNotification        *notification,
+                    gchar                **key)
+{
+  HDSystemNotificationsPrivate *priv = sn->priv;
+  gint64 now = get_time_ms ();
+
+  g_hash_table_foreach_remove (priv->recent_notes,
+                               (GHRFunc) recent_note_expired,
+                               &now);
+
+  *key = recent_note_key (notification);
+
+  return g_hash_table_lookup (priv->recent_notes, *key);
+}
+
+static void
+add_recent_note (HDSystemNotifications *sn,
+                 gchar                 *key,
+                 GtkWidget             *widget)
+{
+  RecentNote *note = g_slice_new (RecentNote);
+
+  note->widget = widget;
+  note->shown_time = get_time_ms ();
+  g_object_add_weak_pointer (G_OBJECT (widget),
+                             (gpointer *) &note->widget);
+
+  g_hash_table_replace (sn->priv->recent_notes, key, note);
+}
+
+static void
+merged_notifications_free (MergedNotifications *merged)
+{
+  g_slist_foreach (merged->notifications, (GFunc) g_object_unref, NULL);
+  g_slist_free (merged->notifications);
+
+  g_slice_free (MergedNotifications, merged);
+}
+
+/* Closes the notifications merged into @dialog, calling their default action if @activate */
+static void
+close_merged_notifications (GtkWidget *dialog,
+                            gboolean   activate)
+{
+  HDNotificationManager *nm = hd_notification_manager_get ();
+  MergedNotifications *merged;
+  GSList *list, *l;
+
+  if (!dialog)
+    return;
+
+  merged = g_object_get_data (G_OBJECT (dialog), "merged-notifications");
+  if (!merged)
+    return;
+
+  list = merged->notifications;
+  merged->notifications = NULL;
+
+  for (l = list; l; l = l->next)
+    {
+      HDNotification *notification = l->data;
+
+      if (activate)
+        hd_notification_manager_call_action (nm, notification, "default");
+      hd_notification_manager_close_notification (nm, hd_notification_get_id (notification), NULL);
+
+      g_object_unref (notification);
+    }
+
+  g_slist_free (list);
+}
+
+static void
+remove_infoprint_timeout (gpointer timeout_id)
+{
+  g_source_remove (GPOINTER_TO_UINT (timeout_id));
+}
+
+static gboolean
+infoprint_timeout (GtkWidget *banner)
+{
+  g_object_steal_data (G_OBJECT (banner), "infoprint-timeout");
+  gtk_widget_destroy (banner);
+
+  return FALSE;
+}
+
+/* (Re)starts the timeout after which @banner is destroyed */
+static void
+restart_infoprint_timeout (GtkWidget *banner)
+{
+  guint timeout_id;
+
+  timeout_id = gdk_threads_add_timeout (INFOPRINT_TIMEOUT,
+                                        (GSourceFunc) infoprint_timeout,
+                                        banner);
+
+  /* Replacing the data removes the previous timeout */
+  g_object_set_data_full (G_OBJECT (banner),
+                          "infoprint-timeout",
+                          GUINT_TO_POINTER (timeout_id),
+                          remove_infoprint_timeout);
+}
+
 static GtkWidget *
 create_note_infoprint (const gchar *summary, 
                        const gchar *body, 
@@ -60,6 +238,11 @@ create_note_infoprint (const gchar *summary,
                                                        icon_name,
                                                        body);
 
+  /* HildonBanner starts its own timeout on the map event, which is
+   * not delivered yet. It cannot be restarted, so use our own. */
+  hildon_banner_set_timeout (HILDON_BANNER (banner), 0);
+  restart_infoprint_timeout (banner);
+
   return banner;
 }
 
@@ -83,6 +266,8 @@ system_notification_dialog_response (GtkWidget      *widget,
 {
   HDNotificationManager *nm = hd_notification_manager_get ();
 
+  close_merged_notifications (widget, TRUE);
+
   hd_notification_manager_call_action (nm, notification, "default");
   hd_notification_manager_close_notification (nm, hd_notification_get_id (notification), NULL);
 }
@@ -164,6 +349,7 @@ dialog_notification_closed (HDNotification               *notification,
                             DialogNotificationClosedData *data)
 {
   g_queue_remove_all (data->queue, data->dialog);
+  close_merged_notifications (data->dialog, FALSE);
   gtk_widget_destroy (data->dialog);
 }
 
@@ -175,6 +361,8 @@ system_notifications_notified (HDNotificationManager *nm,
 {
   GtkWidget *dialog = NULL;
   const gchar *category;
+  RecentNote *recent;
+  gchar *key;
 
   g_return_if_fail (HD_IS_SYSTEM_NOTIFICATIONS (sn));
 
@@ -184,6 +372,31 @@ system_notifications_notified (HDNotificationManager *nm,
   if (category && g_str_equal (category, "system.note.infoprint"))
     {
       g_return_if_fail (!replayed_event);
+
+      /* An equal banner which is still shown is updated and stays
+       * visible for the full time again, instead of stacking. Without
+       * banner the repeat is dropped until the interval is over. */
+      recent = lookup_recent_note (sn, notification, &key);
+      if (recent)
+        {
+          suppressed_infoprints++;
+          g_debug ("%s. Suppressed repeated infoprint %s, %u suppressed so far",
+                   __FUNCTION__,
+                   hd_notification_get_body (notification),
+                   suppressed_infoprints);
+
+          if (recent->widget)
+            {
+              hildon_banner_set_markup (HILDON_BANNER (recent->widget),
+                                        hd_notification_get_body (notification));
+              restart_infoprint_timeout (recent->widget);
+            }
+
+          recent->shown_time = get_time_ms ();
+          g_free (key);
+          return;
+        }
+
       dialog = create_note_infoprint (hd_notification_get_summary (notification),
                                       hd_notification_get_body (notification), 
                                       hd_notification_get_icon (notification));
@@ -192,6 +405,8 @@ system_notifications_notified (HDNotificationManager *nm,
                                G_CALLBACK (gtk_widget_destroy), dialog,
                                G_CONNECT_SWAPPED);
 
+      add_recent_note (sn, key, dialog);
+
       gtk_widget_show_all (dialog);
     }
   else if (category && g_str_equal (category, "system.note.dialog")) 
@@ -199,6 +414,29 @@ system_notifications_notified (HDNotificationManager *nm,
       DialogNotificationClosedData *data;
 
       g_return_if_fail (!replayed_event);
+
+      /* Merge into an equal dialog which is still queued or shown,
+       * an answered one is not answered again on the user's behalf */
+      recent = lookup_recent_note (sn, notification, &key);
+      if (recent && recent->widget)
+        {
+          MergedNotifications *merged;
+
+          merged_dialogs++;
+          g_debug ("%s. Merged repeated dialog %s, %u merged so far",
+                   __FUNCTION__,
+                   hd_notification_get_body (notification),
+                   merged_dialogs);
+
+          merged = g_object_get_data (G_OBJECT (recent->widget),
+                                      "merged-notifications");
+          merged->notifications = g_slist_prepend (merged->notifications,
+                                                   g_object_ref (notification));
+
+          g_free (key);
+          return;
+        }
+
       dialog = create_note_dialog (hd_notification_get_summary (notification),
                                    hd_notification_get_body (notification), 
                                    hd_notification_get_icon (notification), 
@@ -215,6 +453,12 @@ system_notifications_notified (HDNotificationManager *nm,
                                 G_CALLBACK (show_next_system_dialog),
                                 sn);
 
+      g_object_set_data_full (G_OBJECT (dialog),
+                              "merged-notifications",
+                              g_slice_new0 (MergedNotifications),
+                              (GDestroyNotify) merged_notifications_free);
+      add_recent_note (sn, key, dialog);
+
       data = g_new (DialogNotificationClosedData, 1);
       data->queue = sn->priv->dialog_queue;
       data->dialog = dialog;
@@ -251,6 +495,9 @@ hd_system_notifications_dispose (GObject *object)
       priv->dialog_queue = (g_queue_free (priv->dialog_queue), NULL);
     }
 
+  if (priv->recent_notes)
+    priv->recent_notes = (g_hash_table_destroy (priv->recent_notes), NULL);
+
   G_OBJECT_CLASS (hd_system_notifications_parent_class)->dispose (object);
 }
 
@@ -270,6 +517,10 @@ hd_system_notifications_init (HDSystemNotifications *sn)
   sn->priv = HD_SYSTEM_NOTIFICATIONS_GET_PRIVATE (sn);
 
   sn->priv->dialog_queue = g_queue_new ();
+  sn->priv->recent_notes = g_hash_table_new_full (g_str_hash,
+                                                  g_str_equal,
+                                                  g_free,
+                                                  (GDestroyNotify) recent_note_free);
 }
 
 HDSystemNotifications *
@@ -283,3 +534,21 @@ hd_system_notifications_get ()
 
   return sn;
 }
+
+/**
+ * hd_system_notifications_get_stats:
+ * @infoprints: return location for the number of suppressed repeated infoprints, or %NULL
+ * @dialogs: return location for the number of dialogs merged into an equal dialog, or %NULL
+ *
+ * Returns the number of repeated system notes which were not shown on
+ * their own since startup.
+ */
+void
+hd_system_notifications_get_stats (guint *infoprints,
+                                   guint *dialogs)
+{
+  if (infoprints)
+    *infoprints = suppressed_infoprints;
+  if (dialogs)
+    *dialogs = merged_dialogs;
+}
@@ -54,6 +54,9 @@ GType                  hd_system_notifications_get_type (void);
 
 HDSystemNotifications *hd_system_notifications_get      (void);
 
+void                   hd_system_notifications_get_stats (guint *infoprints,
+                                                          guint *dialogs);
+
 G_END_DECLS
 
 #endif
@@ -240,6 +240,39 @@ hd_task_shortcut_show (GtkWidget *widget)
   g_free (desktop_id);
 }
 
+/* Takes the theme images from the surface cache */
+static void
+load_theme_images (HDTaskShortcut *applet)
+{
+  HDTaskShortcutPrivate *priv = applet->priv;
+
+  if (priv->bg_image)
+    cairo_surface_destroy (priv->bg_image);
+  if (priv->bg_active)
+    cairo_surface_destroy (priv->bg_active);
+
+  priv->bg_image = hd_cairo_surface_cache_get_surface (hd_cairo_surface_cache_get (),
+                                                       BACKGROUND_IMAGE_FILE);
+  priv->bg_active = hd_cairo_surface_cache_get_surface (hd_cairo_surface_cache_get (),
+                                                        BACKGROUND_ACTIVE_IMAGE_FILE);
+}
+
+static void
+hd_task_shortcut_style_set (GtkWidget *widget,
+                            GtkStyle  *previous_style)
+{
+  /* The theme changed */
+  if (previous_style)
+    {
+      load_theme_images (HD_TASK_SHORTCUT (widget));
+      gtk_widget_queue_draw (widget);
+    }
+
+  if (GTK_WIDGET_CLASS (hd_task_shortcut_parent_class)->style_set)
+    GTK_WIDGET_CLASS (hd_task_shortcut_parent_class)->style_set (widget,
+                                                                 previous_style);
+}
+
 static void
 hd_task_shortcut_class_init (HDTaskShortcutClass *klass)
 {
@@ -256,6 +289,7 @@ hd_task_shortcut_class_init (HDTaskShortcutClass *klass)
   widget_class->realize = hd_task_shortcut_realize;
   widget_class->expose_event = hd_task_shortcut_expose_event;
   widget_class->show = hd_task_shortcut_show;
+  widget_class->style_set = hd_task_shortcut_style_set;
 
   g_type_class_add_private (klass, sizeof (HDTaskShortcutPrivate));
 }
@@ -354,8 +388,5 @@ hd_task_shortcut_init (HDTaskShortcut *applet)
 
   gtk_widget_set_size_request (GTK_WIDGET (applet), SHORTCUT_WIDTH, SHORTCUT_HEIGHT);
 
-  priv->bg_image = hd_cairo_surface_cache_get_surface (hd_cairo_surface_cache_get (),
-                                                       BACKGROUND_IMAGE_FILE);
-  priv->bg_active = hd_cairo_surface_cache_get_surface (hd_cairo_surface_cache_get (),
-                                                        BACKGROUND_ACTIVE_IMAGE_FILE);
+  load_theme_images (applet);
 }
@@ -50,11 +50,22 @@ const static TimeDiffInfo entries[] = {
   { YEAR, -1, "wdgt_va_ago_one_year", "wdgt_va_ago_years" }
 };
 
+/* Formatted texts by unit and count. There is only a few hundred
+ * different texts for realistic differences, so it is never pruned. */
+static GHashTable *text_cache = NULL;
+
+static inline time_t
+get_diff_in_unit_for_info (const TimeDiffInfo *info,
+                           time_t              difference)
+{
+  return (difference + (info->unit / 2)) / info->unit;
+}
+
 static inline gchar *
 get_time_diff_text_for_info (const TimeDiffInfo *info,
                              time_t              difference)
 {
-  time_t diff_in_unit = (difference + (info->unit / 2)) / info->unit;
+  time_t diff_in_unit = get_diff_in_unit_for_info (info, difference);
 
   return g_strdup_printf (dngettext ("hildon-libs",
                                      info->message_id,
@@ -104,6 +115,47 @@ hd_time_difference_get_text (time_t difference)
     return NULL;
 }
 
+/**
+ * hd_time_difference_get_cached_text:
+ * @difference: time difference in seconds
+ *
+ * Like hd_time_difference_get_text() but the returned string is owned
+ * by a cache and must not be freed. The same pointer is returned for all
+ * differences which are displayed with the same text.
+ *
+ * Returns: the text or %NULL if no time should be displayed
+ */
+const char *
+hd_time_difference_get_cached_text (time_t difference)
+{
+  const TimeDiffInfo *info;
+  gpointer key;
+  gchar *text;
+
+  info = get_time_diff_info_for_difference (difference);
+
+  if (!info)
+    return NULL;
+
+  if (G_UNLIKELY (!text_cache))
+    text_cache = g_hash_table_new_full (g_direct_hash,
+                                        g_direct_equal,
+                                        NULL,
+                                        g_free);
+
+  key = GSIZE_TO_POINTER (get_diff_in_unit_for_info (info, difference) * G_N_ELEMENTS (entries)
+                          + (info - entries));
+
+  text = g_hash_table_lookup (text_cache, key);
+  if (!text)
+    {
+      text = get_time_diff_text_for_info (info, difference);
+      g_hash_table_insert (text_cache, key, text);
+    }
+
+  return text;
+}
+
 static inline time_t
 get_timeout_for_info (const TimeDiffInfo *info,
                       time_t              difference)
@@ -167,6 +219,13 @@ test_time_difference (gconstpointer test_data)
 
   g_assert_cmpstr (text, ==, data->expected_text);
   g_assert_cmpint (timeout, ==, data->expected_timeout);
+
+  /* Cached text is equal and stays the same until the timeout */
+  g_assert_cmpstr (hd_time_difference_get_cached_text (difference), ==, data->expected_text);
+  g_assert (hd_time_difference_get_cached_text (difference) ==
+            hd_time_difference_get_cached_text (difference + timeout - 1));
+
+  g_free (text);
 }
 
 int main (int argc, char **argv)
@@ -25,8 +25,9 @@
 
 G_BEGIN_DECLS
 
-char   *hd_time_difference_get_text (time_t difference);
-time_t  hd_time_difference_get_timeout (time_t difference);
+char       *hd_time_difference_get_text (time_t difference);
+const char *hd_time_difference_get_cached_text (time_t difference);
+time_t      hd_time_difference_get_timeout (time_t difference);
 
 G_END_DECLS
 
@@ -126,10 +126,12 @@ hd_wallpaper_background_set_for_current_view (HDBackground   *background,
   data = command_data_new (priv->file,
                            cancellable);
 
+  /* The wallpaper is cut into all views */
   hd_backgrounds_add_create_cached_image (hd_backgrounds_get (),
+                                          -1,
                                           priv->file,
                                           error_dialogs,
-                                          cancellable,
+                                          data->cancellable,
                                           (HDCommandCallback) create_cached_image_command,
                                           data,
                                           (GDestroyNotify) command_data_free);
@@ -323,7 +325,7 @@ command_data_new  (GFile        *file,
   CommandData *data = g_slice_new0 (CommandData);
 
   data->file = g_object_ref (file);
-  data->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  data->cancellable = hd_backgrounds_job_cancellable_new (cancellable);
 
   return data;
 }
@@ -37,9 +37,14 @@
 #include <stdlib.h>
 
 #include "hd-backgrounds.h"
+#include "hd-cairo-surface-cache.h"
 #include "hd-notification-manager.h"
+#include "hd-notification-latency.h"
+#include "hd-notification-trace.h"
 #include "hd-system-notifications.h"
 #include "hd-incoming-events.h"
+#include "hd-incoming-event-window.h"
+#include "hd-led-pattern.h"
 #include "hd-bookmark-widgets.h"
 #include "hd-bookmark-shortcut.h"
 #include "hd-shortcut-widgets.h"
@@ -61,9 +66,19 @@ HDShortcuts *hd_shortcuts_task_shortcuts;
 static HDShortcuts *hd_shortcuts_bookmarks;
 
 static gboolean enable_debug = FALSE;
+static gchar *record_notifications = NULL;
+static gchar *replay_notifications = NULL;
+static gboolean replay_max_speed = FALSE;
+static gboolean replay_headless = FALSE;
+static gchar *trace_latency = NULL;
 static GOptionEntry entries[] =
 {
   { "enable-debug", 'd', 0, G_OPTION_ARG_NONE, &enable_debug, "Enable debug output", NULL },
+  { "record-notifications", 0, 0, G_OPTION_ARG_FILENAME, &record_notifications, "Record notification traffic to FILE", "FILE" },
+  { "replay-notifications", 0, 0, G_OPTION_ARG_FILENAME, &replay_notifications, "Replay the notification trace FILE", "FILE" },
+  { "replay-max-speed", 0, 0, G_OPTION_ARG_NONE, &replay_max_speed, "Replay the notification trace as fast as possible", NULL },
+  { "replay-headless", 0, 0, G_OPTION_ARG_NONE, &replay_headless, "Replay the notification trace without desktop and mapped windows, then exit", NULL },
+  { "trace-latency", 0, 0, G_OPTION_ARG_FILENAME, &trace_latency, "Write the stage times of each notification to FILE", "FILE" },
   { NULL }
 };
 
@@ -297,10 +312,33 @@ done: /* Final clean up. */
   return FALSE;
 }
 
+/* Theme images are reloaded by the widgets when GTK+ restyles them */
 static GdkFilterReturn
-dont_reread_rcfiles (GdkXEvent *xevent, GdkEvent *event, gpointer data)
+reread_rcfiles (GdkXEvent *xevent, GdkEvent *event, gpointer data)
 {
-  return GDK_FILTER_REMOVE;
+  hd_cairo_surface_cache_clear (hd_cairo_surface_cache_get ());
+
+  return GDK_FILTER_CONTINUE;
+}
+
+static gboolean
+start_replay (gpointer data)
+{
+  GError *error = NULL;
+
+  if (!hd_notification_trace_replay (replay_notifications,
+                                     replay_max_speed,
+                                     replay_headless,
+                                     &error))
+    {
+      g_warning ("Could not replay notifications. %s", error->message);
+      g_error_free (error);
+
+      if (replay_headless)
+        gtk_main_quit ();
+    }
+
+  return FALSE;
 }
 
 int
@@ -338,6 +376,29 @@ main (int argc, char **argv)
   signal (SIGINT,  signal_handler);
   signal (SIGTERM, signal_handler);
 
+  /* Only the notification pipeline is needed to replay a trace. The
+   * incoming event windows are stubbed and system notes are not shown,
+   * so it runs without window manager off the device too. It stays off
+   * the buses, MCE, the LED and the sound/vibra daemon, so it does not
+   * disturb a running hildon-home. */
+  if (replay_notifications && replay_headless)
+    {
+      hd_incoming_event_window_set_stubbed (TRUE);
+      hd_led_pattern_set_stubbed (TRUE);
+      hd_notification_manager_set_headless (TRUE);
+      hd_incoming_events_set_headless (TRUE);
+
+      hd_notification_manager_get ();
+      hd_incoming_events_get ();
+
+      gdk_threads_add_idle_full (G_PRIORITY_LOW, start_replay, NULL, NULL);
+      gtk_main ();
+
+      g_object_unref (hd_notification_manager_get ());
+
+      return 0;
+    }
+
   /* May do waitidle if we're started the first time since boot
    * and not from the terminal. */
   conf = NULL;
@@ -372,6 +433,21 @@ main (int argc, char **argv)
   hd_incoming_events_get ();
   hd_notification_manager_db_load (hd_notification_manager_get ());
 
+  if (record_notifications &&
+      !hd_notification_trace_start_recording (record_notifications, &error))
+    {
+      g_warning ("%s", error->message);
+      g_clear_error (&error);
+    }
+  if (trace_latency &&
+      !hd_notification_latency_start_trace (trace_latency, &error))
+    {
+      g_warning ("%s", error->message);
+      g_clear_error (&error);
+    }
+  if (replay_notifications)
+    gdk_threads_add_idle_full (G_PRIORITY_LOW, start_replay, NULL, NULL);
+
   /* Add shortcuts gconf dirs so hildon-home gets notifications about changes */
   client = gconf_client_get_default ();
   gconf_client_add_dir (client,
@@ -406,11 +482,10 @@ main (int argc, char **argv)
   /* D-Bus */
   hd_hildon_home_dbus_get ();
 
-  /* Don't bother re-styling widgets because we're restarted if the
-   * theme changes anyway. */
+  /* Theme changes are applied in place by re-styling the widgets */
   gdk_add_client_message_filter (
                     gdk_atom_intern_static_string ("_GTK_READ_RCFILES"),
-                    dont_reread_rcfiles, NULL);
+                    reread_rcfiles, NULL);
 
   /* Start the main loop */
   if (conf)
@@ -419,6 +494,9 @@ main (int argc, char **argv)
   
   g_rename (HD_HOME_STAMP_FILE, HD_HOME_STAMP_FILE".sav");
 
+  hd_notification_trace_stop_recording ();
+  hd_notification_latency_stop_trace ();
+
   /* We got a signal, flush the database.  How we do it breaks
    * if somebody has taken reference of the nm, but we don't. */
   g_object_unref (hd_notification_manager_get ());